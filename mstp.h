@@ -79,6 +79,7 @@ typedef unsigned char UINT8;
 #define		maxrx				512				//max chars in rx buffer (NPDU size)
 #define		maxtx				512				//max chars transmitted
 #define		INPUT_BUFFER_SIZE	maxrx
+#define		MSTP_MAX_DATA		501				//octets of data write() may send
 #define maxrcvqsize			(INPUT_BUFFER_SIZE*4)		//circular receive queue size
 
 //status flags
@@ -91,6 +92,46 @@ typedef unsigned char UINT8;
 
 #define MSTP_BROADCAST_ADDRESS 		0xFF
 
+///////////////////////////////////////////////////////////////////////
+//	MS/TP constant values, those in struct mstp_timing are the defaults
+//	of every port, MSTP_IOC_SETTIMING changes them
+
+#define Npolldefault                                                           \
+  50 // number of tokens received or used before Poll for Manager (fixed)
+#define Nretrytoken 1     // number of retries on sending the token (fixed)
+#define Nminoctets 4      // number of "events (octets) for active line (fixed)
+#define Tframeabort 100   //(60 bit times) 100 ms max (fixed)
+#define Tframegap 20      //(20 bit times) (fixed)
+#define Tnotoken 500      // silence time for loss of token (fixed)
+#define Tpostdrive 15     //(15 bit times) (fixed)
+#define Treplydelay 200   // 200 ms (fixed) the lower the better!		***223
+#define Treplytimeout 300 // 300 ms (fixed)
+#define Tslotdefault 10   // 10 ms (fixed)
+#define Ttick 1000        // us between runs of the MNSM
+
+#define MSTP_HDR_LEN 8 /* preamble, header and HeaderCRC */
+#define MSTP_WIRE_SIZE (MSTP_HDR_LEN + INPUT_BUFFER_SIZE + 3) /* +CRC+pad */
+
+/* this structure stores what goes to the upper layers */
+struct mstp_data_t {
+  void *next;
+  int count;                 /* how much data?			*/
+  int wirelen;               /* send queue: octets in data		*/
+  unsigned char SourceAddress;
+  unsigned char DestinationAddress;
+  unsigned char FrameType;
+  unsigned char sclass;      /* size class, see alloc_entry		*/
+  unsigned char prio;        /* MSTP_RXF_PRIORITY, see Q_PushPrio	*/
+  unsigned char own_sa;      /* from This_Station, see mstpHoldService */
+  unsigned int queued_at;    /* mstpPortClock() when write() took it	*/
+  unsigned int ttl;          /* ms after queued_at nobody wants it, 0 */
+  unsigned char report;      /* owes a struct mstp_txreport		*/
+  unsigned long long cookie; /* for it, see mstpQueueFrame		*/
+  unsigned long long queued_ns; /* mstpPortTime() when write() took it	*/
+  unsigned char data[];      /* Here's the data! The send queue keeps
+                                the whole frame here, wirelen long	*/
+};
+
 typedef struct _mstpFrame {
 	struct _mstpFrame  *next;
 	word	plen;						//transmit length
@@ -137,18 +178,130 @@ typedef struct _mstpFrame {
 #define mnsmPollForManager				7
 #define mnsmAnswerDataRequest			8
 
+//Manager Node State Machine transitions, named as in clause 9.5.6
+#define mtNone							0
+#define mtDoneInitializing				1
+//Idle
+#define mtLostToken						2
+#define mtReceivedInvalidFrame			3
+#define mtReceivedUnwantedFrame			4
+#define mtReceivedToken					5
+#define mtReceivedPFM					6
+#define mtReceivedDataNeedingReply		7
+#define mtReceivedTestRequest			8
+#define mtReceivedDataNoReply			9
+#define mtBroadcastDataNeedingReply		10
+//UseToken
+#define mtNothingToSend					11
+#define mtSendNoWait					12
+#define mtSendAndWait					13
+#define mtUnknownFrameType				14
+#define mtSkipDeadStation				15	//not in the standard
+//WaitForReply
+#define mtReplyTimeout					16
+#define mtInvalidFrame					17
+#define mtReceivedReply					18
+#define mtReceivedPostpone				19
+#define mtReceivedUnexpectedFrame		20
+//DoneWithToken
+#define mtSendAnotherFrame				21
+#define mtNextStationUnknown			22
+#define mtSoleManager					23
+#define mtSoleManagerForcePFM			24	//not in the standard
+#define mtSendToken						25
+#define mtSendMaintenancePFM			26
+#define mtResetMaintenancePFM			27
+#define mtSoleManagerRestartMaintenancePFM	28
+//PassToken
+#define mtSawTokenUser					29
+#define mtRetrySendToken				30
+#define mtFindNewSuccessor				31
+#define mtFindNewSuccessorUnknown		32
+//NoToken
+#define mtSawFrame						33
+#define mtSawInvalidFrame				34	//not in the standard
+#define mtGenerateToken					35
+#define mtMissedSlot					36	//not in the standard
+//PollForManager
+#define mtReceivedReplyToPFM			37
+#define mtPFMReceivedUnexpectedFrame	38
+#define mtPFMSoleManager				39
+#define mtSawOtherTransmitter			40	//not in the standard
+#define mtDoneWithPFM					41
+#define mtSendNextPFM					42
+#define mtDeclareSoleManager			43
+//AnswerDataRequest
+#define mtDeferredReply					44
+//DoneWithToken
+#define mtPollLostStation				45	//not in the standard
+//UseToken
+#define mtSkipExpiredFrame				46	//not in the standard
+#define nMNSMTransitions				47
+
 #ifdef __cplusplus
 extern "C" {            /* Assume C declarations for C++ */
 #endif /* __cplusplus */
 
+struct mstp_port;
+
+struct mstp_transition {
+	byte state;				//the mnsm* state it leaves
+	const char *name;
+	};
+
+extern const struct mstp_transition mstpTransitions[nMNSMTransitions];
+
 //------------------------------------------------------------------------
-//Functions provided by MSTP.C:
-void mstpVarInit(byte port,int turnaround);							//				***206 Begin
-void mstpReset(byte);
-void mstpTimerCallback(void);
+//Functions provided by MSTPCORE.C:
+int mstpCoreInit(void);
+void mstpCoreExit(void);
+void mstpPortInit(struct mstp_port *port);
+void mstpVarInit(struct mstp_port *port, int turnaround);		//				***206 Begin
+void mstpReset(struct mstp_port *port);
+int mstpSetBaud(struct mstp_port *port, int baud);
+void mstpSetStation(struct mstp_port *port, byte mac);
+void mstpPeerReset(struct mstp_port *port);
+void mstpRingMap(struct mstp_port *port, struct mstp_ring *r);
+int mstpUsageTimeout(struct mstp_port *port, byte station, int limit);
+int mstpSetTiming(struct mstp_port *port, const struct mstp_timing *t);
+struct mstp_txreport;
+bool mstpTxrPop(struct mstp_port *port, struct mstp_txreport *r);
+struct mstp_token_info;
+void mstpTokenInfo(struct mstp_port *port, struct mstp_token_info *ti);
+struct mstp_warm;
+void mstpWarmSave(struct mstp_port *port, struct mstp_warm *w);
+bool mstpWarmRestore(struct mstp_port *port, const struct mstp_warm *w,
+                     unsigned int max_age);
+int mstpSetRxFilter(struct mstp_port *port, const struct mstp_rx_filter *f);
+void mstpGetRxFilter(struct mstp_port *port, struct mstp_rx_filter *f);
+void mstpServiceMNSM(struct mstp_port *port);
+void mstpFlushFrameEvents(struct mstp_port *port);
+void mstpReceiveOctets(struct mstp_port *port, const unsigned char *cp,
+                       const char *fp, int count);
+int mstpQueueFrame(struct mstp_port *port, const unsigned char *buf,
+                   size_t nr);
+void SendFrame(struct mstp_port *port, byte SendFrameType, byte destination,
+               byte src, byte *data, unsigned data_len);
+void SendQueuedFrame(struct mstp_port *port, struct mstp_data_t *f);
+int mstpBuildFrame(byte *buf, byte type, byte da, byte sa, const byte *data,
+                   unsigned data_len);
+void mstpBuildTemplates(struct mstp_port *port);
+int CalcTXTime(struct mstp_port *port, word n);
+byte CalcHeaderCRC(byte dv, byte cv);
+word CalcDataCRC(byte dv, word cv);
 
 //------------------------------------------------------------------------
-//Functions BACnet Stack must provide for MSTP.C to call:
+//Functions the environment must provide for MSTPCORE.C to call
+//(mstpmain.c in the kernel, the tools/ programs in user space):
+int mstpPortReadSilence(struct mstp_port *port);
+void mstpPortResetSilence(struct mstp_port *port);
+void mstpPortSetSilence(struct mstp_port *port, int val);
+int mstpPortTransmitComplete(struct mstp_port *port);
+void mstpPortTurnaround(struct mstp_port *port);	//wait Tturnaround before driving the line
+int mstpPortSend(struct mstp_port *port, const byte *buf, int len);	//<0 if there is no backend
+unsigned int mstpPortClock(struct mstp_port *port);	//milliseconds, any origin, may wrap
+unsigned long long mstpPortTime(struct mstp_port *port);	//nanoseconds, for struct mstp_txreport
+void mstpPortTokenEvent(struct mstp_port *port);	//tok_state changed, with tok_notify
 
 #ifdef __cplusplus
 }
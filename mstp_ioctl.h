@@ -48,9 +48,210 @@ SOFTWARE.
 #define MSTP_IOC_GETTUSAGE			_IOR(MSTP_IOC_MAGIC,0xC7,unsigned)
 #define MSTP_IOC_GETVER				_IOR(MSTP_IOC_MAGIC,0xC8,unsigned)
 #define MSTP_IOC_GETONLINE			_IOR(MSTP_IOC_MAGIC,0xC9,unsigned)
+#define MSTP_IOC_SETRXFRAMES		_IOW(MSTP_IOC_MAGIC,0xCA,unsigned)
+#define MSTP_IOC_SETRXBYTES			_IOW(MSTP_IOC_MAGIC,0xCB,unsigned)
+#define MSTP_IOC_SETRXPOLICY		_IOW(MSTP_IOC_MAGIC,0xCC,unsigned)
+#define MSTP_IOC_GETRXFRAMES		_IOR(MSTP_IOC_MAGIC,0xCD,unsigned)
+#define MSTP_IOC_GETRXBYTES			_IOR(MSTP_IOC_MAGIC,0xCE,unsigned)
+#define MSTP_IOC_GETRXPOLICY		_IOR(MSTP_IOC_MAGIC,0xCF,unsigned)
+#define MSTP_IOC_SETPEERTIMEOUTS	_IOW(MSTP_IOC_MAGIC,0xD0,unsigned)
+#define MSTP_IOC_SETPEERPROBE		_IOW(MSTP_IOC_MAGIC,0xD1,unsigned)
+#define MSTP_IOC_GETPEERTIMEOUTS	_IOR(MSTP_IOC_MAGIC,0xD2,unsigned)
+#define MSTP_IOC_GETPEERPROBE		_IOR(MSTP_IOC_MAGIC,0xD3,unsigned)
+#define MSTP_IOC_GETPEERSTATE		_IOR(MSTP_IOC_MAGIC,0xD4,unsigned)
+#define MSTP_IOC_GETPEEREVENTS		_IOR(MSTP_IOC_MAGIC,0xD5,unsigned)
+#define MSTP_IOC_SETTXSCHED			_IOW(MSTP_IOC_MAGIC,0xD6,unsigned)
+#define MSTP_IOC_GETTXSCHED			_IOR(MSTP_IOC_MAGIC,0xD7,unsigned)
+#define MSTP_IOC_SETRXFILTER		_IOW(MSTP_IOC_MAGIC,0xD8,struct mstp_rx_filter)
+#define MSTP_IOC_GETRXFILTER		_IOR(MSTP_IOC_MAGIC,0xD9,struct mstp_rx_filter)
+#define MSTP_IOC_GETRXFCOUNT		_IOR(MSTP_IOC_MAGIC,0xDA,unsigned)
+#define MSTP_IOC_GETRING			_IOR(MSTP_IOC_MAGIC,0xDB,struct mstp_ring)
+#define MSTP_IOC_SETRINGTUNE		_IOW(MSTP_IOC_MAGIC,0xDC,unsigned)
+#define MSTP_IOC_GETRINGTUNE		_IOR(MSTP_IOC_MAGIC,0xDD,unsigned)
+#define MSTP_IOC_SETUSAGEADAPT		_IOW(MSTP_IOC_MAGIC,0xDE,unsigned)
+#define MSTP_IOC_GETUSAGEADAPT		_IOR(MSTP_IOC_MAGIC,0xDF,unsigned)
+#define MSTP_IOC_GETUSAGEPEER		_IOR(MSTP_IOC_MAGIC,0xE0,unsigned)
+#define MSTP_IOC_SETTIMING			_IOW(MSTP_IOC_MAGIC,0xE1,struct mstp_timing)
+#define MSTP_IOC_GETTIMING			_IOR(MSTP_IOC_MAGIC,0xE2,struct mstp_timing)
+#define MSTP_IOC_SETHOLDFRAMES		_IOW(MSTP_IOC_MAGIC,0xE3,unsigned)
+#define MSTP_IOC_SETHOLDAGE			_IOW(MSTP_IOC_MAGIC,0xE4,unsigned)
+#define MSTP_IOC_GETHOLDFRAMES		_IOR(MSTP_IOC_MAGIC,0xE5,unsigned)
+#define MSTP_IOC_GETHOLDAGE			_IOR(MSTP_IOC_MAGIC,0xE6,unsigned)
+#define MSTP_IOC_GETJOINTIME		_IOR(MSTP_IOC_MAGIC,0xE7,unsigned)
+#define MSTP_IOC_SETTXREPORT		_IOW(MSTP_IOC_MAGIC,0xE8,unsigned)
+#define MSTP_IOC_GETTXREPORT		_IOR(MSTP_IOC_MAGIC,0xE9,struct mstp_txreport)
+#define MSTP_IOC_SETTXTTL			_IOW(MSTP_IOC_MAGIC,0xEA,unsigned)
+#define MSTP_IOC_GETTXTTL			_IOR(MSTP_IOC_MAGIC,0xEB,unsigned)
+#define MSTP_IOC_SETTOKNOTIFY		_IOW(MSTP_IOC_MAGIC,0xEC,unsigned)
+#define MSTP_IOC_SETTOKLEAD			_IOW(MSTP_IOC_MAGIC,0xED,unsigned)
+#define MSTP_IOC_GETTOKEN			_IOR(MSTP_IOC_MAGIC,0xEE,struct mstp_token_info)
 
 #define MSTP_MIN_NR 0xC0
-#define MSTP_MAX_NR 0xC9
+#define MSTP_MAX_NR 0xEE
+
+/* MSTP_IOC_SETRXPOLICY, what happens to a received frame that doesn't fit
+ * in the receive queue (MSTP_IOC_SETRXFRAMES/SETRXBYTES, 0 is no limit) */
+#define MSTP_RXQ_DROP_NEWEST	0	//the new frame is dropped
+#define MSTP_RXQ_DROP_OLDEST	1	//the oldest frames make room for it
+#define MSTP_RXQ_FAIR			2	//the source with the most frames queued loses its oldest
+
+/* MSTP_IOC_GETPEERSTATE, arg is the station.  A station is dead after
+ * MSTP_IOC_SETPEERTIMEOUTS reply timeouts in a row (0 turns this off) or
+ * when it stops using the token; write() then fails requests to it with
+ * EHOSTUNREACH, except for one every MSTP_IOC_SETPEERPROBE ms.
+ * MSTP_IOC_GETPEEREVENTS counts stations going dead or coming back. */
+#define MSTP_PEER_ALIVE			0
+#define MSTP_PEER_DEAD			1
+
+/* MSTP_IOC_SETTXSCHED, the order frames leave send_queue in one token visit */
+#define MSTP_TXS_FIFO			0	//as written
+#define MSTP_TXS_NOWAIT_FIRST	1	//frames needing no reply, then the quickest peers
+
+/* MSTP_IOC_SETRXFILTER, what happens to a data frame for us or broadcast
+ * before it is queued for read().  The first rule that matches gives the
+ * verdict, dflt if none does.  MSTP_IOC_GETRXFCOUNT, arg is a verdict,
+ * counts the frames that got it. */
+#define MSTP_RXF_ACCEPT			0
+#define MSTP_RXF_DROP			1	//not queued, the MNSM still sees it
+#define MSTP_RXF_PRIORITY		2	//queued ahead of everything accepted
+#define MSTP_RXF_VERDICTS		3
+
+#define MSTP_RXF_RULES			16
+#define MSTP_RXF_ANY			0xFF	//source, any station
+#define MSTP_RXF_TO_US			1	//addressing bits, 0 is either
+#define MSTP_RXF_BROADCAST		2
+
+struct mstp_rxf_rule {
+	unsigned short types;		//bit per FrameType, 0 any
+	unsigned char addressing;	//MSTP_RXF_TO_US | MSTP_RXF_BROADCAST
+	unsigned char source;		//MSTP_RXF_ANY or a station
+	unsigned short offset;		//first NPDU octet compared
+	unsigned char len;			//octets compared, 0..4, shorter frames don't match
+	unsigned char verdict;		//MSTP_RXF_*
+	unsigned char mask[4];		//(octet & mask) == value
+	unsigned char value[4];
+};
+
+struct mstp_rx_filter {
+	unsigned int nrules;		//0 and MSTP_RXF_ACCEPT remove the filter
+	unsigned int dflt;			//verdict if no rule matches
+	struct mstp_rxf_rule rule[MSTP_RXF_RULES];
+};
+
+/* MSTP_IOC_GETRING, the ring as learned from the tokens seen passing
+ * between stations in the last MSTP_RING_AGE ms, our own from NS.
+ * MSTP_IOC_SETRINGTUNE MSTP_RING_APPLY lets the driver set Nmax_manager
+ * to suggested after every maintenance PFM cycle and before looking for
+ * a new successor, once the ring closes. */
+#define MSTP_RING_NONE			0xFF	//next, successor unknown
+#define MSTP_RING_OFF			0	//only suggest
+#define MSTP_RING_APPLY			1
+
+struct mstp_ring {
+	unsigned char next[128];	//successor of each manager
+	unsigned int managers;		//stations that pass the token
+	unsigned int highest;		//highest of their addresses, This_Station included
+	unsigned int closed;		//following next from This_Station leads back
+	unsigned int suggested;		//Nmax_manager that covers them
+};
+
+/* MSTP_IOC_SETUSAGEADAPT 1 shortens the time we wait for a station to
+ * start using a token or answering a PFM from us to what it has needed so
+ * far (95th percentile plus 5 ms), never under 20 ms and never over
+ * MSTP_IOC_SETTUSAGE (85 ms for the first token pass).  Stations we have
+ * too few samples of get the full time.  MSTP_IOC_GETUSAGEPEER, arg is the
+ * station, returns the Tusage_timeout in ms it gets. */
+
+/* While the port is not on the ring (or is the sole manager) write() holds
+ * up to MSTP_IOC_SETHOLDFRAMES frames, for at most MSTP_IOC_SETHOLDAGE ms
+ * each, and sends them once it joins.  When they are all taken write()
+ * fails with ENOBUFS, and with ENOTCONN if holding is off (0 frames) or no
+ * MAC address has been set yet. */
+
+/* MSTP_IOC_SETTIMING replaces all of a port's timing at once, between two
+ * runs of the MNSM, without leaving the ring; EINVAL if any value is out
+ * of range and then nothing changes.  Where clause 9.5.3 gives a range it
+ * is enforced, where it fixes a value (the default) there is some room.
+ * The driver always answers a DataExpectingReply with ReplyPostponed at
+ * once, Treply_delay is only kept for whoever answers it. */
+struct mstp_timing {
+	unsigned int Npoll;				//1..255, 50
+	unsigned int Nretry_token;		//0..3, 1
+	unsigned int Nmin_octets;		//1..16, 4
+	unsigned int Tframe_abort;		//ms, 60 bit times..100, 100
+	unsigned int Tno_token;			//ms, above Treply_timeout..1000, 500
+	unsigned int Treply_timeout;	//ms, 255..300, 300
+	unsigned int Treply_delay;		//ms, 0..250, 200
+	unsigned int Tslot;				//ms, 2..50, 10
+	unsigned int tick_us;			//us between runs of the MNSM, 100..1000, 1000
+};
+
+/* MSTP_IOC_SETTXREPORT 1: every frame write() queues from then on gets a
+ * record, MSTP_IOC_GETTXREPORT takes the oldest one or fails with EAGAIN.
+ * A write() whose size covers 8 octets after the data passes them as the
+ * cookie (host order), any other gets the count of frames written so far.
+ * Times are ktime_get_ns(); done is taken on the first MNSM run after
+ * the uart is empty, so it can be up to a tick late.
+ *
+ * A frame still queued MSTP_IOC_SETTXTTL ms after write() (0, the
+ * default, is never) is dropped when the token comes instead of being
+ * sent, and reported as MSTP_TXR_EXPIRED.  While reports are on, a
+ * write() whose size covers 12 octets after the data gives the frame its
+ * own time to live in the 4 after the cookie (host order ms, 0 for the
+ * port's).
+ *
+ * write() takes up to 512 octets, header and at most 501 of data.  While
+ * reports are on, that is 512 + MSTP_TXR_TRAILER, so a frame with all
+ * 501 octets of data can still carry a cookie and a time to live. */
+#define MSTP_TXR_TRAILER		12	//cookie and time to live after the data
+
+#define MSTP_TXR_SENT			0	//on the wire, no reply expected
+#define MSTP_TXR_REPLY			1	//the reply came
+#define MSTP_TXR_POSTPONED		2	//ReplyPostponed came instead
+#define MSTP_TXR_TIMEOUT		3	//nothing within Treply_timeout
+#define MSTP_TXR_NOREPLY		4	//a bad or unexpected frame came instead
+#define MSTP_TXR_DROPPED		5	//never sent: dead peer, held too long, ...
+#define MSTP_TXR_EXPIRED		6	//never sent, its time to live ran out
+#define MSTP_TXR_OUTCOMES		7
+
+struct mstp_txreport {
+	unsigned long long cookie;
+	unsigned long long queued_ns;	//write() took it
+	unsigned long long start_ns;	//the first octet went to the uart, 0 never
+	unsigned long long done_ns;		//the uart was empty again, 0 never
+	unsigned char outcome;			//MSTP_TXR_*
+	unsigned char destination;
+	unsigned char frame_type;
+	unsigned char pad[5];
+};
+
+/* MSTP_IOC_SETTOKNOTIFY 1: poll() reports POLLPRI once the token is
+ * expected within MSTP_IOC_SETTOKLEAD ms (plus twice the jitter of the
+ * measured rotation), and again when it has arrived, while we are on the
+ * ring.  MSTP_IOC_GETTOKEN says which and clears POLLPRI.  Frames written
+ * on MSTP_TOK_SOON, up to budget of them, go out in the coming visit. */
+#define MSTP_TOK_NONE			0
+#define MSTP_TOK_SOON			1	//expected within lead_ms
+#define MSTP_TOK_HERE			2	//arrived, we are using it now
+
+struct mstp_token_info {
+	unsigned int seq;			//events so far
+	unsigned int state;			//MSTP_TOK_*, the last event
+	unsigned int budget;		//Nmax_info_frames less what is queued
+	unsigned int rotation_ms;	//average time between two of our tokens, 0 unknown
+	unsigned int jitter_ms;		//its mean deviation
+	unsigned int eta_ms;		//until the next is expected, 0 if overdue
+	unsigned int lead_ms;		//MSTP_TOK_SOON comes this long before eta
+};
+
+/* With netdev=1 every port is also a network interface, mstp0, mstp1, ...
+ * Its link layer header is the 5 octet header write() takes: FrameType,
+ * DestinationAddress, SourceAddress (0xFF for This_Station on transmit)
+ * and the big endian DataLength, followed by the NPDU.  Neither number
+ * below is registered, any value nobody else uses will do. */
+#define ARPHRD_MSTP				0xBAC0
+#define ETH_P_MSTP				0x00BA
+#define MSTP_NET_HLEN			5
 
 #define N_MSTP N_MOUSE
 
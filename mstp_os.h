@@ -0,0 +1,157 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+#ifndef __MSTP_OS_H_INCLUDED
+#define __MSTP_OS_H_INCLUDED
+
+/* The protocol core (mstpcore.c, queue.c) is built both into the kernel
+ * module and into a user space library for the simulator and benchmarks
+ * in tools/.  This header is the only place that knows the difference;
+ * outside the kernel it maps the handful of kernel services the core uses
+ * onto libc and pthreads.
+ */
+
+#ifdef __KERNEL__
+
+#include <asm/barrier.h>
+#include <linux/cache.h>
+#include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/tty.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#else /* user space */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define KERN_ERR ""
+#define KERN_INFO ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+
+#define GFP_ATOMIC 0
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kfree(p) free(p)
+
+/* a kmem cache is only a size out here */
+struct kmem_cache {
+  size_t size;
+};
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+                                                   unsigned int size,
+                                                   unsigned int align,
+                                                   unsigned long flags,
+                                                   void (*ctor)(void *)) {
+  struct kmem_cache *c = malloc(sizeof(*c));
+
+  if (c)
+    c->size = size;
+  return c;
+}
+#define kmem_cache_destroy(c) free(c)
+#define kmem_cache_alloc(c, flags) malloc((c)->size)
+#define kmem_cache_free(c, p) free(p)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* there are no interrupts out here, a mutex is all a spinlock needs to be */
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock_init(l) pthread_mutex_init((l), NULL)
+#define spin_lock_irqsave(l, flags)                                            \
+  do {                                                                         \
+    (flags) = 0;                                                               \
+    pthread_mutex_lock(l);                                                     \
+  } while (0)
+#define spin_unlock_irqrestore(l, flags)                                       \
+  do {                                                                         \
+    (void)(flags);                                                             \
+    pthread_mutex_unlock(l);                                                   \
+  } while (0)
+
+/* keeps what different CPUs write on different lines, see mstpport.h */
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((__aligned__(SMP_CACHE_BYTES)))
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* the tools never free what a reader may still be looking at while it
+ * runs, so RCU only has to order the pointer */
+#define __rcu
+#define rcu_read_lock() do {} while (0)
+#define rcu_read_unlock() do {} while (0)
+#define rcu_dereference(p) smp_load_acquire(&(p))
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) smp_store_release(&(p), (v))
+#define synchronize_rcu() do {} while (0)
+
+/* flag bytes handed to receive_buf2 by the tty layer */
+#define TTY_NORMAL 0
+#define TTY_BREAK 1
+#define TTY_FRAME 2
+#define TTY_PARITY 3
+#define TTY_OVERRUN 4
+
+#define USEC_PER_MSEC 1000L
+#define NSEC_PER_USEC 1000L
+
+static inline u64 div_u64(u64 dividend, u32 divisor) {
+  return dividend / divisor;
+}
+
+static inline u64 ktime_get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+#endif /* __KERNEL__ */
+
+#endif //__MSTP_OS_H_INCLUDED
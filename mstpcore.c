@@ -0,0 +1,2626 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------
+Description:
+                        BACnet MS/TP protocol core: the Receive Frame and
+                        Manager Node state machines, framing and CRCs.
+                        Nothing in here knows about ttys or the kernel; the
+                        line discipline (mstpmain.c) and the user space
+                        tools (tools/) supply the hooks listed in mstp.h
+----------------------------------------------------------------------------*/
+
+#include "mstpport.h"
+
+//#define USE_PAD_BYTE 1
+//#define EXTRA_DEBUG 1
+
+static u_char RFSM(struct mstp_port *port, u_char ch);
+static bool ManagerNodeStateMachine(struct mstp_port *port);
+static bool mstpNextFrameEvent(struct mstp_port *port);
+static void mstpHoldService(struct mstp_port *port);
+static void mstpTxrWire(struct mstp_port *port);
+static void mstpTokenSoon(struct mstp_port *port);
+
+///////////////////////////////////////////////////////////////////////
+//	initialize a port to its power-up defaults
+//
+// in:	port	the port to initialize
+
+void mstpPortInit(struct mstp_port *port) {
+  int i;
+
+  memset(port, 0, sizeof(*port));
+  port->This_Station = 0xFE; // not yet assigned
+  port->Nmax_info_frames = 10;
+  port->Nmax_manager = 127;
+  port->HeaderCRC = 0xFF;
+  port->DataCRC = 0xFFFF;
+  port->RFSMstate = rfsmIdle;
+  port->mnstate = mnsmInitialize;
+  port->Tusage_timeout = 35;
+  port->Tusage_timeoutTP = 85;
+  port->rxbuf_r = -1;
+  port->rxq_max_frames = 64;
+  port->rxq_max_bytes = 16384;
+  port->rxq_policy = MSTP_RXQ_DROP_NEWEST;
+  port->peer_timeouts = 3;
+  port->peer_probe = 10000;
+  port->reply_from = MSTP_NO_PEER;
+  port->peer_watch = MSTP_NO_PEER;
+  port->warm_ns = MSTP_NO_PEER;
+  port->hold_max = MSTP_HOLD_FRAMES;
+  port->hold_age = MSTP_HOLD_AGE;
+  port->rejoin_poll = true;
+  port->timing.Npoll = Npolldefault;
+  port->timing.Nretry_token = Nretrytoken;
+  port->timing.Nmin_octets = Nminoctets;
+  port->timing.Tframe_abort = Tframeabort;
+  port->timing.Tno_token = Tnotoken;
+  port->timing.Treply_timeout = Treplytimeout;
+  port->timing.Treply_delay = Treplydelay;
+  port->timing.Tslot = Tslotdefault;
+  port->timing.tick_us = Ttick;
+  for (i = 0; i < 128; i++)
+    port->ring[i].next = MSTP_RING_NONE;
+  mstpSetBaud(port, 38400);
+  mstpBuildTemplates(port);
+  Q_Init(&port->receive_queue);
+  Q_Init(&port->send_queue);
+  Q_Init(&port->hold_queue);
+  spin_lock_init(&port->tx_lock);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	initialize mstp subsystem
+
+void mstpVarInit(struct mstp_port *port, int turnaround) {
+  port->headercrccnt = 0;
+  port->datacrcerrcnt = 0;
+  port->rxinvalidframe = 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Set the baud rate and the turnaround delays that go with it
+//
+// in:	port	the port
+//		baud	the line speed, anything we don't know is taken as 76800
+//
+// out:	the baud rate actually used
+
+int mstpSetBaud(struct mstp_port *port, int baud) {
+  port->baud = baud;
+  // Tturnaround = (40/baud)*1000;
+  switch (baud) {
+  case 9600:
+    port->Tturnaround = 5;
+    port->true_delay = 4167; // 4.167 ms
+    break;
+  case 19200:
+    port->Tturnaround = 3;
+    port->true_delay = 2083; // 2.083 ms
+    break;
+  case 38400:
+    port->Tturnaround = 2;
+    port->true_delay = 1042; // 1.042 ms
+    break;
+  case 57600:
+    port->true_delay = 694; // 694 us
+    port->Tturnaround = 1;
+    break;
+  case 115200:
+    port->true_delay = 347; // 347 us
+    port->Tturnaround = 1;
+    break;
+  default:
+    // Tturnaround=1;
+    // must be 76800
+    port->baud = 76800;
+    port->Tturnaround = 1;
+    port->true_delay = 521; // 521 us
+    break;
+  }
+  return port->baud;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Replace the timing of a port
+//
+//	Nothing the state machines are in the middle of depends on the old
+//	values, a tokencount above the new Npoll only brings the next
+//	maintenance PFM forward, so the ring is left alone.  The caller keeps
+//	the MNSM out; the RFSM only reads Tframe_abort.
+//
+// in:	port	the port
+//		t		the new values, see struct mstp_timing in mstp_ioctl.h
+//
+// out:	0 or -EINVAL, then nothing has changed
+
+int mstpSetTiming(struct mstp_port *port, const struct mstp_timing *t) {
+  unsigned int abort_min = (60 * 1000 + port->baud - 1) / port->baud;
+
+  if ((t->Npoll < 1) || (t->Npoll > 255) || (t->Nretry_token > 3) ||
+      (t->Nmin_octets < 1) || (t->Nmin_octets > 16) ||
+      (t->Tframe_abort < abort_min) || (t->Tframe_abort > 100) ||
+      (t->Treply_timeout < 255) || (t->Treply_timeout > 300) ||
+      (t->Tno_token <= t->Treply_timeout) || (t->Tno_token > 1000) ||
+      (t->Treply_delay > 250) || (t->Tslot < 2) || (t->Tslot > 50) ||
+      (t->tick_us < 100) || (t->tick_us > 1000))
+    return -EINVAL;
+  port->timing = *t;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Assign our MAC address, which (re)starts the state machines
+//
+// in:	port	the port
+//		mac		This_Station, clamped to 127
+
+void mstpSetStation(struct mstp_port *port, byte mac) {
+  unsigned long flags;
+
+  if (mac > 127)
+    mac = 127;
+  if ((mac == port->This_Station) && (port->mnstate != mnsmInitialize))
+    return; // an application restart setting it again, stay on the ring
+  spin_lock_irqsave(&port->tx_lock, flags); // write() sees old or new
+  port->This_Station = mac;
+  port->ns = port->This_Station;
+  port->ps = port->This_Station;
+  port->warm_ns = MSTP_NO_PEER;
+  port->join_pending = true;
+  port->join_start = mstpPortClock(port);
+  port->join_warm = false;
+  mstpBuildTemplates(port);
+  mstpReset(port);
+  spin_unlock_irqrestore(&port->tx_lock, flags);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Warm restart
+//
+//	Closing the port forgets the successor, the ring map, what was
+//	learned about each peer and any timing that was set, and a fresh
+//	port has to be polled in and then poll for its successor all over.
+//	The line discipline keeps a mstp_warm per tty instead and hands it
+//	to the next open of the same tty.  That starts the MNSM with the old
+//	MAC address right away, and the first token it gets goes to the old
+//	successor with no PFM sweep first, so it is back on the ring as soon
+//	as its predecessor passes it the token.  join_ms measures from the
+//	(re)start to the successor taking our first token.  The predecessor
+//	side of this is rejoin_poll, see mstpRingLost.
+//
+// in:	port	the port
+//		w		filled in
+
+void mstpWarmSave(struct mstp_port *port, struct mstp_warm *w) {
+  w->saved = mstpPortClock(port);
+  w->This_Station = port->This_Station;
+  w->ns = port->ns;
+  w->Nmax_info_frames = port->Nmax_info_frames;
+  w->Nmax_manager = port->Nmax_manager;
+  w->Tusage_timeout = port->Tusage_timeout;
+  w->timing = port->timing;
+  memcpy(w->ring, port->ring, sizeof(w->ring));
+  memcpy(w->peer, port->peer, sizeof(w->peer));
+}
+
+// MNSM side: the successor took a token of ours, or there is nobody else
+
+static void mstpJoined(struct mstp_port *port) {
+  if (!port->join_pending)
+    return;
+  port->join_ms = mstpPortClock(port) - port->join_start;
+  port->join_pending = false;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Start a port from what a closed one remembered
+//
+// in:	port	a port that has no MAC address yet
+//		w		from mstpWarmSave
+//		max_age	ms it may have been closed
+//
+// out:	false	nothing was restored, w was too old or had no address
+
+bool mstpWarmRestore(struct mstp_port *port, const struct mstp_warm *w,
+                     unsigned int max_age) {
+  if ((w->This_Station > 127) || (mstpPortClock(port) - w->saved >= max_age))
+    return false;
+  port->Nmax_info_frames = w->Nmax_info_frames;
+  port->Nmax_manager = w->Nmax_manager;
+  port->Tusage_timeout = w->Tusage_timeout;
+  port->timing = w->timing;
+  memcpy(port->ring, w->ring, sizeof(port->ring));
+  memcpy(port->peer, w->peer, sizeof(port->peer));
+  mstpPeerReset(port);
+  mstpSetStation(port, w->This_Station);
+  if (w->ns != w->This_Station)
+    port->warm_ns = w->ns;
+  port->join_warm = true;
+  port->warm_starts++;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Calculate the Transmit Time of a buffered frame
+//
+// in:	n			the number of octets to send
+//		baudrate	the baudrate
+//
+// out:	calculated transmit time in msec
+
+int CalcTXTime(struct mstp_port *port, word n) {
+  int tt;
+
+  switch (port->baud) // we must calculate how long it will take to transmit
+  {
+  case 9600:
+    tt = (int)n; // 9600 is approximately 1 msec per octet
+    break;
+  case 19200:
+    tt = (int)(n >> 1); // 19200 is approximately 0.5 msec per octet
+    break;
+  case 38400:
+    tt = (int)(n >> 2); // 38400 is approximately 0.25 msec per octet
+    break;
+  case 76800:
+    tt = (int)(n >> 4); // 76800 is approximately 0.125 msec per octet
+    break;
+  case 57600:
+    tt = (int)((n >> 2) +
+               (n >> 1)); // 57600 is approximately 0.166 msec per octet
+    break;
+  case 115200:
+    tt = (int)((n >> 2) +
+               (n >> 1)); // 115200 is approximately 0.083 msec per octet
+    tt >>= 2;
+    break;
+  default:
+    tt = (int)n; // default is approximately 1 msec per octet
+    break;
+  }
+  return tt;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Reset
+//
+//	Resets the state machines (goes back to startup)
+//
+// in:	port	the port number to reset
+
+void mstpReset(struct mstp_port *port) {
+  port->mnstate = mnsmInitialize; // we've been starved of time, restart
+  mstpPortSetSilence(port, port->timing.Tframe_abort + 1); // to reset the RFSM
+  port->RFSMstate = rfsmIdle;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Run the MNSM for as long as it asks to transition immediately
+//
+//	Called once per tick with the port locked
+
+void mstpServiceMNSM(struct mstp_port *port) {
+  bool transitionnow = false;
+  int events = MSTP_RXEV_DEPTH; // frames we may still pick up this tick
+  mstpHoldService(port);
+  mstpTokenSoon(port);
+  if (!mstpPortTransmitComplete(port))
+    return;
+  mstpTxrWire(port);
+  // SilenceTimer > 0 once nobody has driven the line for a while; tx_done
+  // says our own frame has just left it, which is as good
+  if (port->tx_done || (mstpPortReadSilence(port) > 0)) {
+    mstpNextFrameEvent(port);
+    transitionnow = ManagerNodeStateMachine(port);
+    while ((port->tx_done || (mstpPortReadSilence(port) > 0)) &&
+           (mstpPortTransmitComplete(port))) {
+      // once the MNSM is done with a frame, the next one the RFSM has
+      // finished is handled right away instead of a tick later
+      mstpTxrWire(port);
+      if (mstpNextFrameEvent(port))
+        events--;
+      else if (transitionnow == false)
+        break;
+      if (events < 0)
+        break;
+      transitionnow = ManagerNodeStateMachine(port);
+    }
+  }
+  port->tx_done = false;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Receive queue limits
+//
+//	The RFSM runs whether or not user space reads, so receive_queue is
+//	bounded by rxq_max_frames and rxq_max_bytes (payload octets).  What
+//	gives way when a frame doesn't fit is up to rxq_policy.  read() may
+//	be popping at the same time, which only makes more room.
+//
+// in:	port	the port
+//		sa		source of the new frame
+//		len		its DataLength
+// out:	true	queue it
+//		false	drop it
+
+static bool mstpRxFull(struct mstp_port *port, int len) {
+  queue *q = &port->receive_queue;
+
+  if (port->rxq_max_frames && (Q_Size(q) >= (int)port->rxq_max_frames))
+    return true;
+  return port->rxq_max_bytes && (q->bytes + len > (int)port->rxq_max_bytes);
+}
+
+static bool mstpRxAdmit(struct mstp_port *port, byte sa, int len) {
+  struct mstp_data_t *d;
+
+  while (mstpRxFull(port, len)) {
+    d = NULL;
+    if (port->rxq_policy == MSTP_RXQ_DROP_OLDEST)
+      d = Q_PopTail(&port->receive_queue);
+    else if (port->rxq_policy == MSTP_RXQ_FAIR)
+      d = Q_PopHeaviest(&port->receive_queue, sa);
+    if (!d) { // the new frame goes, or it is bigger than the whole queue
+      port->rxq_drop_newest++;
+      return false;
+    }
+    if (port->rxq_policy == MSTP_RXQ_FAIR)
+      port->rxq_drop_fair++;
+    else
+      port->rxq_drop_oldest++;
+    free_entry(d);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Receive filter
+//
+//	Every data frame for us or broadcast used to be allocated, queued and
+//	copied out, Who-Is and I-Am storms included, only for the application
+//	to throw most of them away.  MSTP_IOC_SETRXFILTER installs a list of
+//	rules, each matching frame types, addressing, source and up to four
+//	masked NPDU octets at an offset, and the RFSM gives each completed
+//	data frame the verdict of the first rule that matches before it is
+//	allocated: accept, drop, or accept ahead of the frames already queued.
+//	Classic BPF was the other choice, but it runs on an skb and the core
+//	has none (nor a kernel, in tools/).  The RFSM reads the rules under
+//	RCU, so replacing them never stops it.
+
+// in:	port	the port, the RFSM has a good frame in rxbuf[rxbuf_w]
+// out:	MSTP_RXF_*
+
+static byte mstpRxClassify(struct mstp_port *port) {
+  const struct mstp_rx_filter *f;
+  const struct mstp_rxf_rule *r;
+  const byte *data = port->rxbuf[port->rxbuf_w];
+  byte type = port->rx.FrameType;
+  byte ac = (port->rx.DestinationAddress == mstpBroadcast) ? MSTP_RXF_BROADCAST
+                                                           : MSTP_RXF_TO_US;
+  byte verdict = MSTP_RXF_ACCEPT;
+  unsigned int k;
+
+  rcu_read_lock();
+  f = rcu_dereference(port->rxfilter);
+  if (!f)
+    goto out;
+  verdict = f->dflt;
+  for (r = f->rule; r < f->rule + f->nrules; r++) {
+    if (r->types && ((type > 15) || !(r->types & (1 << type))))
+      continue;
+    if (r->addressing && !(r->addressing & ac))
+      continue;
+    if ((r->source != MSTP_RXF_ANY) && (r->source != port->rx.SourceAddress))
+      continue;
+    if (r->offset + r->len > port->rx.DataLength)
+      continue;
+    for (k = 0; k < r->len; k++)
+      if ((data[r->offset + k] & r->mask[k]) != r->value[k])
+        break;
+    if (k < r->len)
+      continue;
+    verdict = r->verdict;
+    break;
+  }
+out:
+  rcu_read_unlock();
+  return verdict;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Replace the receive filter, process context
+//
+// in:	port	the port
+//		f		the new rules, NULL (or none that accept by default) to
+//				remove the filter
+// out:	0, -EINVAL or -ENOMEM
+
+int mstpSetRxFilter(struct mstp_port *port, const struct mstp_rx_filter *f) {
+  struct mstp_rx_filter *nf = NULL, *old;
+  unsigned int i;
+
+  if (f && ((f->nrules > 0) || (f->dflt != MSTP_RXF_ACCEPT))) {
+    if ((f->nrules > MSTP_RXF_RULES) || (f->dflt >= MSTP_RXF_VERDICTS))
+      return -EINVAL;
+    for (i = 0; i < f->nrules; i++)
+      if ((f->rule[i].verdict >= MSTP_RXF_VERDICTS) || (f->rule[i].len > 4) ||
+          (f->rule[i].offset + f->rule[i].len > maxrx))
+        return -EINVAL;
+    nf = kmalloc(sizeof(*nf), GFP_KERNEL);
+    if (!nf)
+      return -ENOMEM;
+    memcpy(nf, f, sizeof(*nf));
+  }
+  old = rcu_dereference_protected(port->rxfilter, 1);
+  rcu_assign_pointer(port->rxfilter, nf);
+  if (old) {
+    synchronize_rcu(); // the RFSM may still be looking at it
+    kfree(old);
+  }
+  return 0;
+}
+
+// in:	port	the port
+//		f		set to the current rules, none if there is no filter
+
+void mstpGetRxFilter(struct mstp_port *port, struct mstp_rx_filter *f) {
+  const struct mstp_rx_filter *cur;
+
+  memset(f, 0, sizeof(*f));
+  rcu_read_lock();
+  cur = rcu_dereference(port->rxfilter);
+  if (cur)
+    memcpy(f, cur, sizeof(*f));
+  rcu_read_unlock();
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Dead peers
+//
+//	A request to a station that doesn't answer holds the token for
+//	Treply_timeout, and everything behind it in send_queue waits.  So
+//	the MNSM keeps count of the times in a row each station failed to
+//	answer: reply timeouts, and tokens (or, for a manager, PFMs) passed
+//	to it, by us or by anyone else, that it didn't use.  A station is dead
+//	after peer_timeouts reply timeouts, or after Nretry_token + 1 unused
+//	tokens, which is when its predecessor drops it from the ring.
+//
+//	Requests to a dead station are failed instead of sent: write()
+//	returns -EHOSTUNREACH and those already queued are dropped in
+//	UseToken.  Every peer_probe ms one is let through to see if it is
+//	back; any frame heard from a station brings it back at once.
+
+static inline bool mstpPeerWaits(byte type, byte da) {
+  return ((type == mftBACnetDataExpectingReply) || (type == mftTestRequest)) &&
+         (da != mstpBroadcast);
+}
+
+// in:	port	the port
+//		da		destination of a request
+//		probe	the caller sends it if it's let through as a probe
+// out:	true if da is dead and it's not time to probe it
+
+static bool mstpPeerBlocked(struct mstp_port *port, byte da, bool probe) {
+  struct mstp_peer *p;
+  u32 now;
+
+  if (da >= MSTP_PEERS)
+    return false;
+  p = &port->peer[da];
+  if (!p->dead)
+    return false;
+  now = mstpPortClock(port);
+  if ((s32)(now - p->probe_at) < 0)
+    return true;
+  if (probe) {
+    p->probe_at = now + port->peer_probe;
+    port->peer_probes++;
+  }
+  return false;
+}
+
+// station failed to answer once more
+//
+// in:	port	the port
+//		station	the station
+//		limit	misses in a row that make it dead
+
+static void mstpPeerMiss(struct mstp_port *port, byte station,
+                         unsigned int limit) {
+  struct mstp_peer *p;
+
+  if (!port->peer_timeouts || (station >= MSTP_PEERS) ||
+      (station == port->This_Station))
+    return;
+  p = &port->peer[station];
+  if (p->misses < 0xFF)
+    p->misses++;
+  if (p->dead || (p->misses < limit))
+    return;
+  p->dead = true;
+  p->probe_at = mstpPortClock(port) + port->peer_probe;
+  port->peer_events++;
+}
+
+// MNSM side: a valid frame was loaded, its source is alive and, if the
+// last one was a token or PFM to someone else, that one had to answer
+
+static void mstpPeerHeard(struct mstp_port *port) {
+  byte sa = port->SourceAddress, da = port->DestinationAddress;
+  struct mstp_peer *p;
+
+  if ((port->peer_watch != MSTP_NO_PEER) && (port->peer_watch != sa))
+    mstpPeerMiss(port, port->peer_watch, port->timing.Nretry_token + 1);
+  port->peer_watch = MSTP_NO_PEER;
+  if (sa < MSTP_PEERS) {
+    p = &port->peer[sa];
+    p->misses = 0;
+    if (p->dead) {
+      p->dead = false;
+      port->peer_events++;
+    }
+    if (port->FrameType == mftToken)
+      p->manager = true;
+  }
+  if ((da >= MSTP_PEERS) || (da == port->This_Station))
+    return;
+  if ((port->FrameType == mftToken) ||
+      ((port->FrameType == mftPollForManager) && port->peer[da].manager))
+    port->peer_watch = da;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Forget what we know about dead peers, after MSTP_IOC_SETPEERTIMEOUTS
+//
+// in:	port	the port
+
+void mstpPeerReset(struct mstp_port *port) {
+  int i;
+
+  for (i = 0; i < MSTP_PEERS; i++) {
+    port->peer[i].misses = 0;
+    port->peer[i].dead = false;
+  }
+  port->peer_watch = MSTP_NO_PEER;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Ring map
+//
+//	Nmax_manager defaults to 127, so successor searches and the
+//	maintenance PFMs walk every address even on a trunk of a dozen
+//	managers.  The RFSM decodes the header of every frame anyway, so it
+//	notes who passed the token to whom, which over one rotation gives
+//	the ring order and the set of managers.  A pass not seen for
+//	MSTP_RING_AGE ms is forgotten.  With ring_tune MSTP_RING_APPLY the
+//	MNSM sets Nmax_manager to the highest manager plus MSTP_RING_SPARE
+//	after each maintenance PFM cycle and before a successor search, once
+//	the ring is known to close; a station above it that gets the token
+//	raises it again next time.
+
+// RFSM side: a good header, DestinationAddress may be anyone
+
+static inline void mstpRingSaw(struct mstp_port *port) {
+  byte sa = port->rx.SourceAddress, da = port->rx.DestinationAddress;
+
+  if ((port->rx.FrameType != mftToken) || (sa > 127) || (da > 127))
+    return;
+  port->ring[sa].next = da;
+  port->ring[sa].seen = mstpPortClock(port);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Snapshot the ring map
+//
+// in:	port	the port
+//		r		filled in, see struct mstp_ring in mstp_ioctl.h
+
+void mstpRingMap(struct mstp_port *port, struct mstp_ring *r) {
+  u32 now = mstpPortClock(port);
+  int i, ts = port->This_Station, cur;
+
+  memset(r, 0, sizeof(*r));
+  for (i = 0; i < 128; i++) {
+    r->next[i] = MSTP_RING_NONE;
+    if ((port->ring[i].next != MSTP_RING_NONE) &&
+        (now - port->ring[i].seen < MSTP_RING_AGE))
+      r->next[i] = port->ring[i].next;
+  }
+  if (ts > 127)
+    return; // no MAC address yet
+  r->next[ts] = MSTP_RING_NONE;
+  if (port->ns != ts)
+    r->next[ts] = port->ns;
+  r->highest = ts;
+  for (i = 0; i < 128; i++)
+    if (r->next[i] != MSTP_RING_NONE) {
+      r->managers++;
+      if (i > (int)r->highest)
+        r->highest = i;
+      if (r->next[i] > r->highest) // it answered a PFM, so it is one
+        r->highest = r->next[i];
+    }
+  for (cur = ts, i = 0; (i < 128) && (r->next[cur] != MSTP_RING_NONE); i++) {
+    cur = r->next[cur];
+    if (cur == ts) {
+      r->closed = 1;
+      break;
+    }
+  }
+  r->suggested = r->highest + MSTP_RING_SPARE;
+  if (r->suggested > 127)
+    r->suggested = 127;
+}
+
+// MNSM side: a maintenance PFM cycle is over
+
+static void mstpRingTune(struct mstp_port *port) {
+  struct mstp_ring r;
+
+  if (port->ring_tune != MSTP_RING_APPLY)
+    return;
+  mstpRingMap(port, &r);
+  if (!r.closed || (r.managers < 2) || (r.suggested == port->Nmax_manager))
+    return;
+  port->Nmax_manager = r.suggested;
+  port->ring_tunes++;
+}
+
+// MNSM side: the first manager between us and our successor that still
+// passed the token within MSTP_RING_AGE.  That is one we gave up on when
+// it stopped answering, most likely an application closing and opening
+// its port, and with rejoin_poll it gets a PFM on every token visit
+// instead of waiting for the maintenance PFMs to come around.
+//
+// out:	its address, or MSTP_NO_PEER
+
+static byte mstpRingLost(struct mstp_port *port) {
+  u32 now = mstpPortClock(port);
+  unsigned int i, k, n = port->Nmax_manager + 1;
+
+  if (!port->rejoin_poll || (port->ns == port->This_Station))
+    return MSTP_NO_PEER;
+  for (i = (port->This_Station + 1) % n, k = 0; (i != port->ns) && (k < n);
+       i = (i + 1) % n, k++) {
+    if ((port->ring[i].next != MSTP_RING_NONE) &&
+        (now - port->ring[i].seen < MSTP_RING_AGE))
+      return i;
+  }
+  return MSTP_NO_PEER;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Usage timeout
+//
+//	After passing the token or polling for a manager we wait
+//	Tusage_timeout (Tusage_timeoutTP for the first token pass) for the
+//	station to start transmitting, yet most start within a few ms.  The
+//	receive path notes SilenceTimer at the first octet after each token
+//	or PFM of ours, usage_sent and usage_heard hand it to the MNSM with
+//	each side writing only its own.  Every station keeps a running 95th
+//	percentile of these, which moves up 19 steps for a sample above it
+//	and down one for a sample below.  With usage_adapt the MNSM waits
+//	that plus MSTP_USAGE_MARGIN, but never less than the standard's 20
+//	ms; a token retry counts as a sample above, so a slow station soon
+//	gets back the time it needs.
+
+#define USAGE_STEP 4 // ms/16 the percentile drops for a sample below it
+
+// RFSM side: octets are coming in
+
+static inline void mstpUsageHeard(struct mstp_port *port) {
+  u32 sent = smp_load_acquire(&port->usage_sent);
+
+  if (port->usage_heard == sent)
+    return;
+  port->usage_ms = mstpPortReadSilence(port);
+  smp_store_release(&port->usage_heard, sent);
+}
+
+// MNSM side: a token or PFM of ours is about to go out
+
+static inline void mstpUsageSent(struct mstp_port *port) {
+  smp_store_release(&port->usage_sent, port->usage_sent + 1);
+}
+
+// move station's percentile towards q, in ms/16
+
+static void mstpUsageFeed(struct mstp_port *port, byte station, int q) {
+  struct mstp_peer *p = &port->peer[station];
+
+  if (p->usage_n == 0)
+    p->usage_q = (q < 0xFFFF) ? q : 0xFFFF;
+  else if (q > p->usage_q)
+    p->usage_q = (p->usage_q < 0xFFFF - 19 * USAGE_STEP)
+                     ? p->usage_q + 19 * USAGE_STEP
+                     : 0xFFFF;
+  else if (q < p->usage_q)
+    p->usage_q = (p->usage_q > USAGE_STEP) ? p->usage_q - USAGE_STEP : 0;
+  if (p->usage_n < MSTP_USAGE_SAMPLES)
+    p->usage_n++;
+}
+
+// station started transmitting after our token or PFM
+
+static void mstpUsageSample(struct mstp_port *port, byte station) {
+  int ms;
+
+  if ((station >= MSTP_PEERS) ||
+      (smp_load_acquire(&port->usage_heard) != port->usage_sent))
+    return; // the first octet came before we sent it
+  ms = (port->usage_ms > 0) ? port->usage_ms : 0;
+  mstpUsageFeed(port, station, ms * 16);
+  port->usage_samples++;
+}
+
+// station let a token of ours go unused
+
+static void mstpUsageMissed(struct mstp_port *port, byte station) {
+  if ((station < MSTP_PEERS) && port->peer[station].usage_n)
+    mstpUsageFeed(port, station, 0xFFFF);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	How long to wait for a station to use our token or answer our PFM
+//
+// in:	port	the port
+//		station	who we sent it to
+//		limit	the fixed timeout, Tusage_timeout or Tusage_timeoutTP
+// out:	ms
+
+int mstpUsageTimeout(struct mstp_port *port, byte station, int limit) {
+  struct mstp_peer *p;
+  int ms;
+
+  if (!port->usage_adapt || (station >= MSTP_PEERS))
+    return limit;
+  p = &port->peer[station];
+  if (p->usage_n < MSTP_USAGE_SAMPLES)
+    return limit;
+  ms = (p->usage_q + 15) / 16 + MSTP_USAGE_MARGIN;
+  if (ms < MSTP_USAGE_MIN)
+    ms = MSTP_USAGE_MIN;
+  return (ms < limit) ? ms : limit;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Token use scheduler
+//
+//	UseToken sends send_queue in FIFO order, so a request that stalls in
+//	WaitForReply holds up the frames behind it, and when it times out
+//	the rest of the token visit is lost.  With tx_sched set to
+//	MSTP_TXS_NOWAIT_FIRST it instead picks, among the frames this visit
+//	would have sent anyway (the first Nmax_info_frames - framecount),
+//	the frames that need no reply first, then requests to the stations
+//	that answer quickest (peer reply_ms).  A frame never passes an
+//	older one to the same destination, and the front of the queue still
+//	goes out in this visit, so nothing waits longer than with FIFO.
+//	A frame that waited longer than its ttl is dropped unsent when it
+//	comes up (SkipExpiredFrame), the application has given up on it and
+//	most likely written it again.
+
+// in:	ctx		the port
+//		e		a frame in send_queue
+// out:	its rank, lower goes first
+
+static int mstpTxRank(void *ctx, void *e) {
+  struct mstp_port *port = ctx;
+  struct mstp_data_t *d = e;
+
+  if (!mstpPeerWaits(d->FrameType, d->DestinationAddress))
+    return 0;
+  if (d->DestinationAddress >= MSTP_PEERS)
+    return 1;
+  return 1 + port->peer[d->DestinationAddress].reply_ms;
+}
+
+// in:	port	the port
+// out:	the next frame to send this visit, NULL if there is none
+
+static struct mstp_data_t *mstpTxNext(struct mstp_port *port) {
+  int window = (int)port->Nmax_info_frames - port->framecount;
+
+  if (port->tx_sched == MSTP_TXS_FIFO)
+    return Q_PopTail(&port->send_queue);
+  return Q_PopBest(&port->send_queue, (window > 1) ? window : 1, mstpTxRank,
+                   port);
+}
+
+// out:	true	f has outlived its ttl
+
+static bool mstpTxExpired(struct mstp_port *port, const struct mstp_data_t *f) {
+  return f->ttl && (mstpPortClock(port) - f->queued_at >= f->ttl);
+}
+
+// WaitForReply is over, account the time it took
+//
+// in:	port	the port
+//		sample	feed it to reply_from's reply_ms, it answered or timed out
+
+static void mstpReplyDone(struct mstp_port *port, bool sample) {
+  u32 ms = mstpPortClock(port) - port->reply_sent;
+  struct mstp_peer *p;
+
+  port->tok_wait_ms += ms;
+  if (!sample || (port->reply_from >= MSTP_PEERS))
+    return;
+  p = &port->peer[port->reply_from];
+  if (ms > 0xFFFF)
+    ms = 0xFFFF;
+  p->reply_ms = p->reply_ms ? (p->reply_ms * 7 + ms) / 8 : ms;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Frame events
+//
+//	The RFSM runs in the receive path and the MNSM on the tick, possibly
+//	at the same time on different CPUs.  Every frame the RFSM finishes is
+//	put into port->rxev[], a single producer single consumer ring, and the
+//	MNSM takes them out in order one at a time into ReceivedValidFrame,
+//	ReceivedInvalidFrame, FrameType, DestinationAddress, SourceAddress,
+//	DataLength and InputBuffer, the variables clause 9 talks about.  That
+//	way a token followed by another frame in the same burst isn't lost.
+//
+//	Frame data is received into one of two rxbufs.  Data frames are copied
+//	into the receive queue right away; only a TestRequest for us keeps its
+//	rxbuf until the MNSM has echoed it, and the RFSM switches to the other.
+
+// RFSM side: a frame is complete
+//
+// in:	port	the port
+//		valid	ReceivedValidFrame, otherwise ReceivedInvalidFrame
+
+static void mstpFrameEvent(struct mstp_port *port, bool valid) {
+  unsigned int head = port->rxev_head;
+  unsigned int depth = head - smp_load_acquire(&port->rxev_tail);
+  struct mstp_frame_event *ev;
+  byte other;
+
+  if (depth >= MSTP_RXEV_DEPTH) {
+    port->rxev_overruns++;
+    return;
+  }
+  ev = &port->rxev[head & (MSTP_RXEV_DEPTH - 1)];
+  *ev = port->rx;
+  ev->valid = valid;
+  ev->buf = -1;
+  if (valid && (ev->FrameType == mftTestRequest) && (ev->DataLength > 0) &&
+      (ev->DestinationAddress == port->This_Station)) {
+    other = port->rxbuf_w ^ 1;
+    if (!smp_load_acquire(&port->rxbuf_held[other])) {
+      port->rxbuf_held[port->rxbuf_w] = true;
+      ev->buf = port->rxbuf_w;
+      port->rxbuf_w = other;
+    } else {
+      port->rxev_nodata++; // echoed without data
+    }
+  }
+  if (depth + 1 > port->rxev_maxdepth)
+    port->rxev_maxdepth = depth + 1;
+  smp_store_release(&port->rxev_head, head + 1);
+}
+
+// MNSM side: done with the data of the current frame, the RFSM may have
+// its buffer back
+
+static void mstpRxbufRelease(struct mstp_port *port) {
+  if (port->rxbuf_r < 0)
+    return;
+  smp_store_release(&port->rxbuf_held[port->rxbuf_r], false);
+  port->rxbuf_r = -1;
+  port->InputBuffer = NULL;
+}
+
+// MNSM side: load the next frame, once the MNSM is done with the last one
+//
+// out:	true if a frame was loaded
+
+static bool mstpNextFrameEvent(struct mstp_port *port) {
+  unsigned int tail = port->rxev_tail;
+  struct mstp_frame_event *ev;
+
+  if (port->ReceivedValidFrame || port->ReceivedInvalidFrame)
+    return false;
+  mstpRxbufRelease(port); // even if nothing else has come yet
+  if (tail == smp_load_acquire(&port->rxev_head))
+    return false;
+  ev = &port->rxev[tail & (MSTP_RXEV_DEPTH - 1)];
+  port->FrameType = ev->FrameType;
+  port->DestinationAddress = ev->DestinationAddress;
+  port->SourceAddress = ev->SourceAddress;
+  port->DataLength = ev->DataLength;
+  port->InputBuffer = (ev->buf >= 0) ? port->rxbuf[ev->buf] : NULL;
+  port->rxbuf_r = ev->buf;
+  if (ev->valid) {
+    port->ReceivedValidFrame = true;
+    mstpPeerHeard(port);
+  } else
+    port->ReceivedInvalidFrame = true;
+  smp_store_release(&port->rxev_tail, tail + 1);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Throw away every frame the MNSM hasn't looked at yet
+//
+//	MNSM side, for callers that run the RFSM without the MNSM
+
+void mstpFlushFrameEvents(struct mstp_port *port) {
+  port->ReceivedValidFrame = false;
+  port->ReceivedInvalidFrame = false;
+  while (mstpNextFrameEvent(port)) {
+    port->ReceivedValidFrame = false;
+    port->ReceivedInvalidFrame = false;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Feed received octets to the RFSM
+//
+// in:	port	the port
+//		cp		the octets
+//		fp		per octet TTY_* flags, may be NULL
+//		count	number of octets
+
+void mstpReceiveOctets(struct mstp_port *port, const unsigned char *cp,
+                       const char *fp, int count) {
+  int i = 0;
+  port->num_rx_bytes += count;
+  if (count > 0)
+    mstpUsageHeard(port);
+  for (i = 0; i < count; i++) {
+    if (fp) {
+      switch (fp[i]) {
+      case TTY_FRAME:
+        port->num_rx_errors++;
+        port->rx_errors = 1;
+        port->num_fe++;
+        break;
+      case TTY_PARITY:
+        port->num_rx_errors++;
+        port->rx_errors = 1;
+        port->num_pe++;
+        break;
+      case TTY_OVERRUN:
+        port->num_rx_errors++;
+        port->rx_errors = 1;
+        port->num_oe++;
+        break;
+      default:
+        break;
+      }
+    }
+    port->DataAvailable = true;
+    RFSM(port, cp[i]);
+    mstpPortResetSilence(port);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Transmit reports
+//
+//	write() returns as soon as a frame is queued.  With tx_report every
+//	frame queued from then on owes user space a struct mstp_txreport: its
+//	cookie, when it was queued, when its first octet went to the uart,
+//	when the uart was empty again and what became of it.  The MNSM keeps
+//	the frame on the wire in txr_cur, until TransmitComplete or, for a
+//	DataExpectingReply, until the reply or Treply_timeout, and then puts
+//	it in txr[] for MSTP_IOC_GETTXREPORT.  Both sides lock the port.
+
+static void mstpTxrPush(struct mstp_port *port, struct mstp_txreport *r,
+                        byte outcome) {
+  r->outcome = outcome;
+  port->txr_counts[outcome]++;
+  if (port->txr_head - port->txr_tail >= MSTP_TXR_DEPTH) {
+    port->txr_lost++;
+    return;
+  }
+  port->txr[port->txr_head % MSTP_TXR_DEPTH] = *r;
+  port->txr_head++;
+}
+
+static void mstpTxrFill(struct mstp_txreport *r, const struct mstp_data_t *f) {
+  memset(r, 0, sizeof(*r));
+  r->cookie = f->cookie;
+  r->queued_ns = f->queued_ns;
+  r->destination = f->DestinationAddress;
+  r->frame_type = f->FrameType;
+}
+
+// MNSM side: f is freed without being sent
+
+static void mstpTxrDrop(struct mstp_port *port, const struct mstp_data_t *f,
+                        byte outcome) {
+  struct mstp_txreport r;
+
+  if (!f->report)
+    return;
+  mstpTxrFill(&r, f);
+  mstpTxrPush(port, &r, outcome);
+}
+
+// its first octet goes out now
+
+static void mstpTxrStart(struct mstp_port *port, const struct mstp_data_t *f) {
+  if (!f->report)
+    return;
+  mstpTxrFill(&port->txr_cur, f);
+  port->txr_cur.start_ns = mstpPortTime(port);
+  port->txr_busy = true;
+  port->txr_wait = false;
+}
+
+// the uart is empty, whatever we sent last has left
+
+static void mstpTxrWire(struct mstp_port *port) {
+  if (!port->txr_busy || port->txr_cur.done_ns)
+    return;
+  port->txr_cur.done_ns = mstpPortTime(port);
+  if (!port->txr_wait) {
+    port->txr_busy = false;
+    mstpTxrPush(port, &port->txr_cur, MSTP_TXR_SENT);
+  }
+}
+
+// WaitForReply is over
+
+static void mstpTxrReply(struct mstp_port *port, byte outcome) {
+  if (!port->txr_busy || !port->txr_wait)
+    return;
+  if (!port->txr_cur.done_ns) // it did leave, somebody answered
+    port->txr_cur.done_ns = mstpPortTime(port);
+  port->txr_busy = false;
+  mstpTxrPush(port, &port->txr_cur, outcome);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Take the oldest transmit report
+//
+// in:	port	the port, locked
+//		r		filled in
+//
+// out:	false	there is none
+
+bool mstpTxrPop(struct mstp_port *port, struct mstp_txreport *r) {
+  if (port->txr_head == port->txr_tail)
+    return false;
+  *r = port->txr[port->txr_tail % MSTP_TXR_DEPTH];
+  port->txr_tail++;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Token notification
+//
+//	An application that queues its frames ahead of time sends data that
+//	was sampled long before the token came, or misses a visit.  The MNSM
+//	measures the time between two tokens for us, and with tok_notify it
+//	tells the environment (mstpPortTokenEvent, poll() in the kernel) when
+//	the next one is due within tok_lead ms plus twice the jitter of that
+//	time, MSTP_TOK_SOON, and when it has come, MSTP_TOK_HERE.  Frames
+//	written on MSTP_TOK_SOON are fresh and still make the coming visit.
+//	tok_early counts tokens that came before MSTP_TOK_SOON did.
+
+// ms until the token is expected, 0 if it is overdue or unknown
+
+static u32 mstpTokenEta(struct mstp_port *port) {
+  u32 gone = mstpPortClock(port) - port->tok_last;
+
+  if (!port->tok_seen || !port->tok_rot || (gone >= port->tok_rot))
+    return 0;
+  return port->tok_rot - gone;
+}
+
+static void mstpTokenEvent(struct mstp_port *port, byte state) {
+  port->tok_state = state;
+  port->tok_seq++;
+  mstpPortTokenEvent(port);
+}
+
+// MNSM side, ReceivedToken
+
+static void mstpTokenArrived(struct mstp_port *port) {
+  u32 now = mstpPortClock(port), rot = now - port->tok_last;
+
+  if (port->tok_seen) {
+    if (!port->tok_rot)
+      port->tok_rot = rot;
+    if (rot > 2 * port->tok_rot) // we were off the ring, or it slowed down
+      rot = 2 * port->tok_rot;
+    port->tok_dev = (port->tok_dev * 7 +
+                     ((rot > port->tok_rot) ? rot - port->tok_rot
+                                            : port->tok_rot - rot)) / 8;
+    port->tok_rot = (port->tok_rot * 7 + rot) / 8;
+  }
+  port->tok_seen = true;
+  port->tok_last = now;
+  if (!port->tok_notify)
+    return;
+  if (!port->tok_soon && port->tok_rot)
+    port->tok_early++;
+  port->tok_soon = false;
+  mstpTokenEvent(port, MSTP_TOK_HERE);
+}
+
+// MNSM side, every tick
+
+static void mstpTokenSoon(struct mstp_port *port) {
+  if (!port->tok_notify || port->tok_soon || !port->tok_rot ||
+      !port->online || (port->mnstate != mnsmIdle))
+    return;
+  if (mstpTokenEta(port) > port->tok_lead + 2 * port->tok_dev)
+    return;
+  port->tok_soon = true;
+  mstpTokenEvent(port, MSTP_TOK_SOON);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Where the token is
+//
+// in:	port	the port, locked
+//		ti		filled in, see struct mstp_token_info in mstp_ioctl.h
+
+void mstpTokenInfo(struct mstp_port *port, struct mstp_token_info *ti) {
+  int budget = (int)port->Nmax_info_frames - Q_Size(&port->send_queue);
+
+  memset(ti, 0, sizeof(*ti));
+  ti->seq = port->tok_seq;
+  ti->state = port->tok_state;
+  ti->budget = (budget > 0) ? budget : 0;
+  ti->rotation_ms = port->tok_rot;
+  ti->jitter_ms = port->tok_dev;
+  ti->eta_ms = mstpTokenEta(port);
+  ti->lead_ms = port->tok_lead + 2 * port->tok_dev;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Hold queue
+//
+//	Until the MNSM has joined the ring, and while it is the sole manager,
+//	there is nobody to send to.  write() used to report success for such
+//	frames and drop them, so the Who-Is and I-Am traffic of a starting
+//	application was lost and only its own timeouts brought it back.  Now
+//	they wait in hold_queue, at most hold_max of them and none longer
+//	than hold_age ms, and the tick moves them to send_queue in order as
+//	soon as we are on the ring and there is room.  Until they are all
+//	gone write() fails with ENOMEM as if send_queue was full, so nothing
+//	overtakes them.  A full hold_queue fails write() with ENOBUFS,
+//	hold_max 0 with ENOTCONN.  Before MSTP_IOC_SETMACADDRESS there is no
+//	source address, so write() fails with ENOTCONN too.  Frames sent
+//	from This_Station get the current one when they move, in case it
+//	was changed while they were held.
+
+static bool mstpHoldOnline(struct mstp_port *port) {
+  return (port->joined_state != 0) && (port->SoleManager != true);
+}
+
+// drop the held frames that are too old
+
+static void mstpHoldExpire(struct mstp_port *port) {
+  struct mstp_data_t *e;
+
+  while ((e = Q_PopExpired(&port->hold_queue, mstpPortClock(port),
+                           port->hold_age)) != NULL) {
+    mstpTxrDrop(port, e, MSTP_TXR_DROPPED);
+    free_entry(e);
+    port->hold_expired++;
+  }
+}
+
+// write() side: is there room for one more?  The tick expires old ones
+
+static bool mstpHoldRoom(struct mstp_port *port) {
+  if (Q_Size(&port->hold_queue) < (int)port->hold_max)
+    return true;
+  if (port->hold_max)
+    port->hold_full++;
+  return false;
+}
+
+// the MAC address may have changed since it was written
+
+static void mstpHoldSource(struct mstp_port *port, struct mstp_data_t *e) {
+  if (!e->own_sa || (e->SourceAddress == port->This_Station))
+    return;
+  e->SourceAddress = port->This_Station;
+  e->wirelen = mstpBuildFrame(e->data, e->FrameType, e->DestinationAddress,
+                              e->SourceAddress, &e->data[MSTP_HDR_LEN],
+                              e->count);
+}
+
+// MNSM side, every tick.  tx_lock keeps write() from deciding while
+// frames are between the two queues
+
+static void mstpHoldService(struct mstp_port *port) {
+  struct mstp_data_t *e;
+  unsigned long flags;
+
+  if (!Q_Size(&port->hold_queue))
+    return;
+  spin_lock_irqsave(&port->tx_lock, flags);
+  mstpHoldExpire(port);
+  while (mstpHoldOnline(port) &&
+         (Q_Size(&port->send_queue) < (int)port->Nmax_info_frames) &&
+         ((e = Q_PopTail(&port->hold_queue)) != NULL)) {
+    mstpHoldSource(port, e);
+    Q_PushHead(&port->send_queue, e);
+    port->hold_flushed++;
+  }
+  spin_unlock_irqrestore(&port->tx_lock, flags);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Queue one frame from the application for transmission
+//
+// in:	port	the port
+//		buf		the frame in the write() format described at mstp_write
+//		nr		size of buf
+//
+// out:	nr if the frame was queued (or held until we are on the ring), a
+//		negative errno otherwise
+//
+//	write() and the network interface's ndo_start_xmit (in softirq) may
+//	both call it, tx_lock lets one of them decide and queue at a time.
+
+static int mstpQueueOne(struct mstp_port *port, const unsigned char *buf,
+                        size_t nr) {
+  struct mstp_data_t *mstp_data_ptr;
+  int count;
+  bool held;
+
+  if (nr > INPUT_BUFFER_SIZE + (port->tx_report ? MSTP_TXR_TRAILER : 0)) {
+    printk(MSTP_MSG "mstp_write: size_t too big\n");
+    return -ENOMEM;
+  }
+  if (nr < 5) {
+    printk(MSTP_MSG "mstp_write: size_t too small\n");
+    return -ENOMEM; // the received data is too small!
+  }
+  if (port->This_Station > 127)
+    return -ENOTCONN; // no MAC address yet, nothing to send from
+  if (mstpPeerWaits(buf[0], buf[1]) && mstpPeerBlocked(port, buf[1], false)) {
+    port->peer_refused++;
+    return -EHOSTUNREACH;
+  }
+  held = !mstpHoldOnline(port);
+  if (held && !mstpHoldRoom(port))
+    return port->hold_max ? -ENOBUFS : -ENOTCONN;
+  // frames held from before we joined go first, they count as queued
+  if (held || ((Q_Size(&port->send_queue) < port->Nmax_info_frames) &&
+               !Q_Size(&port->hold_queue))) {
+    count = ((buf[3] * 256) + buf[4]);
+    if ((count > MSTP_MAX_DATA) || (count > (int)(nr - 5))) {
+      printk(MSTP_MSG "mstp_write: data length too big\n");
+      return -ENOMEM;
+    }
+    // sized for the wire image: header, data, CRC and pad
+    mstp_data_ptr = alloc_entry(MSTP_HDR_LEN + count + 3);
+    if (!mstp_data_ptr) {
+      printk(
+          MSTP_MSG
+          "mstp_write: NULL mstp_data_ptr returned from alloc in mstp_send\n");
+      Q_Empty(&port->send_queue, port->Nmax_info_frames);
+      return -EFAULT;
+    }
+    mstp_data_ptr->FrameType = buf[0];
+    mstp_data_ptr->DestinationAddress = buf[1];
+    mstp_data_ptr->own_sa = (buf[2] == 0xFF);
+    if (mstp_data_ptr->own_sa)
+      mstp_data_ptr->SourceAddress = port->This_Station;
+    else
+      mstp_data_ptr->SourceAddress = buf[2];
+    mstp_data_ptr->count = count;
+    // the whole frame is built here, the MNSM only has to write it
+    mstp_data_ptr->wirelen = mstpBuildFrame(
+        mstp_data_ptr->data, mstp_data_ptr->FrameType,
+        mstp_data_ptr->DestinationAddress, mstp_data_ptr->SourceAddress,
+        &buf[5], count);
+    port->SentPacketCounter++;
+    mstp_data_ptr->queued_at = mstpPortClock(port);
+    mstp_data_ptr->ttl = port->tx_ttl;
+    if (port->tx_report) { // the cookie may follow the data
+      mstp_data_ptr->report = 1;
+      mstp_data_ptr->queued_ns = mstpPortTime(port);
+      mstp_data_ptr->cookie = port->SentPacketCounter;
+      if (nr >= count + 5 + sizeof(mstp_data_ptr->cookie))
+        memcpy(&mstp_data_ptr->cookie, &buf[5 + count],
+               sizeof(mstp_data_ptr->cookie));
+      if (nr >= count + 5 + MSTP_TXR_TRAILER) { // then a ttl of its own
+        u32 ttl;
+        memcpy(&ttl, &buf[5 + count + 8], sizeof(ttl));
+        if (ttl)
+          mstp_data_ptr->ttl = ttl;
+      }
+    }
+    // Add it to our send queue
+    Q_PushHead(held ? &port->hold_queue : &port->send_queue, mstp_data_ptr);
+    return nr;
+  } else {
+    // printk(MSTP_MSG "mstp_write: max frames exceeded\n");
+    return -ENOMEM;
+  }
+}
+
+int mstpQueueFrame(struct mstp_port *port, const unsigned char *buf,
+                   size_t nr) {
+  unsigned long flags;
+  int rc;
+
+  spin_lock_irqsave(&port->tx_lock, flags);
+  rc = mstpQueueOne(port, buf, nr);
+  spin_unlock_irqrestore(&port->tx_lock, flags);
+  return rc;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Receive Frame State Machine
+//
+
+static u_char RFSM(struct mstp_port *port, u_char ch) {
+  struct mstp_data_t *mstp_receive_ptr;
+  byte verdict;
+  switch (port->RFSMstate) {
+  case rfsmIdle:
+    if (port->rx_errors != 0) // EatAnError
+    {
+      port->rx_errors = 0;
+      mstpPortResetSilence(port);
+      port->eventcount++;
+      port->RFSMstate = rfsmIdle;
+      break;
+    } else if (port->rx_errors == 0) // EatAnOctet
+    {
+      if (port->DataAvailable == true) {
+        if (ch != 0x55) {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->eventcount++;
+          port->RFSMstate = rfsmIdle;
+          break;
+        } else if (ch == 0x55) // Preamble1
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->eventcount++;
+          port->hbpos = 0;
+          port->errb[port->hbpos++] = ch;
+          port->RFSMstate = rfsmPreamble;
+          break;
+        }
+      }
+    }
+    break;
+  case rfsmPreamble:
+    if (mstpPortReadSilence(port) > port->timing.Tframe_abort) // Timeout
+    {
+      port->frame_abort_errors++;
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors != 0) // Error
+    {
+      mstpPortResetSilence(port);
+      port->eventcount++;
+      port->RFSMstate = rfsmIdle;
+      break;
+    } else if (port->rx_errors == 0) {
+      if (port->DataAvailable == true) {
+        if (ch == 0xFF) // Preamble2
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->eventcount++;
+          port->errb[port->hbpos++] = ch;
+          port->Index = 0;
+          port->HeaderCRC = 0xFF;
+          port->RFSMstate = rfsmHeader;
+          break;
+        } else if (ch == 0x55) // RepeatedPreamble1
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->eventcount++;
+          port->hbpos = 1; // errb keeps one 0x55, however many there were
+          port->RFSMstate = rfsmPreamble;
+          break;
+        } else // if((ch!=0x55) && (ch!=0xFF))				//Not
+               // Preamble
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->eventcount++;
+          port->errb[port->hbpos++] = ch;
+          port->RFSMstate = rfsmIdle;
+          break;
+        }
+      }
+    }
+    break;
+  case rfsmHeader:
+    if (mstpPortReadSilence(port) > port->timing.Tframe_abort) // Timeout
+    {
+      port->frame_abort_errors++;
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors != 0) // Error
+    {
+      port->rx_errors = 0;
+      mstpPortResetSilence(port);
+      port->eventcount++;
+      port->errb[port->hbpos++] = ch;
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if ((port->rx_errors == 0) && (port->DataAvailable == true)) {
+      if (port->Index == 0) // FrameType
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        port->rx.FrameType = ch;
+        port->Index = 1;
+        port->RFSMstate = rfsmHeader;
+        break;
+      }
+      if (port->Index == 1) // DestinationAddress
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        port->rx.DestinationAddress = ch;
+        port->Index = 2;
+        port->RFSMstate = rfsmHeader;
+        break;
+      }
+      if (port->Index == 2) // SourceAddress
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        port->rx.SourceAddress = ch;
+        port->Index = 3;
+        port->RFSMstate = rfsmHeader;
+        break;
+      }
+      if (port->Index == 3) // Length1
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        port->rx.DataLength = ch * 256;
+        port->Index = 4;
+        port->RFSMstate = rfsmHeader;
+        break;
+      }
+      if (port->Index == 4) // Length2
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        port->rx.DataLength += ch;
+        port->Index = 5;
+        port->RFSMstate = rfsmHeader;
+        break;
+      }
+      if (port->Index == 5) // HeaderCRC
+      {
+        port->DataAvailable = false;
+        mstpPortResetSilence(port);
+        port->eventcount++;
+        port->errb[port->hbpos++] = ch;
+        port->HeaderCRC = CalcHeaderCRC(ch, port->HeaderCRC);
+        // printk(MSTP_MSG "Header CRC=%02X -->
+        // %s,Index=%d\n",HeaderCRC,rfsm_strings[RFSMstate],Index);
+        if (port->HeaderCRC != 0x55) // BadCRC
+        {
+          // printk(MSTP_MSG "*****Header CRC Error!******\n");
+          mstpFrameEvent(port, false);
+          port->RFSMstate = rfsmIdle;
+          port->numHdrCRCErrs++;
+          // memcpy(errb,hb,hbpos-1);
+          port->errb[++port->hbpos] = port->HeaderCRC;
+          break;
+        } else if (port->HeaderCRC ==
+                   0x55) // HeaderCRC state follows, not a state per se though
+        {
+          memset(port->errb, 0x00, sizeof(port->errb));
+          mstpRingSaw(port);
+          if ((port->rx.DestinationAddress != port->This_Station) && // NotForUs
+              (port->rx.DestinationAddress != 0xFF) &&
+              (port->rx.DataLength == 0)) {
+            port->RFSMstate = rfsmIdle;
+            port->hbpos = 0;
+            break;
+          } else {
+            if (port->rx.DestinationAddress == port->This_Station) {
+              if (port->rx.FrameType == mftToken) {
+                port->RX_Token_Count++;
+              }
+              if (port->rx.FrameType == mftPollForManager) {
+                port->RX_PFM_Count++;
+              }
+            }
+            if (port->rx.DataLength == 0) // No Data
+            {
+              mstpFrameEvent(port, true);
+              port->RFSMstate = rfsmIdle;
+              break;
+            } else if ((port->rx.DataLength != 0) && // Data
+                       (port->rx.DataLength <= maxrx)) {
+              if ((port->rx.DestinationAddress !=
+                   port->This_Station) && // DataNotForUs (Addendum 135-2008z-3)
+                  (port->rx.DestinationAddress != 0xFF)) {
+                port->Index = 0;
+                port->RFSMstate = rfsmSkipData;
+                break;
+              } else {
+                port->Index = 0;
+                port->DataCRC = 0xFFFF;
+                port->RFSMstate = rfsmData;
+                break;
+              }
+            } else // FrameTooLong
+            {
+              if (port->rx.DataLength <= (maxrx * 2)) {
+                port->RFSMstate = rfsmSkipData; // reasonable length
+              } else // This is an invalid length, don't try to consume it
+              {
+                port->Num_Invalid_Large_Frames++;
+                port->DataAvailable = false;
+                mstpPortResetSilence(port);
+                mstpFrameEvent(port, false);
+                port->RFSMstate = rfsmIdle;
+                port->hbpos = 0;
+              }
+              break;
+            }
+          }
+        }
+      }
+    }
+    break;
+  case rfsmSkipData: // SkipData (Addendum 135-2008z-3)
+    if (mstpPortReadSilence(port) > port->timing.Tframe_abort) // Timeout
+    {
+      port->frame_abort_errors++;
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors != 0) // Error
+    {
+      port->rx_errors = 0;
+      mstpPortResetSilence(port);
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors == 0) {
+      if (port->DataAvailable) {
+        if (port->Index < (port->rx.DataLength + 1)) // DataOctet
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->Index++;
+          port->RFSMstate = rfsmSkipData;
+          break;
+        } else if (port->Index == (port->rx.DataLength + 1)) // Done
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->RFSMstate = rfsmIdle;
+          break;
+        }
+      }
+    }
+    break;
+  case rfsmData:
+    if (mstpPortReadSilence(port) > port->timing.Tframe_abort) // Timeout
+    {
+      port->frame_abort_errors++;
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors != 0) // Error
+    {
+      port->rx_errors = 0;
+      mstpPortResetSilence(port);
+      mstpFrameEvent(port, false);
+      port->RFSMstate = rfsmIdle;
+      break;
+    }
+    if (port->rx_errors == 0) {
+      if (port->DataAvailable == true) {
+        if (port->Index <= port->rx.DataLength) // Data
+        {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->DataCRC = CalcDataCRC(ch, port->DataCRC);
+          port->rxbuf[port->rxbuf_w][port->Index++] = ch;
+          port->RFSMstate = rfsmData;
+          break;
+        } else if (port->Index == (port->rx.DataLength + 1)) {
+          port->DataAvailable = false;
+          mstpPortResetSilence(port);
+          port->DataCRC = CalcDataCRC(ch, port->DataCRC);
+          if (port->DataCRC != 0xF0B8) {
+            mstpFrameEvent(port, false);
+            port->RFSMstate = rfsmIdle;
+            port->numDataCRCErrs++;
+            break;
+          } else if (port->DataCRC == 0xF0B8) {
+            // the following is "outside" the standard
+            // as soon as we get any data that's broadcast or for TS
+            // then we hand it off to the RxQ for processing
+            if (port->rx.FrameType == mftBACnetDataExpectingReply ||
+                port->rx.FrameType ==
+                    mftBACnetDataNotExpectingReply) // queue only these types
+            {
+              mstp_receive_ptr = NULL;
+              verdict = mstpRxClassify(port);
+              port->rxf_hits[verdict]++;
+              if ((verdict != MSTP_RXF_DROP) &&
+                  mstpRxAdmit(port, port->rx.SourceAddress,
+                              port->rx.DataLength)) {
+                mstp_receive_ptr = (struct mstp_data_t *)alloc_entry(
+                    port->rx.DataLength);
+                if (!mstp_receive_ptr)
+                  port->rxq_nomem++;
+              }
+              // the MNSM sees the frame even if user space won't
+              if (!mstp_receive_ptr) {
+                mstpFrameEvent(port, true);
+                port->RFSMstate = rfsmIdle;
+                break;
+              }
+              mstp_receive_ptr->SourceAddress = port->rx.SourceAddress;
+              mstp_receive_ptr->DestinationAddress =
+                  port->rx.DestinationAddress;
+              mstp_receive_ptr->FrameType = port->rx.FrameType;
+              memmove(mstp_receive_ptr->data, port->rxbuf[port->rxbuf_w],
+                      port->rx.DataLength);
+              mstp_receive_ptr->count = port->rx.DataLength;
+              if (verdict == MSTP_RXF_PRIORITY)
+                Q_PushPrio(&port->receive_queue, mstp_receive_ptr);
+              else
+                Q_PushHead(&port->receive_queue, mstp_receive_ptr);
+              if (port->receive_queue.bytes > port->rxq_maxbytes)
+                port->rxq_maxbytes = port->receive_queue.bytes;
+              // printk(MSTP_MSG "Put %d into the receive
+              // queue\n",mstp_receive_ptr->count);
+            }
+            mstpFrameEvent(port, true);
+            port->RFSMstate = rfsmIdle;
+            break;
+          }
+        }
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  return port->RFSMstate;
+}
+
+//////////////////////////////////////////////////////////////////////
+// The Manager Node State Machine
+//
+//	Written as the transitions of clause 9.5.6, each with its own mt*
+//	number (mstp.h) and name (mstpTransitions[]) and a hit counter in
+//	port->mnsm_hits[].  Choosing the transition (mnsmSelect) is kept
+//	apart from taking it (mnsmTransition), so each can be checked
+//	against the standard on its own.
+//
+//	What a received frame does depends only on the state, its FrameType
+//	and whether it was sent to us, broadcast or to someone else.  Those
+//	cases are written down as rules in mnsm_rules[], and mstpCoreInit
+//	compiles them into mnsm_dispatch[], so classifying a frame is one
+//	lookup instead of a chain of compares.  UseToken uses the same table
+//	for the frame it took from send_queue.  Timers, the invalid frame
+//	flags and the counters are checked in code, in the order the
+//	standard gives them, before or after the frame.
+
+// addressing classes
+#define mnsmToUs 0      // DestinationAddress == This_Station
+#define mnsmBroadcast 1 // DestinationAddress == 0xFF
+#define mnsmToOther 2
+#define nMNSMAddressing 3
+
+// frame types and addressing classes a rule covers, one bit each
+#define MT(type) (1 << (type))
+#define MT_ANY 0x1FF // mftToken..mftUnknown
+#define MA(ac) (1 << (ac))
+#define MA_ANY 0x7
+
+struct mnsm_rule {
+  byte state;
+  unsigned short types;
+  byte addressing;
+  byte transition;
+};
+
+// in priority order, the first rule that matches is taken
+static const struct mnsm_rule mnsm_rules[] = {
+    // Idle, a valid frame was received
+    {mnsmIdle, MT_ANY, MA(mnsmToOther), mtReceivedUnwantedFrame}, // (a)
+    {mnsmIdle, MT(mftToken) | MT(mftTestRequest) | MT(mftUnknown),
+     MA(mnsmBroadcast), mtReceivedUnwantedFrame}, // (b) may not be broadcast
+    {mnsmIdle, MT(mftUnknown), MA_ANY,
+     mtReceivedUnwantedFrame}, // (c) proprietary, not known to us
+    {mnsmIdle, MT(mftToken), MA(mnsmToUs), mtReceivedToken},
+    {mnsmIdle, MT(mftPollForManager), MA(mnsmToUs), mtReceivedPFM},
+    {mnsmIdle, MT(mftBACnetDataExpectingReply), MA(mnsmToUs),
+     mtReceivedDataNeedingReply},
+    {mnsmIdle, MT(mftTestRequest), MA(mnsmToUs), mtReceivedTestRequest},
+    {mnsmIdle, MT(mftBACnetDataNotExpectingReply) | MT(mftTestResponse),
+     MA(mnsmToUs) | MA(mnsmBroadcast), mtReceivedDataNoReply},
+    {mnsmIdle, MT(mftBACnetDataExpectingReply), MA(mnsmBroadcast),
+     mtBroadcastDataNeedingReply}, // Addendum 135-2004b-9
+    // (d) ReplyToPollForManager, ReplyPostponed, Addendum 135-2016bm-3
+    {mnsmIdle, MT_ANY, MA_ANY, mtReceivedUnwantedFrame},
+
+    // UseToken, the frame taken from send_queue
+    {mnsmUseToken, MT(mftTestResponse) | MT(mftBACnetDataNotExpectingReply),
+     MA_ANY, mtSendNoWait},
+    {mnsmUseToken, MT(mftBACnetDataExpectingReply), MA(mnsmBroadcast),
+     mtSendNoWait}, // Addendum 135-2004b-9, DER may be broadcast
+    {mnsmUseToken, MT(mftTestRequest) | MT(mftBACnetDataExpectingReply),
+     MA_ANY, mtSendAndWait},
+    {mnsmUseToken, MT_ANY, MA_ANY, mtUnknownFrameType},
+
+    // WaitForReply
+    {mnsmWaitForReply,
+     MT(mftBACnetDataNotExpectingReply) | MT(mftTestResponse), MA(mnsmToUs),
+     mtReceivedReply},
+    {mnsmWaitForReply, MT(mftReplyPostponed), MA(mnsmToUs),
+     mtReceivedPostpone},
+    {mnsmWaitForReply, MT_ANY, MA_ANY, mtReceivedUnexpectedFrame},
+
+    // PollForManager
+    {mnsmPollForManager, MT(mftReplyToPollForManager), MA(mnsmToUs),
+     mtReceivedReplyToPFM},
+    {mnsmPollForManager, MT_ANY, MA_ANY, mtPFMReceivedUnexpectedFrame},
+};
+
+static byte mnsm_dispatch[mnsmAnswerDataRequest + 1][mftUnknown + 1]
+                         [nMNSMAddressing];
+
+const struct mstp_transition mstpTransitions[nMNSMTransitions] = {
+    [mtNone] = {mnsmInitialize, "None"},
+    [mtDoneInitializing] = {mnsmInitialize, "DoneInitializing"},
+    [mtLostToken] = {mnsmIdle, "LostToken"},
+    [mtReceivedInvalidFrame] = {mnsmIdle, "ReceivedInvalidFrame"},
+    [mtReceivedUnwantedFrame] = {mnsmIdle, "ReceivedUnwantedFrame"},
+    [mtReceivedToken] = {mnsmIdle, "ReceivedToken"},
+    [mtReceivedPFM] = {mnsmIdle, "ReceivedPFM"},
+    [mtReceivedDataNeedingReply] = {mnsmIdle, "ReceivedDataNeedingReply"},
+    [mtReceivedTestRequest] = {mnsmIdle, "ReceivedTestRequest"},
+    [mtReceivedDataNoReply] = {mnsmIdle, "ReceivedDataNoReply"},
+    [mtBroadcastDataNeedingReply] = {mnsmIdle, "BroadcastDataNeedingReply"},
+    [mtNothingToSend] = {mnsmUseToken, "NothingToSend"},
+    [mtSendNoWait] = {mnsmUseToken, "SendNoWait"},
+    [mtSendAndWait] = {mnsmUseToken, "SendAndWait"},
+    [mtUnknownFrameType] = {mnsmUseToken, "UnknownFrameType"},
+    [mtSkipDeadStation] = {mnsmUseToken, "SkipDeadStation"},
+    [mtReplyTimeout] = {mnsmWaitForReply, "ReplyTimeout"},
+    [mtInvalidFrame] = {mnsmWaitForReply, "InvalidFrame"},
+    [mtReceivedReply] = {mnsmWaitForReply, "ReceivedReply"},
+    [mtReceivedPostpone] = {mnsmWaitForReply, "ReceivedPostpone"},
+    [mtReceivedUnexpectedFrame] = {mnsmWaitForReply,
+                                   "ReceivedUnexpectedFrame"},
+    [mtSendAnotherFrame] = {mnsmDoneWithToken, "SendAnotherFrame"},
+    [mtNextStationUnknown] = {mnsmDoneWithToken, "NextStationUnknown"},
+    [mtSoleManager] = {mnsmDoneWithToken, "SoleManager"},
+    [mtSoleManagerForcePFM] = {mnsmDoneWithToken, "SoleManagerForcePFM"},
+    [mtSendToken] = {mnsmDoneWithToken, "SendToken"},
+    [mtSendMaintenancePFM] = {mnsmDoneWithToken, "SendMaintenancePFM"},
+    [mtResetMaintenancePFM] = {mnsmDoneWithToken, "ResetMaintenancePFM"},
+    [mtSoleManagerRestartMaintenancePFM] = {mnsmDoneWithToken,
+                                            "SoleManagerRestartMaintenancePFM"},
+    [mtSawTokenUser] = {mnsmPassToken, "SawTokenUser"},
+    [mtRetrySendToken] = {mnsmPassToken, "RetrySendToken"},
+    [mtFindNewSuccessor] = {mnsmPassToken, "FindNewSuccessor"},
+    [mtFindNewSuccessorUnknown] = {mnsmPassToken, "FindNewSuccessorUnknown"},
+    [mtSawFrame] = {mnsmNoToken, "SawFrame"},
+    [mtSawInvalidFrame] = {mnsmNoToken, "SawInvalidFrame"},
+    [mtGenerateToken] = {mnsmNoToken, "GenerateToken"},
+    [mtMissedSlot] = {mnsmNoToken, "MissedSlot"},
+    [mtReceivedReplyToPFM] = {mnsmPollForManager, "ReceivedReplyToPFM"},
+    [mtPFMReceivedUnexpectedFrame] = {mnsmPollForManager,
+                                      "ReceivedUnexpectedFrame"},
+    [mtPFMSoleManager] = {mnsmPollForManager, "SoleManager"},
+    [mtSawOtherTransmitter] = {mnsmPollForManager, "SawOtherTransmitter"},
+    [mtDoneWithPFM] = {mnsmPollForManager, "DoneWithPFM"},
+    [mtSendNextPFM] = {mnsmPollForManager, "SendNextPFM"},
+    [mtDeclareSoleManager] = {mnsmPollForManager, "DeclareSoleManager"},
+    [mtDeferredReply] = {mnsmAnswerDataRequest, "DeferredReply"},
+    [mtPollLostStation] = {mnsmDoneWithToken, "PollLostStation"},
+    [mtSkipExpiredFrame] = {mnsmUseToken, "SkipExpiredFrame"},
+};
+
+///////////////////////////////////////////////////////////////////////
+//	Compile mnsm_rules[] into mnsm_dispatch[]
+
+static void mnsmCompile(void) {
+  const struct mnsm_rule *r;
+  int state, type, ac;
+
+  memset(mnsm_dispatch, mtNone, sizeof(mnsm_dispatch));
+  for (r = mnsm_rules; r < mnsm_rules + ARRAY_SIZE(mnsm_rules); r++)
+    for (type = 0; type <= mftUnknown; type++)
+      for (ac = 0; ac < nMNSMAddressing; ac++)
+        if ((r->types & MT(type)) && (r->addressing & MA(ac)) &&
+            (mnsm_dispatch[r->state][type][ac] == mtNone))
+          mnsm_dispatch[r->state][type][ac] = r->transition;
+  // every frame has to go somewhere in the states that look at frames
+  for (state = 0; state <= mnsmAnswerDataRequest; state++) {
+    int n = 0;
+    for (type = 0; type <= mftUnknown; type++)
+      for (ac = 0; ac < nMNSMAddressing; ac++)
+        n += (mnsm_dispatch[state][type][ac] != mtNone);
+    if (n && (n != (mftUnknown + 1) * nMNSMAddressing))
+      printk(KERN_ERR MSTP_MSG "MNSM rules miss frames in state %d\n", state);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	One time set up of the core, before the first port is initialized
+//
+// out:	0 or -ENOMEM
+
+int mstpCoreInit(void) {
+  mnsmCompile();
+  return alloc_init(); // frame entry caches
+}
+
+void mstpCoreExit(void) { alloc_exit(); }
+
+///////////////////////////////////////////////////////////////////////
+//	Look a frame up in mnsm_dispatch[] for the current state
+//
+// in:	port	the port
+//		type	its FrameType
+//		da		its DestinationAddress
+// out:	the transition, mtNone if the state doesn't take frames
+
+static inline byte mnsmDispatch(struct mstp_port *port, byte type, byte da) {
+  byte ac = mnsmToOther;
+
+  if (da == port->This_Station)
+    ac = mnsmToUs;
+  else if (da == mstpBroadcast)
+    ac = mnsmBroadcast;
+  if (type > mftUnknown)
+    type = mftUnknown;
+  return mnsm_dispatch[port->mnstate][type][ac];
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Which transition, if any, the MNSM takes now
+//
+// in:	port	the port
+//		f		set to the frame taken from send_queue in UseToken
+//		lost	set to the station PollLostStation polls
+// out:	the transition, mtNone to stay put
+
+static byte mnsmSelect(struct mstp_port *port, struct mstp_data_t **f,
+                       byte *lost) {
+  int silence = mstpPortReadSilence(port);
+  int slot, wait;
+  byte t;
+
+  switch (port->mnstate) {
+  case mnsmInitialize:
+    return mtDoneInitializing;
+  case mnsmIdle:
+    if (silence >= port->timing.Tno_token)
+      return mtLostToken;
+    if (port->ReceivedInvalidFrame)
+      return mtReceivedInvalidFrame;
+    if (port->ReceivedValidFrame)
+      return mnsmDispatch(port, port->FrameType, port->DestinationAddress);
+    return mtNone;
+  case mnsmUseToken:
+    if (!Q_Size(&port->send_queue))
+      return mtNothingToSend;
+    *f = mstpTxNext(port);
+    if (*f == NULL) {
+#ifdef EXTRA_DEBUG
+      printk(MSTP_MSG "Got NULL in pop queue in mnsmUseToken\n");
+#endif
+      Q_Empty(&port->send_queue, port->Nmax_info_frames);
+      return mtNothingToSend;
+    }
+    if (mstpTxExpired(port, *f))
+      return mtSkipExpiredFrame;
+    t = mnsmDispatch(port, (*f)->FrameType, (*f)->DestinationAddress);
+    if ((t == mtSendAndWait) &&
+        mstpPeerBlocked(port, (*f)->DestinationAddress, true))
+      return mtSkipDeadStation;
+    return t;
+  case mnsmWaitForReply:
+    if (silence >= port->timing.Treply_timeout)
+      return mtReplyTimeout;
+    if (port->ReceivedInvalidFrame)
+      return mtInvalidFrame;
+    if (port->ReceivedValidFrame)
+      return mnsmDispatch(port, port->FrameType, port->DestinationAddress);
+    return mtNone;
+  case mnsmDoneWithToken:
+    if (port->framecount < port->Nmax_info_frames)
+      return mtSendAnotherFrame;
+    if (port->tokencount < port->timing.Npoll) { // errata, compare with Npoll
+      // the comparison with NS was removed in the 2008 standard
+      // chosen once, a second look may find it heard or aged out
+      if (!port->SoleManager &&
+          ((*lost = mstpRingLost(port)) != MSTP_NO_PEER))
+        return mtPollLostStation;
+      if (!port->SoleManager)
+        return (port->ns == port->This_Station) ? mtNextStationUnknown
+                                                : mtSendToken;
+      return Q_Size(&port->send_queue) ? mtSoleManager : mtSoleManagerForcePFM;
+    }
+    if (port->ns != (port->ps + 1) % (port->Nmax_manager + 1))
+      return mtSendMaintenancePFM;
+    return port->SoleManager ? mtSoleManagerRestartMaintenancePFM
+                             : mtResetMaintenancePFM;
+  case mnsmPassToken:
+    wait = mstpUsageTimeout(port, port->ns, port->Tusage_timeoutTP);
+    if ((silence < wait) && (port->eventcount > port->timing.Nmin_octets))
+      return mtSawTokenUser;
+    if ((silence >= wait) && (port->retrycount < port->timing.Nretry_token))
+      return mtRetrySendToken;
+    wait = mstpUsageTimeout(port, port->ns, port->Tusage_timeout);
+    if ((silence >= wait) && (port->retrycount >= port->timing.Nretry_token)) {
+      // Add 135-2012bg-9, stop node from sending PFM to itself
+      if (port->This_Station == (port->ns + 1) % (port->Nmax_manager + 1))
+        return mtFindNewSuccessorUnknown;
+      return mtFindNewSuccessor;
+    }
+    return mtNone;
+  case mnsmNoToken:
+    slot = port->timing.Tno_token + (port->timing.Tslot * port->This_Station);
+    if ((silence < slot) && (port->eventcount > port->timing.Nmin_octets))
+      return mtSawFrame;
+    // why this, not in standard
+    if ((silence >= slot) && (port->eventcount < port->timing.Nmin_octets) &&
+        port->ReceivedInvalidFrame)
+      return mtSawInvalidFrame;
+    if ((silence >= slot) && (silence <= slot + port->timing.Tslot))
+      return mtGenerateToken;
+    if (port->eventcount > port->timing.Nmin_octets)
+      return mtMissedSlot;
+    return mtNone;
+  case mnsmPollForManager:
+    if (port->ReceivedValidFrame)
+      return mnsmDispatch(port, port->FrameType, port->DestinationAddress);
+    wait = mstpUsageTimeout(port, port->ps, port->Tusage_timeout);
+    if (port->SoleManager) {
+      if ((silence >= wait) || port->ReceivedInvalidFrame)
+        return mtPFMSoleManager;
+      if (port->eventcount > port->timing.Nmin_octets)
+        return mtSawOtherTransmitter;
+      return mtNone;
+    }
+    if ((silence < wait) && !port->ReceivedInvalidFrame)
+      return mtNone;
+    if (port->ns != port->This_Station)
+      return mtDoneWithPFM;
+    if (port->This_Station != (port->ps + 1) % (port->Nmax_manager + 1))
+      return mtSendNextPFM;
+    return mtDeclareSoleManager;
+  case mnsmAnswerDataRequest:
+    return mtDeferredReply;
+  default:
+    return mtNone;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Take a transition
+//
+// in:	port	the port
+//		t		the transition mnsmSelect chose
+//		f		the frame taken from send_queue, for the UseToken ones
+//		lost	the station to poll, for PollLostStation
+// out:	true if we need to immediately transition
+//		false otherwise
+
+static bool mnsmTransition(struct mstp_port *port, byte t,
+                           struct mstp_data_t *f, byte lost) {
+  switch (t) {
+  case mtDoneInitializing:
+    port->ns = port->This_Station;
+    port->ps = port->This_Station;
+    port->tokencount = port->timing.Npoll;
+    if (port->warm_ns != MSTP_NO_PEER) { // pass the first token right on
+      port->ns = port->warm_ns;
+      port->tokencount = 0;
+      port->warm_ns = MSTP_NO_PEER;
+    }
+    port->SoleManager = false;
+    port->ReceivedValidFrame = false;
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmIdle;
+    mstpPortResetSilence(port);
+    return false;
+
+  // Idle
+  case mtLostToken:
+    port->eventcount = 0; // Addendum 135-2004d-8
+    port->mnstate = mnsmNoToken;
+    return false;
+  case mtReceivedInvalidFrame:
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtReceivedToken:
+    port->ReceivedValidFrame = false;
+    port->framecount = 0;
+    port->SoleManager = false;
+    if (port->joined_state == 0) {
+#ifdef EXTRA_DEBUG
+      printk(MSTP_MSG "Joined the MS/TP network\n");
+#endif
+      port->joined_state = 1;
+      port->online = true;
+    }
+    port->tok_visits++;
+    mstpTokenArrived(port);
+    port->mnstate = mnsmUseToken;
+    return true;
+  case mtReceivedPFM:
+    SendFrame(port, mftReplyToPollForManager, port->SourceAddress,
+              port->This_Station, NULL, 0);
+    if (port->joined_state == 1) {
+#ifdef EXTRA_DEBUG
+      printk(MSTP_MSG "Rec'd a PFM after joining\n");
+#endif
+      port->joined_state = 0;
+    }
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtReceivedDataNeedingReply:
+    port->ReplyTimer = 0;
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmAnswerDataRequest;
+    return false;
+  case mtReceivedTestRequest:
+    // handle this here w/o application's involvement, it's ok to respond
+    // with no data if there isn't space to echo it
+    SendFrame(port, mftTestResponse, port->SourceAddress, port->This_Station,
+              port->InputBuffer,
+              ((port->InputBuffer != NULL) &&
+               (port->DataLength <= (maxtx - 21)))
+                  ? port->DataLength
+                  : 0);
+    mstpRxbufRelease(port); // copied to OutputBuffer, the next may come now
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtReceivedUnwantedFrame:
+  case mtReceivedDataNoReply:
+  case mtBroadcastDataNeedingReply:
+    port->ReceivedValidFrame = false; // just drop it
+    port->mnstate = mnsmIdle;
+    return false;
+
+  // UseToken
+  case mtNothingToSend:
+    port->framecount = port->Nmax_info_frames;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtSendNoWait:
+    SendQueuedFrame(port, f);
+    free_entry(f);
+    port->framecount++;
+    port->tok_frames++;
+    if (port->framecount == port->Nmax_info_frames)
+      port->tok_full++;
+    port->mnstate = mnsmDoneWithToken; // send the next frame asap
+    return true;
+  case mtSendAndWait:
+    port->mnstate = mnsmWaitForReply; // ok to exit and enter later
+    port->reply_from = f->DestinationAddress;
+    SendQueuedFrame(port, f);
+    port->txr_wait = port->txr_busy;
+    port->reply_sent = mstpPortClock(port);
+    free_entry(f);
+    port->framecount++;
+    port->tok_frames++;
+    if (port->framecount == port->Nmax_info_frames)
+      port->tok_full++;
+    return false;
+  case mtUnknownFrameType: // drop it, drop it like it's hot
+#ifdef EXTRA_DEBUG
+    printk(MSTP_MSG "Unknown Frame type in output queue\n");
+#endif
+    mstpTxrDrop(port, f, MSTP_TXR_DROPPED);
+    free_entry(f);
+    port->framecount = port->Nmax_info_frames;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtSkipDeadStation: // it would only cost us Treply_timeout
+    mstpTxrDrop(port, f, MSTP_TXR_DROPPED);
+    free_entry(f);
+    port->peer_failed++;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtSkipExpiredFrame: // doesn't count against Nmax_info_frames
+    mstpTxrDrop(port, f, MSTP_TXR_EXPIRED);
+    free_entry(f);
+    port->tx_expired++;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+
+  // WaitForReply
+  case mtReplyTimeout:
+    mstpReplyDone(port, true);
+    mstpTxrReply(port, MSTP_TXR_TIMEOUT);
+    mstpPeerMiss(port, port->reply_from, port->peer_timeouts);
+    port->framecount = port->Nmax_info_frames;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtInvalidFrame:
+    mstpReplyDone(port, false);
+    mstpTxrReply(port, MSTP_TXR_NOREPLY);
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtReceivedReply:
+  case mtReceivedPostpone:
+    mstpReplyDone(port, true);
+    mstpTxrReply(port, (t == mtReceivedReply) ? MSTP_TXR_REPLY
+                                              : MSTP_TXR_POSTPONED);
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmDoneWithToken;
+    return true;
+  case mtReceivedUnexpectedFrame:
+    mstpReplyDone(port, false);
+    mstpTxrReply(port, MSTP_TXR_NOREPLY);
+    // fall through
+  case mtPFMReceivedUnexpectedFrame:
+#ifdef EXTRA_DEBUG
+    if (port->SoleManager)
+      printk(MSTP_MSG "ReceivedUnexpectedFrame in state %d\n", port->mnstate);
+#endif
+    port->SoleManager = false;
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmIdle; // drop token on purpose
+    return false;
+
+  // DoneWithToken
+  case mtSendAnotherFrame:
+    port->mnstate = mnsmUseToken;
+    return true;
+  case mtNextStationUnknown: // Addendum 135-2008v-1
+    port->ps = (port->This_Station + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->mnstate = mnsmPollForManager;
+    return false;
+  case mtSoleManager:
+    port->framecount = 0;
+    port->tokencount++;
+    port->tok_visits++;
+    port->mnstate = mnsmUseToken;
+    return true;
+  case mtSoleManagerForcePFM:
+    // nothing to send, so force the next PFM now instead of waiting 50
+    // tokens; without it a node can wait up to 300ms at the end of the
+    // PFM cycle, and we don't want that since it's a useless wait
+    port->framecount = port->Nmax_info_frames;
+    port->tokencount = port->timing.Npoll;
+    return true;
+  case mtSendToken:
+    port->tokencount++;
+    SendFrame(port, mftToken, port->ns, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->eventcount = 0;
+    port->mnstate = mnsmPassToken;
+    return false;
+  case mtPollLostStation:
+    // a PFM like the maintenance ones, its answer becomes NS and the
+    // maintenance PFMs go on from there; nothing else was between us
+    // and it when it passed the token
+    port->tokencount++;
+    port->ps = lost;
+    port->rejoin_polls++;
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->mnstate = mnsmPollForManager;
+    return false;
+  case mtSendMaintenancePFM:
+    port->ps = (port->ps + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->mnstate = mnsmPollForManager;
+    return false;
+  case mtResetMaintenancePFM:
+    mstpRingTune(port);
+    port->ps = port->This_Station;
+    SendFrame(port, mftToken, port->ns, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->eventcount = 0;
+    port->tokencount = 1;
+    port->mnstate = mnsmPassToken;
+    return false;
+  case mtSoleManagerRestartMaintenancePFM:
+    port->ps = (port->ns + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->ns = port->This_Station;
+    port->retrycount = 0;
+    port->tokencount = 0; // Addendum 135-2004d-8
+    port->mnstate = mnsmPollForManager;
+    return false;
+
+  // PassToken
+  case mtSawTokenUser:
+    if (port->retrycount == 0)
+      mstpUsageSample(port, port->ns);
+    mstpJoined(port);
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtRetrySendToken:
+    mstpPeerMiss(port, port->ns, port->timing.Nretry_token + 1);
+    mstpUsageMissed(port, port->ns);
+    port->retrycount++;
+    SendFrame(port, mftToken, port->ns, port->This_Station, NULL, 0);
+    port->eventcount = 0;
+    port->mnstate = mnsmPassToken;
+    return false;
+  case mtFindNewSuccessorUnknown:
+  case mtFindNewSuccessor:
+    mstpPeerMiss(port, port->ns, port->timing.Nretry_token + 1);
+    mstpRingTune(port);
+    port->ps = (t == mtFindNewSuccessorUnknown) ? port->This_Station : port->ns;
+    port->ps = (port->ps + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->ns = port->This_Station;
+    port->retrycount = 0;
+    port->tokencount = 0;
+    port->mnstate = mnsmPollForManager;
+    return false;
+
+  // NoToken
+  case mtSawInvalidFrame:
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtSawFrame:
+  case mtMissedSlot: // another manager is present
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtGenerateToken:
+    port->ps = (port->This_Station + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->ns = port->This_Station;
+    port->retrycount = 0;
+    port->tokencount = 0;
+    port->mnstate = mnsmPollForManager;
+    return false;
+
+  // PollForManager
+  case mtReceivedReplyToPFM:
+    mstpUsageSample(port, port->SourceAddress);
+    port->SoleManager = false;
+    port->ns = port->SourceAddress;
+    port->eventcount = 0;
+    // pass token to node that replied
+    SendFrame(port, mftToken, port->ns, port->This_Station, NULL, 0);
+    port->ps = port->This_Station;
+    port->tokencount = 0;
+    port->retrycount = 0;
+    port->ReceivedValidFrame = false;
+    port->mnstate = mnsmPassToken;
+    return false;
+  case mtPFMSoleManager: // there was no valid reply, use the token
+    port->framecount = 0;
+    port->tok_visits++;
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmUseToken;
+    return true;
+  case mtSawOtherTransmitter:
+    // this transition isn't in the standard, at all (no addendum, no
+    // errata). We've previously declared SoleManager yet seen Nmin_octets
+    // of traffic, so there must be another manager on the network. Exit
+    // SoleManager and wait in IDLE for the network to "naturally" re-sync.
+#ifdef EXTRA_DEBUG
+    printk(MSTP_MSG "Previously SoleManager, but detected other traffic\n");
+#endif
+    port->SoleManager = false;
+    port->ns = port->This_Station;
+    port->ps = port->This_Station;
+    port->framecount = 0;
+    port->eventcount = 0;
+    port->retrycount = 0;
+    port->tokencount = 0;
+    port->mnstate = mnsmIdle;
+    return false;
+  case mtDoneWithPFM: // no valid reply to the maintenance PFM at PS
+    if (port->peer[port->ps].manager)
+      mstpPeerMiss(port, port->ps, port->timing.Nretry_token + 1);
+    port->eventcount = 0;
+    SendFrame(port, mftToken, port->ns, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmPassToken;
+    return false;
+  case mtSendNextPFM:
+    if (port->peer[port->ps].manager)
+      mstpPeerMiss(port, port->ps, port->timing.Nretry_token + 1);
+    port->ps = (port->ps + 1) % (port->Nmax_manager + 1);
+    SendFrame(port, mftPollForManager, port->ps, port->This_Station, NULL, 0);
+    port->retrycount = 0;
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmPollForManager;
+    return false;
+  case mtDeclareSoleManager:
+#ifdef EXTRA_DEBUG
+    printk(MSTP_MSG "Declared SoleManager\n");
+#endif
+    port->SoleManager = true;
+    mstpJoined(port);
+    port->joined_state = 0;
+    port->online = true;
+    port->eventcount = 0;
+    port->framecount = 0;
+    port->tok_visits++;
+    port->ReceivedInvalidFrame = false;
+    port->mnstate = mnsmUseToken;
+    return true;
+
+  // AnswerDataRequest
+  case mtDeferredReply:
+    SendFrame(port, mftReplyPostponed, port->SourceAddress,
+              port->This_Station, NULL, 0);
+    port->mnstate = mnsmIdle;
+    return false;
+  default:
+    return false;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+//	Run the MNSM once
+//
+//	out: true if we need to immediately transition
+//		 false otherwise
+
+static bool ManagerNodeStateMachine(struct mstp_port *port) {
+  struct mstp_data_t *f = NULL;
+  byte lost = MSTP_NO_PEER;
+  byte t = mnsmSelect(port, &f, &lost);
+
+  if (t == mtNone)
+    return false;
+  port->mnsm_hits[t]++;
+  return mnsmTransition(port, t, f, lost);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Build the wire image of a frame
+//
+// in:	buf		at least MSTP_HDR_LEN + data_len + 3 octets
+//		type	frame type
+//		da		destination address
+//		sa		source address
+//		data	any data to be sent - may be null
+//		data_len	number of bytes of data (up to 501)
+//
+// out:	the number of octets in buf
+
+int mstpBuildFrame(byte *buf, byte type, byte da, byte sa, const byte *data,
+                   unsigned data_len) {
+  byte HeaderCRC; // used for running CRC calculation
+  union {
+    unsigned short dw;
+    byte db[2];
+  } u;
+  unsigned int i;
+  int size;
+
+  // Transmit the preamble octets X'55', X'FF'.
+  // As each octet is transmitted, set SilenceTimer to zero.
+  buf[0] = (UINT8)0x55;
+  buf[1] = (UINT8)0xFF;
+  HeaderCRC = (UINT8)0xFF;
+  HeaderCRC = CalcHeaderCRC(type, HeaderCRC);
+  // Transmit the Frame Type, Destination Address, Source Address,
+  // and Data Length octets. Accumulate each octet into HeaderCRC.
+  // As each octet is transmitted, set SilenceTimer to zero.
+  buf[2] = type;
+  HeaderCRC = CalcHeaderCRC(da, HeaderCRC);
+  buf[3] = da;
+  HeaderCRC = CalcHeaderCRC(sa, HeaderCRC);
+  buf[4] = sa;
+
+  // use a union here to get the MSB and LSB of DataLen
+  u.dw = data_len;
+  buf[5] = u.db[1];
+  HeaderCRC = CalcHeaderCRC(u.db[1], HeaderCRC);
+  buf[6] = u.db[0];
+  HeaderCRC = CalcHeaderCRC(u.db[0], HeaderCRC);
+  // Transmit the ones-complement of HeaderCRC. Set SilenceTimer to zero.
+  buf[7] = ~HeaderCRC;
+  size = 8;
+
+  // If there are data octets, initialize DataCRC to X'FFFF'.
+  if (data_len > 0) {
+    u.dw = 0xFFFF;
+    // Transmit any data octets. Accumulate each octet into DataCRC.
+    // As each octet is transmitted, set SilenceTimer to zero.
+    memmove(&buf[8], data, data_len);
+    size += data_len;
+    for (i = 0; i < data_len; i++) {
+      u.dw = CalcDataCRC(data[i], u.dw);
+    }
+    // Transmit the ones-complement of DataCRC, least significant octet first.
+    // As each octet is transmitted, set SilenceTimer to zero.
+    buf[8 + data_len] = ~u.db[0];
+    size++;
+    buf[9 + data_len] = ~u.db[1];
+    size++;
+  }
+#ifdef USE_PAD_BYTE
+  buf[size] = 0xFF; // pad
+  size++;
+#endif
+  return size;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Token, Poll For Manager and Reply To Poll For Manager templates
+//
+//	These are all the MNSM sends while passing the token around, and for
+//	a given This_Station there are only 128 of each.  Rebuilt whenever
+//	the MAC address changes.
+
+void mstpBuildTemplates(struct mstp_port *port) {
+  int type, da;
+
+  for (type = mftToken; type <= mftReplyToPollForManager; type++)
+    for (da = 0; da < MSTP_TEMPLATES; da++)
+      port->txtemplate_len = mstpBuildFrame(
+          port->txtemplate[type][da], type, da, port->This_Station, NULL, 0);
+}
+
+// put a finished wire image on the line, Tturnaround has passed
+
+static void mstpSendImage(struct mstp_port *port, const byte *buf, int size,
+                          u64 t0) {
+  int bytes_written;
+
+  port->tx_done = false;
+  if (buf[2] == mftToken)
+    port->TX_Token_Count++;
+  if (buf[2] == mftPollForManager)
+    port->TX_PFM_Count++;
+  if ((buf[2] == mftToken) || (buf[2] == mftPollForManager))
+    mstpUsageSent(port);
+  mstpPortResetSilence(port);
+  bytes_written = mstpPortSend(port, buf, size);
+  if (bytes_written < 0)
+    return; /* no backend */
+  port->num_tx_bytes += bytes_written;
+  mstpPortResetSilence(port);
+  mstpPortSetSilence(port, CalcTXTime(port, (word)bytes_written + 3) * -1);
+  PROF_ADD(port, sendframe, t0);
+}
+
+/**************************************************************
+ * SendFrame
+ **************************************************************
+ * UINT8 SendFrameType  --> type of frame to send - see defines
+ * UINT8 destination  	--> destination address
+ * UINT8 source		    --> source address
+ * UINT8 *data          --> any data to be sent - may be null
+ * unsigned data_len    --> number of bytes of data (up to 501)
+ **************************************************************/
+void SendFrame(struct mstp_port *port, byte SendFrameType, byte destination,
+               byte src, byte *data, unsigned data_len) {
+  int size;
+  u64 t0;
+  if (destination == port->This_Station)
+    return; // never send to ourselves
+  t0 = PROF_NOW();
+
+  mstpPortTurnaround(port);
+
+  if ((SendFrameType <= mftReplyToPollForManager) && (data_len == 0) &&
+      (src == port->This_Station) && (destination < MSTP_TEMPLATES)) {
+    mstpSendImage(port, port->txtemplate[SendFrameType][destination],
+                  port->txtemplate_len, t0);
+    return;
+  }
+  size = mstpBuildFrame(port->OutputBuffer, SendFrameType, destination, src,
+                        data, data_len);
+  mstpSendImage(port, port->OutputBuffer, size, t0);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	Send a frame from the send queue, its wire image was built by
+//	mstpQueueFrame
+//
+// in:	port	the port
+//		f		the frame
+
+void SendQueuedFrame(struct mstp_port *port, struct mstp_data_t *f) {
+  u64 t0;
+  if (f->DestinationAddress == port->This_Station) {
+    mstpTxrDrop(port, f, MSTP_TXR_DROPPED);
+    return; // never send to ourselves
+  }
+  t0 = PROF_NOW();
+
+  mstpPortTurnaround(port);
+  mstpTxrStart(port, f);
+  mstpSendImage(port, f->data, f->wirelen, t0);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	calculate Header CRC (from BACnet Appendix G)
+// in:	dv	data value to accumulate
+//		cv	current crc value
+// out:	new crc
+
+byte CalcHeaderCRC(byte dv, byte cv) {
+  uint16_t crc;
+
+  crc = cv ^ dv;
+  crc = crc ^ (crc << 1) ^ (crc << 2) ^ (crc << 3) ^ (crc << 4) ^ (crc << 5) ^
+        (crc << 6) ^ (crc << 7);
+  return (octet)((crc & 0xFE) ^ ((crc >> 8) & 1));
+}
+
+///////////////////////////////////////////////////////////////////////
+//	calculate Data CRC (from BACnet Appendix G)
+// in:	dv	data value to accumulate
+//		cv	current crc value
+// out:	new crc
+
+word CalcDataCRC(byte dv, word cv) {
+  uint16_t crcLow;
+  crcLow = (cv & 0xFF) ^ dv;
+  return (cv >> 8) ^ (crcLow << 8) ^ (crcLow << 3) ^ (crcLow << 12) ^
+         (crcLow >> 4) ^ (crcLow & 0x0F) ^ ((crcLow & 0x0F) << 7);
+}
+
@@ -35,19 +35,22 @@ divisive language
 #define __KERNEL__
 #endif
 
-#include "mstp.h"
-#include "queue.h"
+#include "mstpport.h"
 #include <asm/delay.h> //udelay, busywait
 #include <asm/ioctls.h>
 #include <asm/termios.h>
 #include <asm/uaccess.h>
 #include <linux/delay.h>
 #include <linux/hrtimer.h>
+#include <linux/if_packet.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
 #include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/netdevice.h>
 #include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/rtnetlink.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -62,7 +65,6 @@ divisive language
 #define ver 530      // version*100
 #define DEV_MSTP 345 /* just random */
 #define HW_LEN INPUT_BUFFER_SIZE
-//#define USE_PAD_BYTE 1
 //#define EXTRA_DEBUG 1
 #define IO_TEST_PIN 48
 
@@ -74,111 +76,170 @@ unsigned char mod_state;
 #define STATE_Ready 'R'
 #define STATE_Done 'D'
 
-/* hrtimer settings */
+/* hrtimer settings, the period is the port's timing.tick_us */
 #define NSEC_PER_MSEC 1000000L
-static struct hrtimer hr_timer;
-enum hrtimer_restart enHRTimer = HRTIMER_NORESTART;
-s64 i64TimeInNsec = 1 * NSEC_PER_MSEC;
+#define mstp_tick_ns(port) ((s64)(port)->timing.tick_us * NSEC_PER_USEC)
 
 ///////////////////////////////////////////////////////////////////////
-//	MS/TP constant values
-
-#define Npoll                                                                  \
-  50 // number of tokens received or used before Poll for Manager (fixed)
-#define Nretrytoken 1     // number of retries on sending the token (fixed)
-#define Nminoctets 4      // number of "events (octets) for active line (fixed)
-#define Tframeabort 100   //(60 bit times) 100 ms max (fixed)
-#define Tframegap 20      //(20 bit times) (fixed)
-#define Tnotoken 500      // silence time for loss of token (fixed)
-#define Tpostdrive 15     //(15 bit times) (fixed)
-#define Treplydelay 200   // 200 ms (fixed) the lower the better!		***223
-#define Treplytimeout 300 // 300 ms (fixed)
-#define Tslot 10          // 10 ms (fixed)
-
-/* this structure stores what goes to the upper layers */
-struct mstp_data_t {
-  unsigned char SourceAddress;
-  unsigned char DestinationAddress;
-  unsigned char FrameType;
-  unsigned char data[INPUT_BUFFER_SIZE]; /* Here's the data! 		*/
-  int count;                             /* how much data?			*/
-  void *next;
+//	MS/TP ports
+//
+//	One struct mstp_port per tty with our line discipline, allocated in
+//	mstp_open and hung off tty->disc_data.  mstp_ports[] only exists so
+//	/proc can find them; it is protected by mstp_ports_mutex.
+
+#define nMSTPports 32
+
+static struct mstp_port *mstp_ports[nMSTPports];
+static DEFINE_MUTEX(mstp_ports_mutex);
+
+///////////////////////////////////////////////////////////////////////
+//	Warm restart
+//
+//	mstp_close keeps what a port with a MAC address knew about the ring
+//	under the name of its tty, and the next mstp_open of that tty within
+//	warm_age ms starts from it (mstpWarmRestore) instead of waiting for
+//	MSTP_IOC_SETMACADDRESS.  Also protected by mstp_ports_mutex.
+
+struct mstp_warm_slot {
+  char name[64];
+  struct mstp_warm *w;
 };
 
+static struct mstp_warm_slot mstp_warm[nMSTPports];
+
 ///////////////////////////////////////////////////////////////////////
-//	MS/TP variable values
-
-static byte This_Station = 0xFE;
-static unsigned int Nmax_info_frames = 10;
-static unsigned int Nmax_manager = 127;
-static word Index = 0;
-static byte HeaderCRC = 0xFF;
-static word DataCRC = 0xFFFF;
-static bool ReceivedValidFrame = false;
-static bool ReceivedInvalidFrame = false;
-static byte FrameType;
-static byte SourceAddress;
-static byte DestinationAddress;
-static word DataLength = 0;
-static byte SoleManager;
-static byte ns, ps;
-static bool DataAvailable;
-static byte tokencount = 0;
-static byte framecount = 0;
-static byte retrycount = 0;
-static byte RFSMstate = rfsmIdle;
-static byte mnstate = mnsmInitialize;
-static int rx_errors = 0;
-static int Tturnaround = (40 / 38400);
-static byte InputBuffer[maxrx];
-static byte OutputBuffer[maxtx];
-static u_long ReplyTimer = 0;
-static int eventcount = 0;
-static int Tusage_timeout = 35;
-static int Tusage_timeoutTP = 85;
-static queue receive_queue = {0};
-static queue send_queue = {0};
-static unsigned int headercrccnt = 0;
-static unsigned int datacrcerrcnt = 0;
-static unsigned int rxinvalidframe = 0;
-static int baud = 38400;
-struct tty_struct *mstp_tty = NULL;
-static int num_rx_errors = 0;
-static int num_fe = 0;
-static int num_pe = 0;
-static int num_oe = 0;
-static int num_unkerr = 0;
-static int frame_abort_errors = 0;
-static unsigned long num_rx_bytes = 0;
-static unsigned long true_delay = 0;
-static unsigned long num_tx_bytes = 0;
-static unsigned long TX_PFM_Count = 0;
-static unsigned long RX_PFM_Count = 0;
-static unsigned long TX_Token_Count = 0;
-static unsigned long RX_Token_Count = 0;
-static unsigned long Num_Invalid_Large_Frames = 0;
-static unsigned long numHdrCRCErrs = 0;
-static unsigned long numDataCRCErrs = 0;
-static unsigned char errb[maxrx + 8];
-static bool online = false;
-static unsigned long SentPacketCounter = 0;
-static unsigned long RecdPacketCounter = 0;
-static int joined_state = 0;
-/* Spinlock to protect the mstp_tty */
-DEFINE_SPINLOCK(mstp_tty_lock);
+//	MNSM thread
+//
+//	By default the MNSM runs in the hrtimer callback with the port's
+//	spinlock held and IRQs off, SendFrame and the turnaround busy-wait
+//	included.  With mnsm_thread=1 every port gets a SCHED_FIFO kthread
+//	that owns the MNSM instead: the hrtimer, the receive path and the
+//	uart's write_wakeup only kick it, the port is serialized with a mutex
+//	and the turnaround sleeps.  mnsm_cpu pins the threads to one CPU.
+
+static bool mnsm_thread;
+module_param(mnsm_thread, bool, 0444);
+MODULE_PARM_DESC(mnsm_thread, "run the MNSM in a SCHED_FIFO kthread per port");
+
+static int mnsm_cpu = -1;
+module_param(mnsm_cpu, int, 0444);
+MODULE_PARM_DESC(mnsm_cpu, "CPU for the MNSM threads, -1 for any");
 
 ///////////////////////////////////////////////////////////////////////
-//	MS/TP constant values
+//	Receive queue limits for new ports, MSTP_IOC_SETRX* changes them per
+//	port.  The RFSM queues frames whether or not anybody reads them.
+
+static unsigned int rx_frames = 64;
+module_param(rx_frames, uint, 0644);
+MODULE_PARM_DESC(rx_frames, "most frames waiting for read(), 0 for no limit");
+
+static unsigned int rx_bytes = 16384;
+module_param(rx_bytes, uint, 0644);
+MODULE_PARM_DESC(rx_bytes, "most octets waiting for read(), 0 for no limit");
 
-#define Nmaxmanager Nmax_manager
-#define Tusagetimeout Tusage_timeout
-#define Tframe_abort Tframeabort
-#define Tno_token Tnotoken
-#define Nmin_octets Nminoctets
-#define Nretry_token Nretrytoken
-#define Treply_timeout Treplytimeout
+static unsigned int rx_policy = MSTP_RXQ_DROP_NEWEST;
+module_param(rx_policy, uint, 0644);
+MODULE_PARM_DESC(rx_policy,
+                 "when full: 0 drop newest, 1 drop oldest, 2 per-source fair");
 
-#define nMSTPports 1
+///////////////////////////////////////////////////////////////////////
+//	Dead peer detection for new ports, MSTP_IOC_SETPEER* changes it per
+//	port, see mstpPeerMiss in mstpcore.c
+
+static unsigned int peer_timeouts = 3;
+module_param(peer_timeouts, uint, 0644);
+MODULE_PARM_DESC(peer_timeouts,
+                 "reply timeouts in a row before a station is dead, 0 off");
+
+static unsigned int peer_probe = 10000;
+module_param(peer_probe, uint, 0644);
+MODULE_PARM_DESC(peer_probe,
+                 "ms between requests let through to a dead station");
+
+// the order frames leave send_queue in, MSTP_IOC_SETTXSCHED per port
+static unsigned int tx_sched = MSTP_TXS_FIFO;
+module_param(tx_sched, uint, 0644);
+MODULE_PARM_DESC(tx_sched, "1 sends frames needing no reply first, 0 FIFO");
+
+// Nmax_manager from the ring map, MSTP_IOC_SETRINGTUNE per port
+static unsigned int ring_tune = MSTP_RING_OFF;
+module_param(ring_tune, uint, 0644);
+MODULE_PARM_DESC(ring_tune,
+                 "1 lowers Nmax_manager to the managers seen, 0 only suggests");
+
+// Tusage_timeout from what each station needs, MSTP_IOC_SETUSAGEADAPT
+static bool usage_adapt;
+module_param(usage_adapt, bool, 0644);
+MODULE_PARM_DESC(usage_adapt,
+                 "wait for stations to use a token as long as they need");
+
+// frames write() holds while off the ring, MSTP_IOC_SETHOLD* per port
+static unsigned int hold_frames = MSTP_HOLD_FRAMES;
+module_param(hold_frames, uint, 0644);
+MODULE_PARM_DESC(hold_frames,
+                 "frames written before joining the ring that are kept");
+
+static unsigned int hold_age = MSTP_HOLD_AGE;
+module_param(hold_age, uint, 0644);
+MODULE_PARM_DESC(hold_age, "ms a frame written before joining is kept");
+
+// ms a written frame may wait for the token, MSTP_IOC_SETTXTTL per port
+static unsigned int tx_ttl;
+module_param(tx_ttl, uint, 0644);
+MODULE_PARM_DESC(tx_ttl, "ms a written frame may wait to be sent, 0 forever");
+
+// MSTP_IOC_SETTOKNOTIFY and MSTP_IOC_SETTOKLEAD per port
+static bool tok_notify;
+module_param(tok_notify, bool, 0644);
+MODULE_PARM_DESC(tok_notify, "poll() reports POLLPRI when the token is near");
+
+static unsigned int tok_lead = 10;
+module_param(tok_lead, uint, 0644);
+MODULE_PARM_DESC(tok_lead, "ms before the token POLLPRI comes, plus jitter");
+
+static bool rejoin_poll = true;
+module_param(rejoin_poll, bool, 0644);
+MODULE_PARM_DESC(rejoin_poll,
+                 "poll a manager that dropped out of the ring on every token");
+
+static unsigned int warm_age = 30000;
+module_param(warm_age, uint, 0644);
+MODULE_PARM_DESC(warm_age,
+                 "ms a closed port's ring state is kept for the next open, 0 never");
+
+// a network interface per port, see mstp_net_* below
+static bool netdev;
+module_param(netdev, bool, 0444);
+MODULE_PARM_DESC(netdev, "register a net_device (mstp%d) for every port");
+
+#define MSTP_KICK_TICK 0   // 1 ms passed
+#define MSTP_KICK_FRAME 1  // the RFSM finished a frame
+#define MSTP_KICK_TXDONE 2 // the uart can take more
+
+///////////////////////////////////////////////////////////////////////
+//	Hot path time accounting
+
+#define MSTP_LATE_TICK_NS(port) (mstp_tick_ns(port) / 4)
+
+// take/release the port lock, accounting for how long it was held
+#define mstp_lock(port, flags)                                                 \
+  do {                                                                         \
+    if ((port)->mnsm_task) {                                                   \
+      flags = 0;                                                               \
+      mutex_lock(&(port)->mnsm_mutex);                                         \
+    } else                                                                     \
+      spin_lock_irqsave(&(port)->lock, flags);                                 \
+    (port)->lock_t0 = PROF_NOW();                                              \
+  } while (0)
+
+#define mstp_unlock(port, flags)                                               \
+  do {                                                                         \
+    PROF_ADD(port, lockhold, (port)->lock_t0);                                 \
+    if ((port)->mnsm_task)                                                     \
+      mutex_unlock(&(port)->mnsm_mutex);                                       \
+    else                                                                       \
+      spin_unlock_irqrestore(&(port)->lock, flags);                            \
+  } while (0)
 
 static char *mnsm_strings[] = {
     "00 Initialize",   "01 Idle",           "02 UseToken",
@@ -188,6 +249,8 @@ static char *mnsm_strings[] = {
 static char *rfsm_strings[] = {"00 Idle", "01 Preamble", "02 Header", "03 Data",
                                "04 SkipData"};
 
+static char *rxq_strings[] = {"drop newest", "drop oldest", "per-source fair"};
+
 #ifdef __cplusplus
 extern "C" { /* Assume C declarations for C++ */
 #endif       /* __cplusplus */
@@ -195,27 +258,20 @@ extern "C" { /* Assume C declarations for C++ */
 ///////////////////////////////////////////////////////////////////////
 //	function prototypes
 
-static word CalcDataCRC(byte dv, word cv);
-static octet CalcHeaderCRC(byte dv, byte cv);
-int CalcTXTime(word);
-static void SendFrame(byte SendFrameType, byte destination, byte src,
-                      byte *data, unsigned data_len);
-struct mstp_data_t *ChkTxQ(byte);
-struct mstp_data_t *GetTxQ(byte);
-static u_char RFSM(u_char ch);
-static bool ManagerNodeStateMachine(void);
 static ssize_t mstp_read(struct tty_struct *tty, struct file *file,
-                         unsigned char __user *buf, size_t nr, void **cookie, unsigned long offset);
+                         unsigned char __user *buf, size_t nr, void **cookie,
+                         unsigned long offset);
 static ssize_t mstp_write(struct tty_struct *tty, struct file *file,
                           const unsigned char *buf, size_t nr);
 static unsigned int mstp_poll(struct tty_struct *tty, struct file *filp,
                               poll_table *wait);
 
-// NOTE: these functions are in the low level uart driver
+// NOTE: these functions are in the low level uart driver (or mstpvbus.c),
+// each one works on the port the tty belongs to
 extern void mstpSetToMSTP(struct tty_struct *tty);
-extern int mstpReadSilenceTimer(void);
-extern void mstpResetSilenceTimer(void);
-extern void mstpSetSilenceTimer(int val);
+extern int mstpReadSilenceTimer(struct tty_struct *tty);
+extern void mstpResetSilenceTimer(struct tty_struct *tty);
+extern void mstpSetSilenceTimer(struct tty_struct *tty, int val);
 extern int mstpTransmitComplete(struct tty_struct *tty);
 extern unsigned long mstpShutdownLock(struct tty_struct *tty);
 extern void mstpShutdownUnlock(struct tty_struct *tty, unsigned long);
@@ -225,1090 +281,431 @@ extern void mstpShutdownUnlock(struct tty_struct *tty, unsigned long);
 #endif /* __cplusplus */
 
 ///////////////////////////////////////////////////////////////////////
-//	initialize mstp subsystem
+//	Hooks the protocol core calls, see mstp.h
+//
+//	In the kernel these go straight to the low level uart driver
 
-void mstpVarInit(byte port, int turnaround) {
-  if (port > nMSTPports)
-    return;
-  headercrccnt = 0;
-  datacrcerrcnt = 0;
-  rxinvalidframe = 0;
+int mstpPortReadSilence(struct mstp_port *port) {
+  return mstpReadSilenceTimer(port->tty);
 }
 
-///////////////////////////////////////////////////////////////////////
-//	Calculate the Transmit Time of a buffered frame
-//
-// in:	n			the number of octets to send
-//		baudrate	the baudrate
-//
-// out:	calculated transmit time in msec
+void mstpPortResetSilence(struct mstp_port *port) {
+  mstpResetSilenceTimer(port->tty);
+}
 
-int CalcTXTime(word n) {
-  int tt;
+void mstpPortSetSilence(struct mstp_port *port, int val) {
+  mstpSetSilenceTimer(port->tty, val);
+}
 
-  switch (baud) // we must calculate how long it will take to transmit
-  {
-  case 9600:
-    tt = (int)n; // 9600 is approximately 1 msec per octet
-    break;
-  case 19200:
-    tt = (int)(n >> 1); // 19200 is approximately 0.5 msec per octet
-    break;
-  case 38400:
-    tt = (int)(n >> 2); // 38400 is approximately 0.25 msec per octet
-    break;
-  case 76800:
-    tt = (int)(n >> 4); // 76800 is approximately 0.125 msec per octet
-    break;
-  case 57600:
-    tt = (int)((n >> 2) +
-               (n >> 1)); // 57600 is approximately 0.166 msec per octet
-    break;
-  case 115200:
-    tt = (int)((n >> 2) +
-               (n >> 1)); // 115200 is approximately 0.083 msec per octet
-    tt >>= 2;
-    break;
-  default:
-    tt = (int)n; // default is approximately 1 msec per octet
-    break;
+// done when we hold nothing back, the tty driver has nothing buffered and
+// the uart says its shift register is empty
+int mstpPortTransmitComplete(struct mstp_port *port) {
+  if (port->txpend_len || tty_chars_in_buffer(port->tty))
+    return 0;
+  return mstpTransmitComplete(port->tty);
+}
+
+void mstpPortTurnaround(struct mstp_port *port) {
+  int x;
+  u64 tw;
+  if (!port->tty)
+    return;
+
+  // anything less than 38400 will have a
+  // true delay greater than 2000us which
+  // an invalid value for udelay
+
+  tw = PROF_NOW();
+  x = 0;
+  if (port->baud < 38400) {
+    if (mstpReadSilenceTimer(port->tty) < port->Tturnaround)
+      x = (port->Tturnaround * USEC_PER_MSEC) -
+          (mstpReadSilenceTimer(port->tty) * USEC_PER_MSEC);
+  } else {
+    x = port->true_delay;
+  }
+  if (port->mnsm_task) {
+    // the MNSM thread may sleep, and being SCHED_FIFO it wakes up on time
+    if (x > 0)
+      usleep_range(x, x + 20);
+  } else if (port->baud < 38400) {
+    while (x > 0) {
+      udelay(1);
+      x--;
+    }
+  } else {
+    udelay(x);
   }
-  return tt;
+  PROF_ADD(port, turnaround, tw);
 }
 
-///////////////////////////////////////////////////////////////////////
-//	Reset
-//
-//	Resets the state machines (goes back to startup)
-//
-// in:	port	the port number to reset
+int mstpPortSend(struct mstp_port *port, const byte *buf, int len) {
+  struct tty_struct *tty = port->tty;
+  int n = 0;
+
+  if (!tty || !tty->ops->write)
+    return -1; /* no backend */
+  // write_wakeup continues the frame and tells us when it is gone
+  set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+  port->tx_busy = true;
+  if (port->txpend_len == 0) {
+    n = tty->ops->write(tty, buf, len);
+    if (n < 0)
+      return n;
+  }
+  if (n < len) {
+    // a small uart FIFO, keep the rest for mstp_tx_service
+    if (port->txpend_off) {
+      memmove(port->txpend, port->txpend + port->txpend_off,
+              port->txpend_len);
+      port->txpend_off = 0;
+    }
+    if (port->txpend_len + len - n > (int)sizeof(port->txpend))
+      return n; // can't happen, the MNSM waits for the previous frame
+    memcpy(port->txpend + port->txpend_len, buf + n, len - n);
+    port->txpend_len += len - n;
+    port->tx_partial++;
+  }
+  return len;
+}
 
-void mstpReset(byte port) {
-  mnstate = mnsmInitialize;             // we've been starved of time, restart
-  mstpSetSilenceTimer(Tframeabort + 1); // to reset the RFSM
-  RFSMstate = rfsmIdle;
+unsigned int mstpPortClock(struct mstp_port *port) {
+  return jiffies_to_msecs(jiffies);
+}
+
+unsigned long long mstpPortTime(struct mstp_port *port) {
+  return ktime_get_ns();
+}
+
+// the port is locked, wake_up does not sleep
+void mstpPortTokenEvent(struct mstp_port *port) {
+  wake_up_interruptible(&port->tok_wq);
 }
 
 ///////////////////////////////////////////////////////////////////////
-//	Work function for servicing MNSM
+//	Transmit completion
 //
-
-void mstpTimerCallback(void) {
-  bool transitionnow = false;
-  unsigned long flags;
-  if (This_Station > 127)
-    return; // not yet inited
-  spin_lock_irqsave(&mstp_tty_lock, flags);
-  if (!mstp_tty)
-    goto end;
-  if (!mstpTransmitComplete(mstp_tty))
-    goto end;
-  if (mstpReadSilenceTimer() > 0) {
-    transitionnow = ManagerNodeStateMachine();
-    while ((transitionnow == true) && (mstpReadSilenceTimer() > 0) &&
-           (mstpTransmitComplete(mstp_tty))) {
-      transitionnow = ManagerNodeStateMachine();
+//	Hand the uart the rest of a partly written frame, and notice when the
+//	last octet has left the line so the MNSM can go on right away instead
+//	of waiting for SilenceTimer to pass the estimate SendFrame left in it.
+//	Runs from write_wakeup (through mnsm_task or tx_work) and from every
+//	tick, for uarts that don't wake us up once their shift register is
+//	empty.  Called with the port locked.
+
+static void mstp_tx_service(struct mstp_port *port) {
+  struct tty_struct *tty = port->tty;
+  int n;
+
+  if (!tty || !port->tx_busy)
+    return;
+  set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags); // before we look, or we miss it
+  if (port->txpend_len) {
+    n = tty->ops->write(tty, port->txpend + port->txpend_off,
+                        port->txpend_len);
+    if (n > 0) {
+      port->txpend_off += n;
+      port->txpend_len -= n;
     }
+    if (port->txpend_len == 0)
+      port->txpend_off = 0;
+    return; // it has only just been queued
   }
-end:
-  spin_unlock_irqrestore(&mstp_tty_lock, flags);
-  return;
+  if (!mstpPortTransmitComplete(port))
+    return;
+  clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+  port->tx_busy = false;
+  port->tx_done = true;
+  mstpResetSilenceTimer(tty); // the line went quiet just now
 }
 
 ///////////////////////////////////////////////////////////////////////
-//	Receive Frame State Machine
+//	Network interface
+//
+//	With netdev=1 every port also registers a net_device, so the BACnet
+//	stack can use AF_PACKET sockets (PACKET_MMAP included), qdiscs and
+//	the usual tools instead of read() and write() on the tty.  The link
+//	layer header is the one write() takes, MSTP_NET_HLEN in mstp_ioctl.h.
 //
+//	receive_queue, with its limits and drop policy, stays the backlog
+//	between the RFSM and the stack.  While the interface is up the
+//	receive path schedules NAPI and mstp_net_poll hands the frames over,
+//	at most budget per run; read() only gets frames while it is down.
+//	ndo_start_xmit queues like write(), mstpQueueFrame takes one of them
+//	at a time, and stops the queue as soon as send_queue is full, so
+//	frames wait in the qdisc, where they can be prioritized and shaped,
+//	rather than in the ldisc.  A frame that still finds it full, write()
+//	got there first, is dropped.  The tick wakes the queue again and
+//	keeps the carrier in step with the ring.
+
+struct mstp_net {
+  struct mstp_port *port;
+  struct napi_struct napi;
+};
 
-static u_char RFSM(u_char ch) {
-  struct mstp_data_t *mstp_receive_ptr;
-  static unsigned long hbpos = 0;
-  switch (RFSMstate) {
-  case rfsmIdle:
-    if (rx_errors != 0) // EatAnError
-    {
-      rx_errors = 0;
-      mstpResetSilenceTimer();
-      eventcount++;
-      RFSMstate = rfsmIdle;
-      break;
-    } else if (rx_errors == 0) // EatAnOctet
-    {
-      if (DataAvailable == true) {
-        if (ch != 0x55) {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          eventcount++;
-          RFSMstate = rfsmIdle;
-          break;
-        } else if (ch == 0x55) // Preamble1
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          eventcount++;
-          hbpos = 0;
-          errb[hbpos++] = ch;
-          RFSMstate = rfsmPreamble;
-          break;
-        }
-      }
-    }
-    break;
-  case rfsmPreamble:
-    if (mstpReadSilenceTimer() > Tframe_abort) // Timeout
-    {
-      frame_abort_errors++;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors != 0) // Error
-    {
-      mstpResetSilenceTimer();
-      eventcount++;
-      RFSMstate = rfsmIdle;
-      break;
-    } else if (rx_errors == 0) {
-      if (DataAvailable == true) {
-        if (ch == 0xFF) // Preamble2
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          eventcount++;
-          errb[hbpos++] = ch;
-          Index = 0;
-          HeaderCRC = 0xFF;
-          RFSMstate = rfsmHeader;
-          break;
-        } else if (ch == 0x55) // RepeatedPreamble1
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          eventcount++;
-          errb[hbpos++] = ch;
-          RFSMstate = rfsmPreamble;
-          break;
-        } else // if((ch!=0x55) && (ch!=0xFF))				//Not
-               // Preamble
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          eventcount++;
-          errb[hbpos++] = ch;
-          RFSMstate = rfsmIdle;
-          break;
-        }
-      }
-    }
-    break;
-  case rfsmHeader:
-    if (mstpReadSilenceTimer() > Tframe_abort) // Timeout
-    {
-      frame_abort_errors++;
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors != 0) // Error
-    {
-      rx_errors = 0;
-      mstpResetSilenceTimer();
-      eventcount++;
-      errb[hbpos++] = ch;
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if ((rx_errors == 0) && (DataAvailable == true)) {
-      if (Index == 0) // FrameType
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        FrameType = ch;
-        Index = 1;
-        RFSMstate = rfsmHeader;
-        break;
-      }
-      if (Index == 1) // DestinationAddress
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        DestinationAddress = ch;
-        Index = 2;
-        RFSMstate = rfsmHeader;
-        break;
-      }
-      if (Index == 2) // SourceAddress
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        SourceAddress = ch;
-        Index = 3;
-        RFSMstate = rfsmHeader;
-        break;
-      }
-      if (Index == 3) // Length1
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        DataLength = ch * 256;
-        Index = 4;
-        RFSMstate = rfsmHeader;
-        break;
-      }
-      if (Index == 4) // Length2
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        DataLength += ch;
-        Index = 5;
-        RFSMstate = rfsmHeader;
-        break;
-      }
-      if (Index == 5) // HeaderCRC
-      {
-        DataAvailable = false;
-        mstpResetSilenceTimer();
-        eventcount++;
-        errb[hbpos++] = ch;
-        HeaderCRC = CalcHeaderCRC(ch, HeaderCRC);
-        // printk(MSTP_MSG "Header CRC=%02X -->
-        // %s,Index=%d\n",HeaderCRC,rfsm_strings[RFSMstate],Index);
-        if (HeaderCRC != 0x55) // BadCRC
-        {
-          // printk(MSTP_MSG "*****Header CRC Error!******\n");
-          ReceivedInvalidFrame = true;
-          RFSMstate = rfsmIdle;
-          numHdrCRCErrs++;
-          // memcpy(errb,hb,hbpos-1);
-          errb[++hbpos] = HeaderCRC;
-          break;
-        } else if (HeaderCRC ==
-                   0x55) // HeaderCRC state follows, not a state per se though
-        {
-          memset(errb, 0x00, sizeof(errb));
-          if ((DestinationAddress != This_Station) && // NotForUs
-              (DestinationAddress != 0xFF) && (DataLength == 0)) {
-            RFSMstate = rfsmIdle;
-            hbpos = 0;
-            break;
-          } else {
-            if (DestinationAddress == This_Station) {
-              if (FrameType == mftToken) {
-                RX_Token_Count++;
-              }
-              if (FrameType == mftPollForManager) {
-                RX_PFM_Count++;
-              }
-            }
-            if (DataLength == 0) // No Data
-            {
-              ReceivedValidFrame = true;
-              RFSMstate = rfsmIdle;
-              break;
-            } else if ((DataLength != 0) && // Data
-                       (DataLength <= maxrx)) {
-              if ((DestinationAddress !=
-                   This_Station) && // DataNotForUs (Addendum 135-2008z-3)
-                  (DestinationAddress != 0xFF)) {
-                Index = 0;
-                RFSMstate = rfsmSkipData;
-                break;
-              } else {
-                Index = 0;
-                DataCRC = 0xFFFF;
-                RFSMstate = rfsmData;
-                break;
-              }
-            } else // FrameTooLong
-            {
-              if (DataLength <= (maxrx * 2)) {
-                RFSMstate = rfsmSkipData; // reasonable length
-              } else // This is an invalid length, don't try to consume it
-              {
-                Num_Invalid_Large_Frames++;
-                DataAvailable = false;
-                mstpResetSilenceTimer();
-                ReceivedInvalidFrame = true;
-                RFSMstate = rfsmIdle;
-                hbpos = 0;
-              }
-              break;
-            }
-          }
-        }
-      }
-    }
-    break;
-  case rfsmSkipData: // SkipData (Addendum 135-2008z-3)
-    if (mstpReadSilenceTimer() > Tframe_abort) // Timeout
-    {
-      frame_abort_errors++;
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors != 0) // Error
-    {
-      rx_errors = 0;
-      mstpResetSilenceTimer();
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors == 0) {
-      if (DataAvailable) {
-        if (Index < (DataLength + 1)) // DataOctet
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          Index++;
-          RFSMstate = rfsmSkipData;
-          break;
-        } else if (Index == (DataLength + 1)) // Done
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          RFSMstate = rfsmIdle;
-          break;
-        }
-      }
-    }
-    break;
-  case rfsmData:
-    if (mstpReadSilenceTimer() > Tframe_abort) // Timeout
-    {
-      frame_abort_errors++;
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors != 0) // Error
-    {
-      rx_errors = 0;
-      mstpResetSilenceTimer();
-      ReceivedInvalidFrame = true;
-      RFSMstate = rfsmIdle;
-      break;
-    }
-    if (rx_errors == 0) {
-      if (DataAvailable == true) {
-        if (Index <= DataLength) // Data
-        {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          DataCRC = CalcDataCRC(ch, DataCRC);
-          InputBuffer[Index++] = ch;
-          RFSMstate = rfsmData;
-          break;
-        } else if (Index == (DataLength + 1)) {
-          DataAvailable = false;
-          mstpResetSilenceTimer();
-          DataCRC = CalcDataCRC(ch, DataCRC);
-          if (DataCRC != 0xF0B8) {
-            ReceivedInvalidFrame = true;
-            RFSMstate = rfsmIdle;
-            numDataCRCErrs++;
-            break;
-          } else if (DataCRC == 0xF0B8) {
-            ReceivedValidFrame = true;
-            // the following is "outside" the standard
-            // as soon as we get any data that's broadcast or for TS
-            // then we hand it off to the RxQ for processing
-            if (FrameType == mftBACnetDataExpectingReply ||
-                FrameType ==
-                    mftBACnetDataNotExpectingReply) // queue only these types
-            {
-              mstp_receive_ptr =
-                  (struct mstp_data_t *)alloc_entry(sizeof(struct mstp_data_t));
-              if (!mstp_receive_ptr) {
-                ReceivedValidFrame = false;
-                RFSMstate = rfsmIdle;
-                break;
-              }
-              mstp_receive_ptr->SourceAddress = SourceAddress;
-              mstp_receive_ptr->DestinationAddress = DestinationAddress;
-              mstp_receive_ptr->FrameType = FrameType;
-              memmove(mstp_receive_ptr->data, InputBuffer, DataLength);
-              mstp_receive_ptr->count = DataLength;
-              Q_PushHead(&receive_queue, mstp_receive_ptr);
-              // printk(MSTP_MSG "Put %d into the receive
-              // queue\n",mstp_receive_ptr->count);
-            }
-            RFSMstate = rfsmIdle;
-            break;
-          }
-        }
-      }
-    }
-    break;
-  default:
-    break;
+// would mstpQueueFrame take another frame?
+static bool mstp_net_room(struct mstp_port *port) {
+  return Q_Size(&port->send_queue) < (int)port->Nmax_info_frames;
+}
+
+// would it send it?  off the ring mstpQueueFrame only holds frames, and
+// the qdisc is the better place for that
+static bool mstp_net_joined(struct mstp_port *port) {
+  return (port->joined_state != 0) && (port->SoleManager != true);
+}
+
+static int mstp_net_open(struct net_device *dev) {
+  struct mstp_net *net = netdev_priv(dev);
+
+  napi_enable(&net->napi);
+  netif_start_queue(dev);
+  if (Q_Size(&net->port->receive_queue)) {
+    local_bh_disable();
+    napi_schedule(&net->napi);
+    local_bh_enable();
   }
-  return RFSMstate;
+  return 0;
 }
 
-//////////////////////////////////////////////////////////////////////
-// The Manager Node State Machine
-//	out: true if we need to immediately transition
-//		 false otherwise
-
-static bool ManagerNodeStateMachine(void) {
-  bool transitionnow = false;
-  static struct mstp_data_t *mstp_send_ptr;
-  switch (mnstate) {
-  case mnsmInitialize:
-    ns = This_Station;
-    ps = This_Station;
-    tokencount = Npoll;
-    SoleManager = false;
-    ReceivedValidFrame = false;
-    ReceivedInvalidFrame = false;
-    mnstate = mnsmIdle;
-    mstpResetSilenceTimer();
-    break;
-  case mnsmIdle:
-    if (mstpReadSilenceTimer() >= Tno_token) // LostToken
-    {
-      eventcount = 0; // Addendum 135-2004d-8
-      mnstate = mnsmNoToken;
-      break;
-    }
-    if (ReceivedInvalidFrame == true) // ReceivedInvalidFrame
-    {
-      ReceivedInvalidFrame = false;
-      mnstate = mnsmIdle;
-      break;
-    }
-    if (ReceivedValidFrame == true) {
-      if ((DestinationAddress != This_Station) && // ReceivedUnwantedFrame (a)
-          (DestinationAddress != 0xFF)) {
-        ReceivedValidFrame = false;
-        mnstate = mnsmIdle;
-        break;
-      }
-      if ((DestinationAddress ==
-           0xFF) && //(b) -- such frames may not be broadcast
-          ((FrameType == mftToken) || (FrameType == mftTestRequest) ||
-           (FrameType >= mftUnknown))) {
-        ReceivedValidFrame = false;
-        mnstate = mnsmIdle;
-        break;
-      }
-      if (FrameType >= mftUnknown) //(c) -- proprietary not know to us
-      {
-        ReceivedValidFrame = false;
-        mnstate = mnsmIdle;
-        break;
-      }
-      if (DestinationAddress == This_Station) {
-        if (FrameType == mftToken) // ReceivedToken
-        {
-          ReceivedValidFrame = false;
-          framecount = 0;
-          SoleManager = false;
-          if (joined_state == 0) {
-#ifdef EXTRA_DEBUG
-            printk(MSTP_MSG "Joined the MS/TP network\n");
-#endif
-            joined_state = 1;
-            online = true;
-          }
-          mnstate = mnsmUseToken;
-          transitionnow = true;
-          return transitionnow;
-          // break;
-        }
-        if (FrameType == mftPollForManager) {
-          SendFrame(mftReplyToPollForManager, SourceAddress, This_Station, NULL,
-                    0);
-          if (joined_state == 1) {
-#ifdef EXTRA_DEBUG
-            printk(MSTP_MSG "Rec'd a PFM after joining\n");
-#endif
-            joined_state = 0;
-          }
-          ReceivedValidFrame = false;
-          mnstate = mnsmIdle;
-          break;
-        }
-        if (FrameType ==
-            mftBACnetDataExpectingReply) // ReceivedDataNeedingReply
-        {
-          ReplyTimer = 0;
-          ReceivedValidFrame = false;
-          mnstate = mnsmAnswerDataRequest;
-          break;
-        }
-        if (FrameType == mftTestRequest) // ReceivedTestRequest
-        {
-          if (DataLength <= (maxtx - 21)) // we have space to echo data
-            SendFrame(
-                mftTestResponse, SourceAddress, This_Station, InputBuffer,
-                DataLength); // handle this here w/o application's involvement
-          else               // it's ok to respond with no data
-            SendFrame(mftTestResponse, SourceAddress, This_Station, InputBuffer,
-                      0); // handle this here w/o application's involvement
-          ReceivedValidFrame = false;
-          mnstate = mnsmIdle;
-          break;
-        }
-        if (FrameType == mftTestResponse) // ReceivedTestResponse
-        {
-          ReceivedValidFrame = false; // just drop it
-          mnstate = mnsmIdle;
-          break;
-        }
-        if ((FrameType ==
-             mftReplyToPollForManager) || // Addendum 135-2016bm-3 (case d in
-                                          // ReceivedUnwantedFrame)
-            (FrameType == mftReplyPostponed)) {
-          ReceivedValidFrame = false; // just drop it
-          mnstate = mnsmIdle;
-          break;
-        }
-      }
-      if ((DestinationAddress == This_Station) || // ReceivedDataNoReply
-          (DestinationAddress == 0xFF)) {
-        if (FrameType == mftBACnetDataNotExpectingReply) {
-          ReceivedValidFrame = false;
-          mnstate = mnsmIdle;
-          break;
-        }
-      }
-      if ((DestinationAddress == 0xFF) &&
-          (FrameType == mftBACnetDataExpectingReply)) // BroadcastDataNeedingReply
-                                                      // (Addendum 135-2004b-9)
-      {
-        ReceivedValidFrame = false;
-        mnstate = mnsmIdle;
-        break;
-      }
-    }
-    break;
-  case mnsmUseToken:
-    if (!Q_Size(&send_queue)) // NothingToSend
-    {
-      framecount = Nmax_info_frames;
-      mnstate = mnsmDoneWithToken;
-      transitionnow = true;
-      return transitionnow;
-    } else {
-      mstp_send_ptr = (struct mstp_data_t *)Q_PopTail(&send_queue);
-      if (mstp_send_ptr == NULL) {
-#ifdef EXTRA_DEBUG
-        printk(MSTP_MSG "Got NULL in pop queue in mnsmUseToken\n");
-#endif
-        Q_Empty(&send_queue, Nmax_info_frames);
-        framecount = Nmax_info_frames;
-        mnstate = mnsmDoneWithToken;
-        transitionnow = true;
-        return transitionnow;
-      } else // if(mstp_send_ptr!=NULL)
-      {
-        if ((mstp_send_ptr->FrameType == mftTestResponse) ||
-            (mstp_send_ptr->FrameType == mftBACnetDataNotExpectingReply) ||
-            ((mstp_send_ptr->FrameType ==
-              mftBACnetDataExpectingReply) && // Addendum 135-2004b-9, allow DER
-                                              // to be broadcast
-             (mstp_send_ptr->DestinationAddress == 0xFF))) {
-          transitionnow = true;
-          SendFrame(mstp_send_ptr->FrameType, mstp_send_ptr->DestinationAddress,
-                    mstp_send_ptr->SourceAddress, mstp_send_ptr->data,
-                    mstp_send_ptr->count);
-          framecount++;
-          mnstate = mnsmDoneWithToken; // SendNoWait, send the next frame asap
-        } else if ((mstp_send_ptr->FrameType == mftTestRequest) ||
-                   ((mstp_send_ptr->FrameType == mftBACnetDataExpectingReply) &&
-                    (mstp_send_ptr->DestinationAddress != 0xFF))) {
-          mnstate = mnsmWaitForReply; // SendAndWait, ok to exit and enter later
-          SendFrame(mstp_send_ptr->FrameType, mstp_send_ptr->DestinationAddress,
-                    mstp_send_ptr->SourceAddress, mstp_send_ptr->data,
-                    mstp_send_ptr->count);
-          framecount++;
-        } else // UnknownFrameType, drop it, drop it like it's hot
-        {
-#ifdef EXTRA_DEBUG
-          printk(MSTP_MSG "Unknown Frame type in output queue\n");
-#endif
-          framecount = Nmax_info_frames;
-          mnstate = mnsmDoneWithToken;
-          transitionnow = true;
-          free_entry(mstp_send_ptr);
-          return transitionnow;
-        }
-        free_entry(mstp_send_ptr);
-      }
-      break;
-    }
-    break;
-  case mnsmWaitForReply:
-    if (mstpReadSilenceTimer() >= Treply_timeout) // ReplyTimeout
-    {
-      framecount = Nmax_info_frames;
-      mnstate = mnsmDoneWithToken;
-      transitionnow = true;
-      return transitionnow;
-      // break;
-    } else // SilenceTimer < Treply_timeout
-    {
-      if (ReceivedInvalidFrame == true) // InvalidFrame
-      {
-        ReceivedInvalidFrame = false;
-        mnstate = mnsmDoneWithToken;
-        transitionnow = true;
-        return transitionnow;
-        // break;
-      }
-      if (ReceivedValidFrame == true) {
-        if (DestinationAddress == This_Station) {
-          if ((FrameType == mftBACnetDataNotExpectingReply) ||
-              (FrameType == mftTestResponse) || // ReceivedReply
-              (FrameType == mftReplyPostponed))
-          // || or FrameType is an NER proprietary frame
-          {
-            ReceivedValidFrame = false;
-            mnstate = mnsmDoneWithToken;
-            transitionnow = true;
-            return transitionnow;
-            // break;
-          }
-        } else // UnexpectedFrame
-        {
-          if (SoleManager == (byte) true) {
-#ifdef EXTRA_DEBUG
-            printk(MSTP_MSG "ReceivedUnexpectedFrame in PFM state 1096\n");
-#endif
-            SoleManager = false;
-          }
-          ReceivedValidFrame = false;
-          mnstate = mnsmIdle; // drop token on purpose
-          return false;
-          // break;
-        }
-      }
-    }
-    break;
-  case mnsmDoneWithToken:
-    if (framecount < Nmax_info_frames) {
-      mnstate = mnsmUseToken;
-      transitionnow = true;
-      return transitionnow;
-      // break;
-    } else {
-      if (tokencount < (Npoll)) // errata, compare with Npoll
-      {
-        if ((SoleManager == false) &&
-            (ns == This_Station)) // NextStationUnknown (Addendum 135-2008v-1)
-        {
-          ps = (This_Station + 1) % (Nmaxmanager + 1);
-          SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-          retrycount = 0;
-          mnstate = mnsmPollForManager;
-          break;
-        }
-        if (SoleManager == (byte) true) // SoleManager
-        {
-          // this first check is to force the next PFM
-          // without it, a node can wait up to 300ms at the end
-          // of the PFM cycle, and we don't want that since it's
-          // a useless wait
-          if (!Q_Size(
-                  &send_queue)) // correct 300 ms gap after poll for max manager
-          {
-            framecount = Nmax_info_frames;
-            tokencount =
-                Npoll; // force the next PFM...now instead of waiting 50 tokens
-            return true;
-          } else {
-            framecount = 0;
-            tokencount++;
-            mnstate = mnsmUseToken;
-            return true;
-          }
-          // no need to break; here, as we return directly from each the above
-          // cases
-        }
-        // the comparison with NS was removed in the 2008 standard
-        if ((SoleManager == false)) // || (ns==((TS+1)%(Nmaxmanager+1))))
-                                    // //SendToken
-        {
-          tokencount++;
-          SendFrame(mftToken, ns, This_Station, NULL, 0);
-          retrycount = 0;
-          eventcount = 0;
-          mnstate = mnsmPassToken;
-          break;
-        }
-      } else if ((tokencount >= (Npoll))) // errata, compare with Npoll
-      {
-        if (ns != (ps + 1) % (Nmaxmanager + 1)) // SendMaintenancePFM
-        {
-          ps = (ps + 1) % (Nmaxmanager + 1);
-          SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-          retrycount = 0;
-          mnstate = mnsmPollForManager;
-          break;
-        } else {
-          if (SoleManager == false) // ResetMaintenancePFM
-          {
-            ps = This_Station;
-            SendFrame(mftToken, ns, This_Station, NULL, 0);
-            retrycount = 0;
-            eventcount = 0;
-            tokencount = 1;
-            mnstate = mnsmPassToken;
-            break;
-          } else // SoleManagerRestartMaintenancePFM
-          {
-            ps = (ns + 1) % (Nmaxmanager + 1);
-            SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-            ns = This_Station;
-            retrycount = 0;
-            tokencount = 0; // Addendum 135-2004d-8
-            // eventcount=0;								//Addendum
-            // 135-2004d-8
-            mnstate = mnsmPollForManager;
-            break;
-          }
-        }
-      }
-    }
-    break;
-  case mnsmPassToken:
-    if ((mstpReadSilenceTimer() < Tusage_timeoutTP) && // SawTokenUser
-        (eventcount > Nmin_octets)) {
-      mnstate = mnsmIdle;
-      break;
-    }
-    if ((mstpReadSilenceTimer() >= Tusage_timeoutTP) && // RetrySendToken
-        (retrycount < Nretry_token)) {
-      retrycount++;
-      SendFrame(mftToken, ns, This_Station, NULL, 0);
-      eventcount = 0;
-      mnstate = mnsmPassToken;
-      break;
-    }
-    if ((mstpReadSilenceTimer() >= Tusage_timeout) &&
-        (retrycount >= Nretry_token)) {
-      if (This_Station ==
-          ((ns + 1) %
-           (Nmaxmanager + 1))) // FindNewSuccessorUnknown - Add 135-2012bg-9,
-                               // stop node from sending PFM to itself
-      {
-        ps = ((This_Station + 1) % (Nmaxmanager + 1));
-        SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-        ns = This_Station;
-        retrycount = 0;
-        tokencount = 0;
-        mnstate = mnsmPollForManager;
-        break;
-      } else // FindNewSuccessor
-      {
-        ps = ((ns + 1) % (Nmaxmanager + 1));
-        SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-        ns = This_Station;
-        retrycount = 0;
-        tokencount = 0;
-        mnstate = mnsmPollForManager;
-        break;
-      }
-    }
-    break;
-  case mnsmNoToken:
-    if ((mstpReadSilenceTimer() <
-         (Tno_token + (Tslot * This_Station))) && // SawFrame
-        (eventcount > Nmin_octets)) {
-      mnstate = mnsmIdle;
-      break;
-    }
-    if ((mstpReadSilenceTimer() >=
-         ((Tno_token + (Tslot * This_Station)))) && // why this,not in standard
-        (eventcount < Nmin_octets) &&
-        (ReceivedInvalidFrame == true)) {
-      ReceivedInvalidFrame = false;
-      mnstate = mnsmIdle;
-      break;
-    }
-    if ((mstpReadSilenceTimer() >=
-         ((Tno_token + (Tslot * This_Station)))) && // GenerateToken
-        (mstpReadSilenceTimer() <=
-         (Tno_token + (Tslot * (This_Station + 1))))) {
-      ps = ((This_Station + 1) % (Nmaxmanager + 1));
-      SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-      ns = This_Station;
-      retrycount = 0;
-      tokencount = 0;
-      // eventcount=0;
-      // //Addendum 135-2004d-8
-      mnstate = mnsmPollForManager;
-      break;
-    }
-    if (eventcount > Nmin_octets) {
-      mnstate = mnsmIdle; // we missed our slot and another manager is preent
-      break;
-    }
-    break;
-  case mnsmPollForManager:
-    if (ReceivedValidFrame == true) {
-      if ((DestinationAddress == This_Station) && // ReceivedReplyToPFM
-          (FrameType == mftReplyToPollForManager)) {
-        SoleManager = false;
-        ns = SourceAddress;
-        eventcount = 0;
-        SendFrame(mftToken, ns, This_Station, NULL,
-                  0); // pass token to node that replied
-        ps = This_Station;
-        tokencount = 0;
-        retrycount = 0;
-        ReceivedValidFrame = false;
-        mnstate = mnsmPassToken;
-        break;
-      }
-      if ((DestinationAddress != This_Station) || // ReceivedUnexpectedFrame
-          (FrameType != mftReplyToPollForManager)) {
-        if (SoleManager == (byte) true) {
-#ifdef EXTRA_DEBUG
-          printk(MSTP_MSG "ReceivedUnexpectedFrame in PFM state 1290\n");
-#endif
-          SoleManager = false;
-        }
-        ReceivedValidFrame = false;
-        mnstate = mnsmIdle; // drop token on purpose
-        return false;
-      }
-      break;
-    }
-    if ((SoleManager == (byte) true) && // SoleManager
-        ((mstpReadSilenceTimer() >= Tusage_timeout) ||
-         (ReceivedInvalidFrame ==
-          true))) // there was no valid reply, use the token
-    {
-      framecount = 0;
-      ReceivedInvalidFrame = false;
-      mnstate = mnsmUseToken;
-      transitionnow = true;
-      return transitionnow;
-    }
-    // this transition isn't in the standard, at all (no addendum, no errata)
-    // the concept here is that we've previously declared SoleManager
-    // yet, we've encountered at Nmin_octets of traffic, so therefore
-    // there must be another manager on the network. Exit SoleManager and
-    // just wait for the network to "naturally" re-sync.
-    if ((SoleManager == (byte) true) &&
-        (eventcount >
-         Nmin_octets)) // SawOtherTransmitter (rejoin network from SoleManager)
-    {
-#ifdef EXTRA_DEBUG
-      printk(MSTP_MSG "Previously SoleManager, but detected other traffic\n");
-#endif
-      SoleManager =
-          false; // we were SoleManager, but other traffic means be silent
-      ns = This_Station;
-      ps = This_Station;
-      framecount = 0;
-      eventcount = 0;
-      retrycount = 0;
-      tokencount = 0;
-      mnstate = mnsmIdle; // return to IDLE and wait for a poll to us
-      return false;
-    }
-    if (SoleManager == false) {
-      if (((mstpReadSilenceTimer() >= Tusage_timeout) ||
-           (ReceivedInvalidFrame == true))) {
-        if (ns !=
-            This_Station) // DoneWithPFM -- there was no valid reply to the
-                          // maintenance poll for a manager at address PS
-        {
-          eventcount = 0;
-          SendFrame(mftToken, ns, This_Station, NULL,
-                    0); // pass the token to the next station
-          retrycount = 0;
-          ReceivedInvalidFrame = false;
-          mnstate = mnsmPassToken;
-          break;
-        }
-        if (ns == This_Station) {
-          if (This_Station != (ps + 1) % (Nmaxmanager + 1)) // SendNextPFM
-          {
-            ps = (ps + 1) % (Nmaxmanager + 1);
-            SendFrame(mftPollForManager, ps, This_Station, NULL, 0);
-            retrycount = 0;
-            ReceivedInvalidFrame = false;
-            mnstate = mnsmPollForManager;
-            break;
-          }
-          if (This_Station ==
-              (ps + 1) % (Nmaxmanager + 1)) // Declare SoleManager
-          {
-#ifdef EXTRA_DEBUG
-            printk(MSTP_MSG "Declared SoleManager\n");
-#endif
-            SoleManager = true;
-            joined_state = 0;
-            online = true;
-            eventcount = 0;
-            framecount = 0;
-            ReceivedInvalidFrame = false;
-            mnstate = mnsmUseToken;
-            transitionnow = true;
-            return transitionnow;
-          }
-        }
-      }
-    }
-    break;
-  case mnsmAnswerDataRequest:
-    SendFrame(mftReplyPostponed, SourceAddress, This_Station, NULL, 0);
-    mnstate = mnsmIdle;
-    break;
-  default:
-    break;
+static int mstp_net_stop(struct net_device *dev) {
+  struct mstp_net *net = netdev_priv(dev);
+
+  netif_stop_queue(dev);
+  napi_disable(&net->napi);
+  return 0;
+}
+
+// no more until the tick sees room again
+static void mstp_net_stop_full(struct net_device *dev,
+                               struct mstp_port *port) {
+  if (mstp_net_room(port))
+    return;
+  netif_stop_queue(dev);
+  if (mstp_net_room(port)) // the MNSM took one meanwhile
+    netif_wake_queue(dev);
+}
+
+static netdev_tx_t mstp_net_xmit(struct sk_buff *skb, struct net_device *dev) {
+  struct mstp_net *net = netdev_priv(dev);
+  struct mstp_port *port = net->port;
+  int rc;
+
+  if (!netif_carrier_ok(dev)) {
+    dev->stats.tx_carrier_errors++;
+    goto drop;
   }
-  return transitionnow;
-}
-
-/**************************************************************
- * SendFrame
- **************************************************************
- * UINT8 SendFrameType  --> type of frame to send - see defines
- * UINT8 destination  	--> destination address
- * UINT8 source		    --> source address
- * UINT8 *data          --> any data to be sent - may be null
- * unsigned data_len    --> number of bytes of data (up to 501)
- **************************************************************/
-static void SendFrame(byte SendFrameType, byte destination, byte src,
-                      byte *data, unsigned data_len) {
-  byte HeaderCRC; // used for running CRC calculation
-  union {
-    unsigned short dw;
-    byte db[2];
-  } u;
-  unsigned int i;
-  int bytes_written = 0;
-  int OutputBufferSize;
-  int x;
-  if (!mstp_tty || !mstp_tty->ops->write)
-    return; /* no backend */
-  if (destination == This_Station)
-    return; // never send to ourselves
+  if (skb_linearize(skb))
+    goto drop;
+  rc = mstpQueueFrame(port, skb->data, skb->len);
+  if (rc < 0) {
+    if (rc == -ENOMEM)
+      dev->stats.tx_fifo_errors++; // write() filled send_queue first
+    dev->stats.tx_errors++;
+    goto drop;
+  }
+  dev->stats.tx_packets++;
+  dev->stats.tx_bytes += skb->len - MSTP_NET_HLEN;
+  dev_kfree_skb_any(skb);
+  mstp_net_stop_full(dev, port);
+  return NETDEV_TX_OK;
+drop:
+  dev->stats.tx_dropped++;
+  dev_kfree_skb_any(skb);
+  mstp_net_stop_full(dev, port);
+  return NETDEV_TX_OK;
+}
 
-  // anything less than 38400 will have a
-  // true delay greater than 2000us which
-  // an invalid value for udelay
+static void mstp_net_stats(struct net_device *dev,
+                           struct rtnl_link_stats64 *s) {
+  struct mstp_port *port = ((struct mstp_net *)netdev_priv(dev))->port;
+
+  netdev_stats_to_stats64(s, &dev->stats);
+  s->rx_dropped += port->rxq_drop_newest + port->rxq_drop_oldest +
+                   port->rxq_drop_fair + port->rxq_nomem;
+  s->rx_crc_errors = port->numHdrCRCErrs + port->numDataCRCErrs;
+  s->rx_frame_errors = port->num_fe;
+  s->rx_fifo_errors = port->num_oe;
+  s->rx_length_errors = port->Num_Invalid_Large_Frames;
+  s->rx_errors = s->rx_crc_errors + s->rx_frame_errors + s->rx_fifo_errors +
+                 s->rx_length_errors;
+}
+
+static const struct net_device_ops mstp_net_ops = {
+    .ndo_open = mstp_net_open,
+    .ndo_stop = mstp_net_stop,
+    .ndo_start_xmit = mstp_net_xmit,
+    .ndo_get_stats64 = mstp_net_stats,
+};
 
-  if (tty_get_baud_rate(mstp_tty) < 38400) {
-    if (mstpReadSilenceTimer() < Tturnaround) {
-      x = (Tturnaround * USEC_PER_MSEC) -
-          (mstpReadSilenceTimer() * USEC_PER_MSEC);
-      while (x > 0) {
-        udelay(1);
-        x--;
-      }
+// SOCK_DGRAM sockets: a DataNotExpectingReply to the sll_addr station;
+// SOCK_RAW senders write the whole header themselves
+static int mstp_net_header(struct sk_buff *skb, struct net_device *dev,
+                           unsigned short type, const void *daddr,
+                           const void *saddr, unsigned int len) {
+  byte *h = skb_push(skb, MSTP_NET_HLEN);
+
+  h[0] = mftBACnetDataNotExpectingReply;
+  h[1] = daddr ? *(const byte *)daddr : MSTP_BROADCAST_ADDRESS;
+  h[2] = 0xFF; // This_Station
+  h[3] = (byte)(len >> 8);
+  h[4] = (byte)len;
+  return MSTP_NET_HLEN;
+}
+
+static int mstp_net_parse(const struct sk_buff *skb, unsigned char *haddr) {
+  haddr[0] = skb_mac_header(skb)[2]; // SourceAddress
+  return 1;
+}
+
+static const struct header_ops mstp_net_header_ops = {
+    .create = mstp_net_header,
+    .parse = mstp_net_parse,
+};
+
+// NAPI: hand frames from receive_queue to the stack, at most budget
+static int mstp_net_poll(struct napi_struct *napi, int budget) {
+  struct mstp_net *net = container_of(napi, struct mstp_net, napi);
+  struct net_device *dev = napi->dev;
+  struct mstp_data_t *d;
+  struct sk_buff *skb;
+  byte *h;
+  int done = 0;
+
+  while (done < budget) {
+    d = Q_PopTail(&net->port->receive_queue);
+    if (!d)
+      break;
+    done++;
+    skb = napi_alloc_skb(napi, MSTP_NET_HLEN + d->count);
+    if (!skb) {
+      dev->stats.rx_dropped++;
+      free_entry(d);
+      continue;
     }
-  } else {
-    udelay(true_delay);
+    h = skb_put(skb, MSTP_NET_HLEN + d->count);
+    h[0] = d->FrameType;
+    h[1] = d->DestinationAddress;
+    h[2] = d->SourceAddress;
+    h[3] = (byte)(d->count >> 8);
+    h[4] = (byte)d->count;
+    memcpy(h + MSTP_NET_HLEN, d->data, d->count);
+    skb->protocol = htons(ETH_P_MSTP);
+    skb->pkt_type = (d->DestinationAddress == MSTP_BROADCAST_ADDRESS)
+                        ? PACKET_BROADCAST
+                        : PACKET_HOST;
+    skb_reset_mac_header(skb);
+    skb_pull(skb, MSTP_NET_HLEN);
+    skb_reset_network_header(skb);
+    dev->stats.rx_packets++;
+    dev->stats.rx_bytes += d->count;
+    free_entry(d);
+    netif_receive_skb(skb);
   }
+  if (done < budget)
+    napi_complete_done(napi, done); // reschedules if the RFSM kicked meanwhile
+  return done;
+}
 
-  // Transmit the preamble octets X'55', X'FF'.
-  // As each octet is transmitted, set SilenceTimer to zero.
-  OutputBuffer[0] = (UINT8)0x55;
-  OutputBuffer[1] = (UINT8)0xFF;
-  HeaderCRC = (UINT8)0xFF;
-  HeaderCRC = CalcHeaderCRC(SendFrameType, HeaderCRC);
-  // Transmit the Frame Type, Destination Address, Source Address,
-  // and Data Length octets. Accumulate each octet into HeaderCRC.
-  // As each octet is transmitted, set SilenceTimer to zero.
-  OutputBuffer[2] = SendFrameType;
-  if (SendFrameType == mftToken)
-    TX_Token_Count++;
-  if (SendFrameType == mftPollForManager)
-    TX_PFM_Count++;
-  HeaderCRC = CalcHeaderCRC(destination, HeaderCRC);
-  OutputBuffer[3] = destination;
-  HeaderCRC = CalcHeaderCRC(src, HeaderCRC);
-  OutputBuffer[4] = src;
-
-  // use a union here to get the MSB and LSB of DataLen
-  u.dw = data_len;
-  OutputBuffer[5] = u.db[1];
-  HeaderCRC = CalcHeaderCRC(u.db[1], HeaderCRC);
-  OutputBuffer[6] = u.db[0];
-  HeaderCRC = CalcHeaderCRC(u.db[0], HeaderCRC);
-  // Transmit the ones-complement of HeaderCRC. Set SilenceTimer to zero.
-  OutputBuffer[7] = ~HeaderCRC;
-  OutputBufferSize = 8;
-
-  // If there are data octets, initialize DataCRC to X'FFFF'.
-  if (data_len > 0) {
-    u.dw = 0xFFFF;
-    // Transmit any data octets. Accumulate each octet into DataCRC.
-    // As each octet is transmitted, set SilenceTimer to zero.
-    memmove(&OutputBuffer[8], data, data_len);
-    OutputBufferSize += data_len;
-    for (i = 0; i < data_len; i++) {
-      u.dw = CalcDataCRC(data[i], u.dw);
-    }
-    // Transmit the ones-complement of DataCRC, least significant octet first.
-    // As each octet is transmitted, set SilenceTimer to zero.
-    OutputBuffer[8 + data_len] = ~u.db[0];
-    OutputBufferSize++;
-    OutputBuffer[9 + data_len] = ~u.db[1];
-    OutputBufferSize++;
+static void mstp_net_setup(struct net_device *dev) {
+  dev->netdev_ops = &mstp_net_ops;
+  dev->header_ops = &mstp_net_header_ops;
+  dev->type = ARPHRD_MSTP;
+  dev->hard_header_len = MSTP_NET_HLEN;
+  dev->min_header_len = MSTP_NET_HLEN;
+  dev->mtu = MSTP_MAX_DATA; // max NPDU
+  dev->min_mtu = 1;
+  dev->max_mtu = MSTP_MAX_DATA;
+  dev->addr_len = 1;
+  dev->broadcast[0] = MSTP_BROADCAST_ADDRESS;
+  dev->tx_queue_len = 64;
+  dev->flags = IFF_NOARP | IFF_BROADCAST;
+}
+
+// the RFSM queued frames, called from the receive path
+static void mstp_net_rx(struct mstp_port *port) {
+  struct mstp_net *net = netdev_priv(port->netdev);
+
+  if (!netif_running(port->netdev))
+    return; // they are for read()
+  local_bh_disable(); // so NAPI runs when we're done, not from ksoftirqd
+  napi_schedule(&net->napi);
+  local_bh_enable();
+}
+
+// every tick, with the port locked
+static void mstp_net_tick(struct mstp_port *port) {
+  struct net_device *dev = port->netdev;
+  bool joined;
+
+  if (!dev)
+    return;
+  joined = mstp_net_joined(port);
+  if (joined != netif_carrier_ok(dev)) {
+    if (joined)
+      netif_carrier_on(dev);
+    else
+      netif_carrier_off(dev);
   }
-#ifdef USE_PAD_BYTE
-  OutputBuffer[OutputBufferSize] = 0xFF; // pad
-  OutputBufferSize++;
-#endif
-  mstpResetSilenceTimer();
-  bytes_written =
-      mstp_tty->ops->write(mstp_tty, OutputBuffer, OutputBufferSize);
-  // mstp_tty->ops->wait_until_sent(mstp_tty,CalcTXTime((word)OutputBufferSize));
-  num_tx_bytes += bytes_written;
-  mstpResetSilenceTimer();
-  mstpSetSilenceTimer(CalcTXTime((word)bytes_written + 3) * -1);
-  return;
+  if (netif_queue_stopped(dev) && mstp_net_room(port))
+    netif_wake_queue(dev);
 }
 
-///////////////////////////////////////////////////////////////////////
-//	calculate Header CRC (from BACnet Appendix G)
-// in:	dv	data value to accumulate
-//		cv	current crc value
-// out:	new crc
+static int mstp_net_create(struct mstp_port *port) {
+  struct net_device *dev;
+  struct mstp_net *net;
+  int err;
 
-static byte CalcHeaderCRC(byte dv, byte cv) {
-  uint16_t crc;
+  dev = alloc_netdev(sizeof(*net), "mstp%d", NET_NAME_ENUM, mstp_net_setup);
+  if (!dev)
+    return -ENOMEM;
+  net = netdev_priv(dev);
+  net->port = port;
+  netif_napi_add(dev, &net->napi, mstp_net_poll, NAPI_POLL_WEIGHT);
+  dev->dev_addr[0] = port->This_Station;
+  netif_carrier_off(dev);
+  err = register_netdev(dev);
+  if (err) {
+    netif_napi_del(&net->napi);
+    free_netdev(dev);
+    return err;
+  }
+  port->netdev = dev;
+  return 0;
+}
+
+// once nothing runs the tick or the receive path any more
+static void mstp_net_destroy(struct mstp_port *port) {
+  struct net_device *dev = port->netdev;
+  struct mstp_net *net;
 
-  crc = cv ^ dv;
-  crc = crc ^ (crc << 1) ^ (crc << 2) ^ (crc << 3) ^ (crc << 4) ^ (crc << 5) ^
-        (crc << 6) ^ (crc << 7);
-  return (octet)((crc & 0xFE) ^ ((crc >> 8) & 1));
+  if (!dev)
+    return;
+  net = netdev_priv(dev);
+  unregister_netdev(dev); // stops it first
+  netif_napi_del(&net->napi);
+  port->netdev = NULL;
+  free_netdev(dev);
 }
 
 ///////////////////////////////////////////////////////////////////////
-//	calculate Data CRC (from BACnet Appendix G)
-// in:	dv	data value to accumulate
-//		cv	current crc value
-// out:	new crc
+//	Work function for servicing MNSM
+//
 
-static word CalcDataCRC(byte dv, word cv) {
-  uint16_t crcLow;
-  crcLow = (cv & 0xFF) ^ dv;
-  return (cv >> 8) ^ (crcLow << 8) ^ (crcLow << 3) ^ (crcLow << 12) ^
-         (crcLow >> 4) ^ (crcLow & 0x0F) ^ ((crcLow & 0x0F) << 7);
+static void mstpTimerCallback(struct mstp_port *port) {
+  unsigned long flags;
+  u64 t0;
+  if (port->This_Station > 127)
+    return; // not yet inited
+  t0 = PROF_NOW();
+  mstp_lock(port, flags);
+  if (!port->tty)
+    goto end;
+  mstp_tx_service(port);
+  mstpServiceMNSM(port);
+  mstp_net_tick(port);
+end:
+  mstp_unlock(port, flags);
+  PROF_ADD(port, timer, t0);
+  return;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -1317,28 +714,106 @@ static word CalcDataCRC(byte dv, word cv) {
 // Timer function, in charge of mstpTimerCallback and administering SilenceTimer
 //	and ReplyTimer
 
-static enum hrtimer_restart mstp_timer_function(struct hrtimer *timer) {
+// one tick: run the MNSM, then account the time since the last one to
+// SilenceTimer and ReplyTimer
+
+static void mstp_tick(struct mstp_port *port) {
   unsigned long t2, diff, msec;
-  static unsigned long t1 = 0;
   int st = 0;
 
-  if (t1 == 0)
-    t1 = jiffies;
-  if (mod_state != STATE_Done) {
-    t2 = jiffies;
-    mstpTimerCallback();
-    diff = (long)t2 - (long)t1;
-    msec = jiffies_to_msecs(diff);
-    st = mstpReadSilenceTimer();
-    st += msec;
-    mstpSetSilenceTimer(st);
-    ReplyTimer += msec;
-    t1 = jiffies; // timestamp of when we left the MNSM, including wait for
-                  // transmit
+  if (port->t1 == 0)
+    port->t1 = jiffies;
+  t2 = jiffies;
+  mstpTimerCallback(port);
+  diff = (long)t2 - (long)port->t1;
+  msec = jiffies_to_msecs(diff);
+  st = mstpReadSilenceTimer(port->tty);
+  st += msec;
+  mstpSetSilenceTimer(port->tty, st);
+  port->ReplyTimer += msec;
+  port->t1 = jiffies; // timestamp of when we left the MNSM, including wait
+                      // for transmit
+}
+
+static void mstp_kick(struct mstp_port *port, int why) {
+  set_bit(why, &port->mnsm_kick);
+  wake_up_interruptible(&port->mnsm_wq);
+}
+
+static int mstp_mnsm_thread(void *data) {
+  struct mstp_port *port = data;
+  unsigned long kick;
+
+  while (!kthread_should_stop()) {
+    wait_event_interruptible(port->mnsm_wq,
+                             READ_ONCE(port->mnsm_kick) ||
+                                 kthread_should_stop());
+    kick = xchg(&port->mnsm_kick, 0);
+    if (kick & (1UL << MSTP_KICK_TICK))
+      mstp_tick(port);
+    else if (kick)
+      mstpTimerCallback(port); // a frame or the uart, no time has passed
   }
-  hrtimer_forward(timer, hrtimer_cb_get_time(timer),
-                  ktime_set(0, i64TimeInNsec));
-  return enHRTimer;
+  return 0;
+}
+
+// write_wakeup without mnsm_thread: the uart driver may call it with its
+// own lock held, so the MNSM, which writes, runs from here
+
+static void mstp_tx_work(struct work_struct *work) {
+  struct mstp_port *port = container_of(work, struct mstp_port, tx_work);
+
+  if ((mod_state != STATE_Done) && (port->enHRTimer == HRTIMER_RESTART))
+    mstpTimerCallback(port);
+}
+
+static enum hrtimer_restart mstp_timer_function(struct hrtimer *timer) {
+  struct mstp_port *port = container_of(timer, struct mstp_port, timer);
+  u64 overrun;
+  s64 late;
+
+  late = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer),
+                               hrtimer_get_expires(timer)));
+  if (port->tick_primed) {
+    mstp_prof_add(&port->prof.ticklate, (late > 0) ? late : 0);
+    if (late > MSTP_LATE_TICK_NS(port))
+      port->prof.lateticks++;
+  }
+  port->tick_primed = true;
+  if ((mod_state != STATE_Done) && (port->enHRTimer == HRTIMER_RESTART)) {
+    if (port->mnsm_task)
+      mstp_kick(port, MSTP_KICK_TICK);
+    else
+      mstp_tick(port);
+  }
+  overrun = hrtimer_forward(timer, hrtimer_cb_get_time(timer),
+                            ktime_set(0, mstp_tick_ns(port)));
+  if (overrun > 1)
+    port->prof.overruns += overrun - 1;
+  return port->enHRTimer;
+}
+
+// start the tick of a port, if it isn't running yet
+
+static void mstp_start_timer(struct mstp_port *port) {
+  ktime_t kt;
+
+  if (port->enHRTimer == HRTIMER_RESTART)
+    return;
+  port->enHRTimer = HRTIMER_RESTART;
+  kt = ktime_set(0, mstp_tick_ns(port));
+  hrtimer_init(&port->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  port->timer.function = &mstp_timer_function;
+  port->tick_primed = false;
+  port->t1 = 0;
+  hrtimer_start(&port->timer, kt, HRTIMER_MODE_REL);
+}
+
+static void mstp_stop_timer(struct mstp_port *port) {
+  if (port->enHRTimer == HRTIMER_NORESTART)
+    return;
+  port->enHRTimer = HRTIMER_NORESTART;
+  hrtimer_cancel(&port->timer);
 }
 
 /*
@@ -1363,109 +838,225 @@ static enum hrtimer_restart mstp_timer_function(struct hrtimer *timer) {
  */
 static int mstp_receive(struct tty_struct *tty, const unsigned char *cp,
                         char *fp, int count) {
-  int c = count, i = 0;
-  if (!mstp_tty || !mstp_tty->ops->write) {
+  struct mstp_port *port = tty->disc_data;
+  int c = count;
+  u64 t0;
+  if (!port || !port->tty || !port->tty->ops->write) {
     count = 0;
     return c; /* no backend */
   }
-  if (enHRTimer == HRTIMER_NORESTART) {
+  if (port->enHRTimer == HRTIMER_NORESTART) {
     count = 0;
     return c;
   }
-  num_rx_bytes += count;
-  for (i = 0; i < c; i++) {
-    if (fp) {
-      switch (fp[i]) {
-      case TTY_FRAME:
-        num_rx_errors++;
-        rx_errors = 1;
-        num_fe++;
-        break;
-      case TTY_PARITY:
-        num_rx_errors++;
-        rx_errors = 1;
-        num_pe++;
-        break;
-      case TTY_OVERRUN:
-        num_rx_errors++;
-        rx_errors = 1;
-        num_oe++;
-        break;
-      default:
-        break;
-      }
+  t0 = PROF_NOW();
+  mstpReceiveOctets(port, cp, fp, c);
+  if (port->mnsm_task && mstpFrameEventPending(port))
+    mstp_kick(port, MSTP_KICK_FRAME);
+  if (port->netdev && Q_Size(&port->receive_queue))
+    mstp_net_rx(port);
+  PROF_ADD(port, receive, t0);
+  return c;
+}
+
+// give the port its MNSM thread, before anything takes the port lock;
+// which lock mstp_lock uses depends on it
+
+static int mstp_start_thread(struct mstp_port *port, struct tty_struct *tty) {
+  struct task_struct *task;
+
+  task = kthread_create(mstp_mnsm_thread, port, "mstp/%s", tty->name);
+  if (IS_ERR(task)) {
+    printk(KERN_ERR MSTP_MSG "no MNSM thread for %s\n", tty->name);
+    return PTR_ERR(task);
+  }
+  if ((mnsm_cpu >= 0) && cpu_online(mnsm_cpu))
+    kthread_bind(task, mnsm_cpu);
+  sched_set_fifo(task);
+  port->mnsm_task = task;
+  wake_up_process(task);
+  return 0;
+}
+
+// keep what port knew for the next open of tty, once port is stopped
+
+static void mstp_warm_save(struct mstp_port *port, struct tty_struct *tty) {
+  struct mstp_warm *w;
+  int i, slot = -1;
+
+  if (!warm_age || (port->This_Station > 127))
+    return;
+  w = kmalloc(sizeof(*w), GFP_KERNEL);
+  if (!w)
+    return;
+  mstpWarmSave(port, w);
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++) {
+    if (mstp_warm[i].w && !strcmp(mstp_warm[i].name, tty->name)) {
+      slot = i;
+      break;
     }
-    DataAvailable = true;
-    RFSM(cp[i]);
-    mstpResetSilenceTimer();
+    if ((slot < 0) && (!mstp_warm[i].w ||
+                       (w->saved - mstp_warm[i].w->saved >= warm_age)))
+      slot = i; // free, or too old to be used
   }
-  return c;
+  if (slot < 0) {
+    mutex_unlock(&mstp_ports_mutex);
+    kfree(w);
+    return;
+  }
+  kfree(mstp_warm[slot].w);
+  strscpy(mstp_warm[slot].name, tty->name, sizeof(mstp_warm[slot].name));
+  mstp_warm[slot].w = w;
+  mutex_unlock(&mstp_ports_mutex);
+}
+
+// what the last close of tty kept, the caller frees it
+
+static struct mstp_warm *mstp_warm_take(struct tty_struct *tty) {
+  struct mstp_warm *w = NULL;
+  int i;
+
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++)
+    if (mstp_warm[i].w && !strcmp(mstp_warm[i].name, tty->name)) {
+      w = mstp_warm[i].w;
+      mstp_warm[i].w = NULL;
+      break;
+    }
+  mutex_unlock(&mstp_ports_mutex);
+  return w;
 }
 
 /* Open and close keep track of the tty involved */
 
 static int mstp_open(struct tty_struct *tty) {
+  struct mstp_port *port;
+  struct mstp_warm *warm;
   unsigned long flags;
-  spin_lock_init(&mstp_tty_lock);
-  spin_lock_irqsave(&mstp_tty_lock, flags);
-  mstp_tty = tty;
+  int baud, slot, err;
+  bool warmed = false;
+
+  port = kzalloc(sizeof(*port), GFP_KERNEL);
+  if (!port)
+    return -ENOMEM;
+  mstpPortInit(port);
+  port->rxq_max_frames = rx_frames;
+  port->rxq_max_bytes = rx_bytes;
+  if (rx_policy <= MSTP_RXQ_FAIR)
+    port->rxq_policy = rx_policy;
+  port->peer_timeouts = peer_timeouts;
+  port->peer_probe = peer_probe;
+  if (tx_sched <= MSTP_TXS_NOWAIT_FIRST)
+    port->tx_sched = tx_sched;
+  if (ring_tune <= MSTP_RING_APPLY)
+    port->ring_tune = ring_tune;
+  port->usage_adapt = usage_adapt;
+  port->hold_max = hold_frames;
+  port->hold_age = hold_age;
+  port->rejoin_poll = rejoin_poll;
+  port->tx_ttl = tx_ttl;
+  port->tok_notify = tok_notify;
+  port->tok_lead = tok_lead;
+  spin_lock_init(&port->lock);
+  mutex_init(&port->mnsm_mutex);
+  init_waitqueue_head(&port->mnsm_wq);
+  init_waitqueue_head(&port->tok_wq);
+  INIT_WORK(&port->tx_work, mstp_tx_work);
+  port->enHRTimer = HRTIMER_NORESTART;
+
+  mutex_lock(&mstp_ports_mutex);
+  for (slot = 0; slot < nMSTPports; slot++)
+    if (!mstp_ports[slot])
+      break;
+  if (slot == nMSTPports) {
+    mutex_unlock(&mstp_ports_mutex);
+    printk(KERN_ERR MSTP_MSG "no room for %s, %d ports in use\n", tty->name,
+           nMSTPports);
+    kfree(port);
+    return -EBUSY;
+  }
+  if (mnsm_thread) {
+    err = mstp_start_thread(port, tty);
+    if (err) {
+      mutex_unlock(&mstp_ports_mutex);
+      kfree(port);
+      return err;
+    }
+  }
+  port->slot = slot;
+  mstp_ports[slot] = port;
+  mutex_unlock(&mstp_ports_mutex);
+
+  mstp_lock(port, flags);
+  port->tty = tty;
+  tty->disc_data = port;
 
   printk(MSTP_MSG "tty index is %d\n", tty->index);
-  mstp_tty->receive_room = maxrcvqsize;
-  mstp_tty->ops->flush_buffer(mstp_tty);
+  tty->receive_room = maxrcvqsize;
+  tty->ops->flush_buffer(tty);
 
   // printk(MSTP_MSG "receive_room=%d\n",tty->receive_room);
-  baud = tty_get_baud_rate(mstp_tty);
-  // Tturnaround = (40/baud)*1000;
-  switch (baud) {
-  case 9600:
-    Tturnaround = 5;
-    true_delay = 4167; // 4.167 ms
-    break;
-  case 19200:
-    Tturnaround = 3;
-    true_delay = 2083; // 2.083 ms
-    break;
-  case 38400:
-    Tturnaround = 2;
-    true_delay = 1042; // 1.042 ms
-    break;
-  case 57600:
-    true_delay = 694; // 694 us
-    Tturnaround = 1;
-    break;
-  case 115200:
-    true_delay = 347; // 347 us
-    Tturnaround = 1;
-    break;
-  default:
-    // Tturnaround=1;
-    // must be 76800
-    baud = 76800;
-    Tturnaround = 1;
-    true_delay = 521; // 521 us
-    break;
+  baud = mstpSetBaud(port, tty_get_baud_rate(tty));
+  mstpVarInit(port, port->Tturnaround);
+  mstpSetToMSTP(tty);
+  printk(MSTP_MSG "Device %s set to MS/TP @ %d\n", tty->name, baud);
+  mstp_unlock(port, flags);
+
+  warm = mstp_warm_take(tty);
+  if (warm) {
+    mstp_lock(port, flags);
+    warmed = mstpWarmRestore(port, warm, warm_age);
+    mstp_unlock(port, flags);
+    kfree(warm);
+  }
+  if (warmed) {
+    printk(MSTP_MSG "Device %s restarts warm as MAC %d\n", tty->name,
+           port->This_Station);
+    mstp_start_timer(port);
+  }
+
+  if (netdev) {
+    err = mstp_net_create(port);
+    if (err) // the tty still works
+      printk(KERN_ERR MSTP_MSG "no network interface for %s (%d)\n",
+             tty->name, err);
+    else
+      printk(MSTP_MSG "Device %s is %s\n", tty->name, port->netdev->name);
   }
-  mstpVarInit(0, Tturnaround);
-  mstpSetToMSTP(mstp_tty);
-  printk(MSTP_MSG "Device %s set to MS/TP @ %d\n", mstp_tty->name, baud);
-  spin_unlock_irqrestore(&mstp_tty_lock, flags);
   return 0;
 }
 
 static void mstp_close(struct tty_struct *tty) {
+  struct mstp_port *port = tty->disc_data;
   unsigned long flags;
-  mod_state = STATE_Done; /* indicate we're done                              */
-  hrtimer_cancel(&hr_timer); /* stop the timers after next execution */
-  enHRTimer = HRTIMER_NORESTART;
-  spin_lock_irqsave(&mstp_tty_lock, flags);
-  mstp_tty = NULL;
-  spin_unlock_irqrestore(&mstp_tty_lock, flags);
+  if (!port)
+    return;
+  mstp_stop_timer(port); /* stop the timer after next execution */
+  if (port->mnsm_task)
+    kthread_stop(port->mnsm_task);
+  mstp_lock(port, flags);
+  port->tty = NULL;
+  tty->disc_data = NULL;
+  mstp_unlock(port, flags);
+  cancel_work_sync(&port->tx_work);
+  mstp_net_destroy(port);
+
+  mutex_lock(&mstp_ports_mutex);
+  mstp_ports[port->slot] = NULL;
+  mutex_unlock(&mstp_ports_mutex);
+  mstp_warm_save(port, tty);
+
+  Q_Empty(&port->receive_queue, Q_Size(&port->receive_queue));
+  Q_Empty(&port->send_queue, Q_Size(&port->send_queue));
+  Q_Empty(&port->hold_queue, Q_Size(&port->hold_queue));
+  mstpSetRxFilter(port, NULL);
+  kfree(port);
 }
 
-static int mstp_custom_ioctl(unsigned int cmd, unsigned long arg) {
+static int mstp_custom_ioctl(struct mstp_port *port, unsigned int cmd,
+                             unsigned long arg) {
   int retVal = 0;
-  ktime_t kt;
 
   // printk(KERN_ERR MSTP_MSG "IOCTL cmd = %d arg = %ld\n",cmd,arg);
 
@@ -1482,71 +1073,160 @@ static int mstp_custom_ioctl(unsigned int cmd, unsigned long arg) {
   /* Next, handle the command */
   switch (cmd) {
   case MSTP_IOC_GETONLINE:
-    if ((joined_state != 0) || (SoleManager == true))
+    if ((port->joined_state != 0) || (port->SoleManager == true))
       retVal = 1;
     break;
   case MSTP_IOC_SETMAXMANAGER: // we should shutdown here and restart for each
                                // of these
-    Nmax_manager = arg;
+    port->Nmax_manager = arg;
     // printk(MSTP_MSG "Setting Nmax_manager to %d\n",Nmax_manager);
-    if (Nmax_manager > 127)
-      Nmax_manager = 127;
+    if (port->Nmax_manager > 127)
+      port->Nmax_manager = 127;
     retVal = 0;
     break;
   case MSTP_IOC_SETMAXINFOFRAMES:
-    Nmax_info_frames = arg;
+    port->Nmax_info_frames = arg;
     // if(Nmax_info_frames > 20) Nmax_info_frames = 20;
     // printk(MSTP_MSG "Setting Nmax_info_frames to %d\n",Nmax_info_frames);
     retVal = 0;
     break;
-  case MSTP_IOC_SETMACADDRESS:
-    This_Station = (octet)arg;
-    // printk(MSTP_MSG "Setting This_Station to %d\n",This_Station);
-    if (This_Station > 127)
-      This_Station = 127;
-    ns = This_Station;
-    ps = This_Station;
-    retVal = 0;
-    mnstate = mnsmInitialize;             // we've been starved of time, restart
-    mstpSetSilenceTimer(Tframeabort + 1); // to reset the RFSM
-    RFSMstate = rfsmIdle;
-    if (enHRTimer == HRTIMER_NORESTART) {
-      enHRTimer = HRTIMER_RESTART;
-      kt = ktime_set(0, i64TimeInNsec);
-      hrtimer_init(&hr_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
-      hrtimer_set_expires(&hr_timer, kt);
-      hr_timer.function = &mstp_timer_function;
-      hrtimer_start(&hr_timer, kt, HRTIMER_MODE_ABS);
-      mod_state = STATE_Ready;
-    }
-    break;
   case MSTP_IOC_SETTUSAGE:
-    Tusage_timeout = arg; // 5 ms is our RX latency from the OS
-    if (Tusage_timeout > 35)
-      Tusage_timeout =
+    port->Tusage_timeout = arg; // 5 ms is our RX latency from the OS
+    if (port->Tusage_timeout > 35)
+      port->Tusage_timeout =
           35; // Tusage_timeout range is 20-35 (Addendum 135-2016bm-1)
-    if (Tusage_timeout < 20)
-      Tusage_timeout = 20;
+    if (port->Tusage_timeout < 20)
+      port->Tusage_timeout = 20;
     retVal = 0;
     break;
   case MSTP_IOC_GETMAXMANAGER:
     // return put_user(Nmax_manager,(char*)arg);
-    retVal = Nmax_manager;
+    retVal = port->Nmax_manager;
     break;
   case MSTP_IOC_GETMAXINFOFRAMES:
     // return put_user(Nmax_info_frames,(char*)arg);
-    retVal = Nmax_info_frames;
+    retVal = port->Nmax_info_frames;
     break;
   case MSTP_IOC_GETMACADDRESS:
     // return put_user(This_Station,(char*)arg);
-    retVal = This_Station;
+    retVal = port->This_Station;
     break;
   case MSTP_IOC_GETTUSAGE:
-    retVal = Tusage_timeout - 5 - Tturnaround;
+    retVal = port->Tusage_timeout - 5 - port->Tturnaround;
     break;
   case MSTP_IOC_GETVER:
     retVal = ver;
     break;
+  case MSTP_IOC_SETRXFRAMES:
+    port->rxq_max_frames = arg;
+    break;
+  case MSTP_IOC_SETRXBYTES:
+    port->rxq_max_bytes = arg;
+    break;
+  case MSTP_IOC_SETRXPOLICY:
+    if (arg > MSTP_RXQ_FAIR)
+      retVal = -EINVAL;
+    else
+      port->rxq_policy = arg;
+    break;
+  case MSTP_IOC_GETRXFRAMES:
+    retVal = port->rxq_max_frames;
+    break;
+  case MSTP_IOC_GETRXBYTES:
+    retVal = port->rxq_max_bytes;
+    break;
+  case MSTP_IOC_GETRXPOLICY:
+    retVal = port->rxq_policy;
+    break;
+  case MSTP_IOC_SETPEERTIMEOUTS:
+    port->peer_timeouts = arg;
+    mstpPeerReset(port);
+    break;
+  case MSTP_IOC_SETPEERPROBE:
+    port->peer_probe = arg;
+    break;
+  case MSTP_IOC_GETPEERTIMEOUTS:
+    retVal = port->peer_timeouts;
+    break;
+  case MSTP_IOC_GETPEERPROBE:
+    retVal = port->peer_probe;
+    break;
+  case MSTP_IOC_GETPEERSTATE:
+    if (arg >= MSTP_PEERS)
+      retVal = -EINVAL;
+    else
+      retVal = port->peer[arg].dead ? MSTP_PEER_DEAD : MSTP_PEER_ALIVE;
+    break;
+  case MSTP_IOC_GETPEEREVENTS:
+    retVal = port->peer_events;
+    break;
+  case MSTP_IOC_SETTXSCHED:
+    if (arg > MSTP_TXS_NOWAIT_FIRST)
+      retVal = -EINVAL;
+    else
+      port->tx_sched = arg;
+    break;
+  case MSTP_IOC_GETTXSCHED:
+    retVal = port->tx_sched;
+    break;
+  case MSTP_IOC_GETRXFCOUNT:
+    if (arg >= MSTP_RXF_VERDICTS)
+      retVal = -EINVAL;
+    else
+      retVal = port->rxf_hits[arg];
+    break;
+  case MSTP_IOC_SETRINGTUNE:
+    if (arg > MSTP_RING_APPLY)
+      retVal = -EINVAL;
+    else
+      port->ring_tune = arg;
+    break;
+  case MSTP_IOC_GETRINGTUNE:
+    retVal = port->ring_tune;
+    break;
+  case MSTP_IOC_SETUSAGEADAPT:
+    port->usage_adapt = (arg != 0);
+    break;
+  case MSTP_IOC_GETUSAGEADAPT:
+    retVal = port->usage_adapt;
+    break;
+  case MSTP_IOC_SETHOLDFRAMES:
+    port->hold_max = arg;
+    break;
+  case MSTP_IOC_SETHOLDAGE:
+    port->hold_age = arg;
+    break;
+  case MSTP_IOC_GETHOLDFRAMES:
+    retVal = port->hold_max;
+    break;
+  case MSTP_IOC_GETHOLDAGE:
+    retVal = port->hold_age;
+    break;
+  case MSTP_IOC_GETJOINTIME:
+    retVal = port->join_pending ? -EAGAIN : (int)port->join_ms;
+    break;
+  case MSTP_IOC_SETTXREPORT:
+    port->tx_report = (arg != 0);
+    break;
+  case MSTP_IOC_SETTXTTL:
+    port->tx_ttl = arg;
+    break;
+  case MSTP_IOC_GETTXTTL:
+    retVal = port->tx_ttl;
+    break;
+  case MSTP_IOC_SETTOKNOTIFY:
+    port->tok_notify = (arg != 0);
+    port->tok_soon = false;
+    break;
+  case MSTP_IOC_SETTOKLEAD:
+    port->tok_lead = arg;
+    break;
+  case MSTP_IOC_GETUSAGEPEER:
+    if (arg >= MSTP_PEERS)
+      retVal = -EINVAL;
+    else
+      retVal = mstpUsageTimeout(port, arg, port->Tusage_timeout);
+    break;
   default:
     retVal = -ENOIOCTLCMD;
     break;
@@ -1555,18 +1235,147 @@ static int mstp_custom_ioctl(unsigned int cmd, unsigned long arg) {
       (cmd !=
        MSTP_IOC_GETONLINE)) // only if the values were set somehow, not got
   {
-    mstpVarInit(0, Tturnaround);
+    mstpVarInit(port, port->Tturnaround);
   }
   return retVal;
 }
 
+// the receive filter ioctls copy a struct mstp_rx_filter and may sleep,
+// so they run without mstpShutdownLock
+
+static int mstp_rxfilter_ioctl(struct mstp_port *port, unsigned int cmd,
+                               void __user *arg) {
+  struct mstp_rx_filter *f;
+  int retVal = 0;
+
+  f = kmalloc(sizeof(*f), GFP_KERNEL);
+  if (!f)
+    return -ENOMEM;
+  if (cmd == MSTP_IOC_SETRXFILTER) {
+    if (copy_from_user(f, arg, sizeof(*f)))
+      retVal = -EFAULT;
+    else
+      retVal = mstpSetRxFilter(port, f);
+  } else {
+    mstpGetRxFilter(port, f);
+    if (copy_to_user(arg, f, sizeof(*f)))
+      retVal = -EFAULT;
+  }
+  kfree(f);
+  return retVal;
+}
+
+// MSTP_IOC_GETRING copies a struct mstp_ring out, the map needs no lock
+
+static int mstp_ring_ioctl(struct mstp_port *port, void __user *arg) {
+  struct mstp_ring r;
+
+  mstpRingMap(port, &r);
+  if (copy_to_user(arg, &r, sizeof(r)))
+    return -EFAULT;
+  return 0;
+}
+
+// MSTP_IOC_SETTIMING/GETTIMING copy a struct mstp_timing and may sleep,
+// so they run without mstpShutdownLock; the port lock keeps the MNSM from
+// seeing half of a new timing
+
+static int mstp_timing_ioctl(struct mstp_port *port, unsigned int cmd,
+                             void __user *arg) {
+  struct mstp_timing t;
+  unsigned long flags;
+  int retVal = 0;
+
+  if (cmd == MSTP_IOC_SETTIMING) {
+    if (copy_from_user(&t, arg, sizeof(t)))
+      return -EFAULT;
+    mstp_lock(port, flags);
+    retVal = mstpSetTiming(port, &t);
+    mstp_unlock(port, flags);
+    return retVal;
+  }
+  mstp_lock(port, flags);
+  t = port->timing;
+  mstp_unlock(port, flags);
+  if (copy_to_user(arg, &t, sizeof(t)))
+    return -EFAULT;
+  return 0;
+}
+
+// MSTP_IOC_SETMACADDRESS rebuilds the token and PFM templates the MNSM
+// sends from, so it has to hold the port lock, which is a mutex with
+// mnsm_thread and must not be taken inside mstpShutdownLock
+
+static int mstp_station_ioctl(struct mstp_port *port, unsigned long arg) {
+  unsigned long flags;
+  byte mac;
+
+  mstp_lock(port, flags);
+  mstpSetStation(port, (octet)arg);
+  mac = port->This_Station;
+  mstp_start_timer(port);
+  mstp_unlock(port, flags);
+  if (port->netdev && (port->netdev->dev_addr[0] != mac)) {
+    rtnl_lock();
+    port->netdev->dev_addr[0] = mac;
+    call_netdevice_notifiers(NETDEV_CHANGEADDR, port->netdev);
+    rtnl_unlock();
+  }
+  return 0;
+}
+
+static int mstp_txreport_ioctl(struct mstp_port *port, void __user *arg) {
+  struct mstp_txreport r;
+  unsigned long flags;
+  bool got;
+
+  mstp_lock(port, flags);
+  got = mstpTxrPop(port, &r);
+  mstp_unlock(port, flags);
+  if (!got)
+    return -EAGAIN;
+  if (copy_to_user(arg, &r, sizeof(r)))
+    return -EFAULT;
+  return 0;
+}
+
+// MSTP_IOC_GETTOKEN, clears POLLPRI
+
+static int mstp_token_ioctl(struct mstp_port *port, void __user *arg) {
+  struct mstp_token_info ti;
+  unsigned long flags;
+
+  mstp_lock(port, flags);
+  mstpTokenInfo(port, &ti);
+  port->tok_ack = ti.seq;
+  mstp_unlock(port, flags);
+  if (copy_to_user(arg, &ti, sizeof(ti)))
+    return -EFAULT;
+  return 0;
+}
+
 /* Handles the incoming tty ioctls and send them to N_TTY */
 /* If it's one of our IOCTLs, call mstp_custom_ioctl	  */
 static int mstp_ioctl(struct tty_struct *tty, struct file *file,
                       unsigned int cmd, unsigned long arg) {
+  struct mstp_port *port = tty->disc_data;
   int retVal = 0;
   int qcount = 0;
   unsigned long flags;
+  if (!port)
+    return -EIO;
+  if ((cmd == MSTP_IOC_SETRXFILTER) || (cmd == MSTP_IOC_GETRXFILTER))
+    return mstp_rxfilter_ioctl(port, cmd, (void __user *)arg);
+  if (cmd == MSTP_IOC_GETRING)
+    return mstp_ring_ioctl(port, (void __user *)arg);
+  if ((cmd == MSTP_IOC_SETTIMING) || (cmd == MSTP_IOC_GETTIMING))
+    return mstp_timing_ioctl(port, cmd, (void __user *)arg);
+  if (cmd == MSTP_IOC_SETMACADDRESS)
+    return mstp_station_ioctl(port, arg);
+  if (cmd == MSTP_IOC_GETTXREPORT)
+    return mstp_txreport_ioctl(port, (void __user *)arg);
+  if (cmd == MSTP_IOC_GETTOKEN)
+    return mstp_token_ioctl(port, (void __user *)arg);
   flags = mstpShutdownLock(tty);
   /* First, make sure the command is valid */
   if (_IOC_TYPE(cmd) != MSTP_IOC_MAGIC)
@@ -1591,19 +1400,49 @@ static int mstp_ioctl(struct tty_struct *tty, struct file *file,
         n_tty_ioctl_helper(tty, (struct file *)file, cmd, (unsigned long)arg);
     break;
   case FIONREAD: // return the packet count available to user space
-    qcount = Q_Size(&receive_queue);
+    qcount = Q_Size(&port->receive_queue);
     *(int *)arg = qcount;
     break;
   case MSTP_IOC_SETMAXMANAGER:
   case MSTP_IOC_SETMAXINFOFRAMES:
-  case MSTP_IOC_SETMACADDRESS:
   case MSTP_IOC_SETTUSAGE:
   case MSTP_IOC_GETMAXMANAGER:
   case MSTP_IOC_GETMAXINFOFRAMES:
   case MSTP_IOC_GETMACADDRESS:
   case MSTP_IOC_GETTUSAGE:
   case MSTP_IOC_GETVER:
-    retVal = mstp_custom_ioctl(cmd, (unsigned long)arg);
+  case MSTP_IOC_GETONLINE:
+  case MSTP_IOC_SETRXFRAMES:
+  case MSTP_IOC_SETRXBYTES:
+  case MSTP_IOC_SETRXPOLICY:
+  case MSTP_IOC_GETRXFRAMES:
+  case MSTP_IOC_GETRXBYTES:
+  case MSTP_IOC_GETRXPOLICY:
+  case MSTP_IOC_SETPEERTIMEOUTS:
+  case MSTP_IOC_SETPEERPROBE:
+  case MSTP_IOC_GETPEERTIMEOUTS:
+  case MSTP_IOC_GETPEERPROBE:
+  case MSTP_IOC_GETPEERSTATE:
+  case MSTP_IOC_GETPEEREVENTS:
+  case MSTP_IOC_SETTXSCHED:
+  case MSTP_IOC_GETTXSCHED:
+  case MSTP_IOC_GETRXFCOUNT:
+  case MSTP_IOC_SETRINGTUNE:
+  case MSTP_IOC_GETRINGTUNE:
+  case MSTP_IOC_SETUSAGEADAPT:
+  case MSTP_IOC_GETUSAGEADAPT:
+  case MSTP_IOC_GETUSAGEPEER:
+  case MSTP_IOC_SETHOLDFRAMES:
+  case MSTP_IOC_SETHOLDAGE:
+  case MSTP_IOC_GETHOLDFRAMES:
+  case MSTP_IOC_GETHOLDAGE:
+  case MSTP_IOC_GETJOINTIME:
+  case MSTP_IOC_SETTXREPORT:
+  case MSTP_IOC_SETTXTTL:
+  case MSTP_IOC_GETTXTTL:
+  case MSTP_IOC_SETTOKNOTIFY:
+  case MSTP_IOC_SETTOKLEAD:
+    retVal = mstp_custom_ioctl(port, cmd, (unsigned long)arg);
     break;
   default:
     retVal =
@@ -1645,23 +1484,24 @@ void mstp_default(void) {
 static ssize_t mstp_read(struct tty_struct *tty, struct file *file,
                          unsigned char __user *buf, size_t nr, 
                          void **cookie, unsigned long offset) {
+  struct mstp_port *port = tty->disc_data;
   int error = 0;
   ssize_t ret = 0;
   // unsigned long flags;
   static struct mstp_data_t *mstp_receive_ptr;
   unsigned char data[INPUT_BUFFER_SIZE +
                      1]; /* Here's the data! account for source address  */
-  if (!mstp_tty)
+  if (!port || !port->tty)
     return -EIO;
   if (!buf)
     return -EIO;
 
-  if (Q_Size(&receive_queue) > 0) {
-    mstp_receive_ptr = Q_PopTail(&receive_queue);
+  if (Q_Size(&port->receive_queue) > 0) {
+    mstp_receive_ptr = Q_PopTail(&port->receive_queue);
     if (!mstp_receive_ptr) // ==NULL
     {
       printk(MSTP_MSG "Pop Q NULL pointer in mstp_read\n");
-      Q_Empty(&receive_queue, Nmax_info_frames);
+      Q_Empty(&port->receive_queue, port->Nmax_info_frames);
       return 0;
     }
     if (mstp_receive_ptr->count > nr) {
@@ -1678,7 +1518,7 @@ static ssize_t mstp_read(struct tty_struct *tty, struct file *file,
       // error=%d\n",mstp_receive_ptr->count+1,error);
       ret = (ssize_t)mstp_receive_ptr->count + 1;
       free_entry(mstp_receive_ptr);
-      RecdPacketCounter++;
+      port->RecdPacketCounter++;
     }
   } else {
     if (file->f_flags &
@@ -1719,82 +1559,49 @@ static ssize_t mstp_read(struct tty_struct *tty, struct file *file,
  */
 static ssize_t mstp_write(struct tty_struct *tty, struct file *file,
                           const unsigned char *buf, size_t nr) {
-  unsigned char data[INPUT_BUFFER_SIZE];
-  struct mstp_data_t *mstp_data_ptr;
-  size_t i = 0;
+  struct mstp_port *port = tty->disc_data;
 
-  if (!mstp_tty) {
-    printk(MSTP_MSG "mstp_write: mstp_tty is NULL\n");
+  if (!port || !port->tty) {
+    printk(MSTP_MSG "mstp_write: port is not open\n");
     return -EIO;
   }
-  if (nr > INPUT_BUFFER_SIZE) { // too big
-    printk(MSTP_MSG "mstp_write: size_t too big\n");
-    return -ENOMEM;
-  }
-  if (nr < 5) {
-    printk(MSTP_MSG "mstp_write: size_t too small\n");
-    return -ENOMEM; // the received data is too small!
-  }
-  if ((joined_state == 0) || (SoleManager == true)) {
-    // #ifdef EXTRA_DEBUG
-    // 		printk(MSTP_MSG "mstp_write: not online yet, fake it\n");
-    // #endif
-    return nr; // pretend we did it
-  }
-  for (i = 0; i < nr; i++) {
-    data[i] = buf[i];
-  }
-  if (Q_Size(&send_queue) < Nmax_info_frames) // is there room?
-  {
-    mstp_data_ptr = alloc_entry(sizeof(struct mstp_data_t));
-    if (!mstp_data_ptr) {
-      printk(
-          MSTP_MSG
-          "mstp_write: NULL mstp_data_ptr returned from alloc in mstp_send\n");
-      Q_Empty(&send_queue, Nmax_info_frames);
-      return -EFAULT;
-    }
-    mstp_data_ptr->FrameType = data[0];
-    // printk(MSTP_MSG "FrameType = %2X\n",mstp_data_ptr->FrameType);
-    mstp_data_ptr->DestinationAddress = data[1];
-    if (data[2] == 0xFF)
-      mstp_data_ptr->SourceAddress = This_Station;
-    else
-      mstp_data_ptr->SourceAddress = data[2];
-    // printk(MSTP_MSG "da = %2X
-    // sa=%2X\n",mstp_data_ptr->DestinationAddress,mstp_data_ptr->SourceAddress);
-    mstp_data_ptr->count = ((data[3] * 256) + data[4]);
-    // printk(MSTP_MSG "dlen = %2X\n",mstp_data_ptr->count);
-    if (mstp_data_ptr->count < INPUT_BUFFER_SIZE) {
-      memcpy(&mstp_data_ptr->data, &data[5], mstp_data_ptr->count);
-      SentPacketCounter++;
-      Q_PushHead(&send_queue, mstp_data_ptr); // Add it to our send queue
-      return nr;
-    } else {
-      printk(MSTP_MSG "mstp_write: no room in send queue\n");
-      return -ENOMEM;
-    }
-  } else {
-    // printk(MSTP_MSG "mstp_write: max frames exceeded\n");
-    return -ENOMEM;
-  }
+  return mstpQueueFrame(port, buf, nr);
 }
 
+// only token events, see mstpTokenEvent
+
 static unsigned int mstp_poll(struct tty_struct *tty, struct file *filp,
                               poll_table *wait) {
+  struct mstp_port *port = tty->disc_data;
+
+  if (!port)
+    return POLLERR;
+  poll_wait(filp, &port->tok_wq, wait);
+  if (port->tok_notify && (READ_ONCE(port->tok_seq) != port->tok_ack))
+    return POLLPRI;
   return 0;
 }
 
 /* mstp_wakeup()
  *
  *    Callback for transmit wakeup. Called when low level
- *    device driver can accept more send data.
+ *    device driver can accept more send data.  mstp_tx_service,
+ *    in the MNSM thread or tx_work, continues a partly written
+ *    frame or notices that it has been sent.
  *
  * Arguments:        tty    pointer to associated tty instance data
  * Return Value:    None
  */
 static void mstp_wakeup(struct tty_struct *tty) {
+  struct mstp_port *port = tty->disc_data;
+
   clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+  if (!port)
+    return;
+  if (port->mnsm_task)
+    mstp_kick(port, MSTP_KICK_TXDONE);
+  else
+    schedule_work(&port->tx_work);
 }
 
 /* proc_read - proc_read_mstp
@@ -1809,65 +1616,181 @@ static void mstp_wakeup(struct tty_struct *tty) {
  * mstp Default
  */
 
-static int proc_show_mstpstatus(struct seq_file *m, void *v) {
-  int i = 0;
-  unsigned long flags;
-  seq_printf(m, "\n%s %s\n", MSTPMODULE_NAME, MSTPMODULE_VERSION);
-  seq_printf(m,
-             "============================================================\n");
-  seq_printf(m, "MS/TP MAC Address:          %d\n", This_Station);
-  spin_lock_irqsave(&mstp_tty_lock, flags);
-  if (mstp_tty) {
-    seq_printf(m, "Baud Rate:                  %d\n",
-               tty_get_baud_rate(mstp_tty));
-  }
-  spin_unlock_irqrestore(&mstp_tty_lock, flags);
-  seq_printf(m, "SilenceTimer:               %d\n", mstpReadSilenceTimer());
-  seq_printf(m, "Max Manager:                 %d\n", Nmax_manager);
-  seq_printf(m, "Max Info Frames:            %d\n", Nmax_info_frames);
-  seq_printf(m, "Next Station:               %d\n", ns);
-  seq_printf(m, "Poll Station:               %d\n", ps);
-  if (RFSMstate == rfsmHeader) {
+static void proc_show_port_status(struct seq_file *m, struct mstp_port *port) {
+  struct mstp_ring ring;
+  int i = 0, n;
+  seq_printf(m, "Device:                     %s\n", port->tty->name);
+  seq_printf(m, "MS/TP MAC Address:          %d\n", port->This_Station);
+  if (port->This_Station > 127)
+    seq_printf(m, "Time To Join:               no MAC address\n");
+  else if (port->join_pending)
+    seq_printf(m, "Time To Join:               waiting, %s start\n",
+               port->join_warm ? "warm" : "cold");
+  else
+    seq_printf(m, "Time To Join:               %ld ms, %s start\n",
+               port->join_ms, port->join_warm ? "warm" : "cold");
+  seq_printf(m, "Warm Starts:                %ld\n", port->warm_starts);
+  seq_printf(m, "Rejoin Polls:               %ld%s\n", port->rejoin_polls,
+             port->rejoin_poll ? "" : ", off");
+  seq_printf(m, "Baud Rate:                  %d\n", port->baud);
+  if (port->netdev)
+    seq_printf(m, "Network Interface:          %s%s%s\n", port->netdev->name,
+               netif_running(port->netdev) ? ", up" : "",
+               netif_carrier_ok(port->netdev) ? ", on the ring" : "");
+  if (port->mnsm_task)
+    seq_printf(m, "MNSM Context:               thread %s\n",
+               port->mnsm_task->comm);
+  else
+    seq_printf(m, "MNSM Context:               hrtimer\n");
+  seq_printf(m, "SilenceTimer:               %d\n",
+             mstpReadSilenceTimer(port->tty));
+  seq_printf(m, "Max Manager:                 %d\n", port->Nmax_manager);
+  seq_printf(m, "Max Info Frames:            %d\n", port->Nmax_info_frames);
+  seq_printf(m, "Next Station:               %d\n", port->ns);
+  seq_printf(m, "Poll Station:               %d\n", port->ps);
+  if (port->RFSMstate == rfsmHeader) {
     seq_printf(m, "RFSM State:                 %s, Index=%d\n",
-               rfsm_strings[RFSMstate], Index);
-  } else if (RFSMstate == rfsmSkipData)
-    seq_printf(m, " RFSM Skipping Data: Index=%d,DataLength=%d\n", Index,
-               DataLength);
+               rfsm_strings[port->RFSMstate], port->Index);
+  } else if (port->RFSMstate == rfsmSkipData)
+    seq_printf(m, " RFSM Skipping Data: Index=%d,DataLength=%d\n",
+               port->Index, port->rx.DataLength);
   else
-    seq_printf(m, "RFSM State:                 %s\n", rfsm_strings[RFSMstate]);
-  seq_printf(m, "MNSM State:                 %s\n", mnsm_strings[mnstate]);
-  seq_printf(m, "Tturnaround:                %d\n", (int)(Tturnaround));
-  seq_printf(m, "PFM Timeout:                %d\n", Tusage_timeout);
-  seq_printf(m, "TX PFM Count:               %ld\n", TX_PFM_Count);
-  seq_printf(m, "RX PFM Count:               %ld\n", RX_PFM_Count);
-  seq_printf(m, "Token Usage Timeout:        %d\n", Tusage_timeoutTP);
-  seq_printf(m, "TX Token Count:             %ld\n", TX_Token_Count);
-  seq_printf(m, "RX Token Count:             %ld\n", RX_Token_Count);
-  seq_printf(m, "tokencount/Npoll            %d/%d\n", tokencount, Npoll);
-  seq_printf(m, "Event Count:                %d\n", eventcount);
-  seq_printf(m, "Total Bytes Received:       %ld\n", num_rx_bytes);
-  seq_printf(m, "Total Bytes Sent:           %ld\n", num_tx_bytes);
-  seq_printf(m, "Error Count:                %d\n", num_rx_errors);
-  seq_printf(m, "Framing Errors:             %d\n", num_fe);
-  seq_printf(m, "Parity Errors:              %d\n", num_pe);
-  seq_printf(m, "Overrun Errors:             %d\n", num_oe);
-  seq_printf(m, "Unknown Errors:             %d\n", num_unkerr);
-  seq_printf(m, "Tframe_abort violations:    %d\n", frame_abort_errors);
-  seq_printf(m, "Invalid Large Frames:       %ld\n", Num_Invalid_Large_Frames);
-  seq_printf(m, "Data CRC Error Count:       %ld\n", numDataCRCErrs);
-  seq_printf(m, "Header CRC Error Count:     %ld\n", numHdrCRCErrs);
-  if (numHdrCRCErrs > 0) {
+    seq_printf(m, "RFSM State:                 %s\n",
+               rfsm_strings[port->RFSMstate]);
+  seq_printf(m, "MNSM State:                 %s\n",
+             mnsm_strings[port->mnstate]);
+  seq_printf(m, "Tturnaround:                %d\n", (int)(port->Tturnaround));
+  seq_printf(m, "PFM Timeout:                %d\n", port->Tusage_timeout);
+  seq_printf(m, "Timing:                     Npoll %u, Nretry_token %u, "
+                "Nmin_octets %u, Tframe_abort %u, Tno_token %u, "
+                "Treply_timeout %u, Treply_delay %u, Tslot %u, tick %u us\n",
+             port->timing.Npoll, port->timing.Nretry_token,
+             port->timing.Nmin_octets, port->timing.Tframe_abort,
+             port->timing.Tno_token, port->timing.Treply_timeout,
+             port->timing.Treply_delay, port->timing.Tslot,
+             port->timing.tick_us);
+  seq_printf(m, "TX PFM Count:               %ld\n", port->TX_PFM_Count);
+  seq_printf(m, "RX PFM Count:               %ld\n", port->RX_PFM_Count);
+  seq_printf(m, "Token Usage Timeout:        %d\n", port->Tusage_timeoutTP);
+  seq_printf(m, "Successor Usage Timeout:    %d/%d%s, %ld samples\n",
+             mstpUsageTimeout(port, port->ns, port->Tusage_timeoutTP),
+             mstpUsageTimeout(port, port->ns, port->Tusage_timeout),
+             port->usage_adapt ? " adaptive" : "", port->usage_samples);
+  seq_printf(m, "TX Token Count:             %ld\n", port->TX_Token_Count);
+  seq_printf(m, "RX Token Count:             %ld\n", port->RX_Token_Count);
+  seq_printf(m, "tokencount/Npoll            %d/%d\n", port->tokencount,
+             port->timing.Npoll);
+  seq_printf(m, "Event Count:                %d\n", port->eventcount);
+  seq_printf(m, "Total Bytes Received:       %ld\n", port->num_rx_bytes);
+  seq_printf(m, "Total Bytes Sent:           %ld\n", port->num_tx_bytes);
+  seq_printf(m, "TX Partial Writes:          %ld\n", port->tx_partial);
+  seq_printf(m, "TX Pending:                 %d\n", port->txpend_len);
+  seq_printf(m, "Error Count:                %d\n", port->num_rx_errors);
+  seq_printf(m, "Framing Errors:             %d\n", port->num_fe);
+  seq_printf(m, "Parity Errors:              %d\n", port->num_pe);
+  seq_printf(m, "Overrun Errors:             %d\n", port->num_oe);
+  seq_printf(m, "Unknown Errors:             %d\n", port->num_unkerr);
+  seq_printf(m, "Tframe_abort violations:    %d\n", port->frame_abort_errors);
+  seq_printf(m, "Invalid Large Frames:       %ld\n",
+             port->Num_Invalid_Large_Frames);
+  seq_printf(m, "Data CRC Error Count:       %ld\n", port->numDataCRCErrs);
+  seq_printf(m, "Frame Event Overruns:       %ld\n", port->rxev_overruns);
+  seq_printf(m, "Frame Event Max Depth:      %d\n", port->rxev_maxdepth);
+  seq_printf(m, "Header CRC Error Count:     %ld\n", port->numHdrCRCErrs);
+  if (port->numHdrCRCErrs > 0) {
     seq_printf(m, "RX Pkt: ");
     for (i = 0; i < 8; i++) {
-      seq_printf(m, "%02X ", errb[i]);
+      seq_printf(m, "%02X ", port->errb[i]);
     }
-    seq_printf(m, "(%02X)\n", errb[8]);
+    seq_printf(m, "(%02X)\n", port->errb[8]);
   }
-  seq_printf(m, "RX Queue Size:              %d\n", Q_Size(&receive_queue));
-  seq_printf(m, "TX Queue Size:              %d\n", Q_Size(&send_queue));
-  seq_printf(m, "RX Packets:                 %ld\n", RecdPacketCounter);
-  seq_printf(m, "TX Packets:                 %ld\n", SentPacketCounter);
+  seq_printf(m, "RX Queue Size:              %d (%d bytes, max %d)\n",
+             Q_Size(&port->receive_queue), port->receive_queue.bytes,
+             port->rxq_maxbytes);
+  seq_printf(m, "RX Queue Limit:             %u frames, %u bytes, %s\n",
+             port->rxq_max_frames, port->rxq_max_bytes,
+             rxq_strings[port->rxq_policy]);
+  seq_printf(m, "RX Drops (newest/oldest/fair): %ld/%ld/%ld\n",
+             port->rxq_drop_newest, port->rxq_drop_oldest,
+             port->rxq_drop_fair);
+  seq_printf(m, "RX Memory Pressure:         %ld\n", port->rxq_nomem);
+  seq_printf(m, "RX Filter (accept/drop/priority): %ld/%ld/%ld%s\n",
+             port->rxf_hits[MSTP_RXF_ACCEPT], port->rxf_hits[MSTP_RXF_DROP],
+             port->rxf_hits[MSTP_RXF_PRIORITY],
+             rcu_access_pointer(port->rxfilter) ? "" : ", no filter");
+  seq_printf(m, "TX Queue Size:              %d\n", Q_Size(&port->send_queue));
+  seq_printf(m, "TX Held:                    %d (max %u, %u ms)\n",
+             Q_Size(&port->hold_queue), port->hold_max, port->hold_age);
+  seq_printf(m, "TX Held (sent/expired/full): %ld/%ld/%ld\n",
+             port->hold_flushed, port->hold_expired, port->hold_full);
+  seq_printf(m, "TX Reports:                 %u unread, %ld lost%s\n",
+             port->txr_head - port->txr_tail, port->txr_lost,
+             port->tx_report ? "" : ", off");
+  seq_printf(m, "TX Outcomes (sent/reply/postponed/timeout/noreply/dropped/"
+                "expired): %ld/%ld/%ld/%ld/%ld/%ld/%ld\n",
+             port->txr_counts[MSTP_TXR_SENT], port->txr_counts[MSTP_TXR_REPLY],
+             port->txr_counts[MSTP_TXR_POSTPONED],
+             port->txr_counts[MSTP_TXR_TIMEOUT],
+             port->txr_counts[MSTP_TXR_NOREPLY],
+             port->txr_counts[MSTP_TXR_DROPPED],
+             port->txr_counts[MSTP_TXR_EXPIRED]);
+  if (port->tx_ttl)
+    seq_printf(m, "TX Time To Live:            %u ms, %ld expired\n",
+               port->tx_ttl, port->tx_expired);
+  else
+    seq_printf(m, "TX Time To Live:            none, %ld expired\n",
+               port->tx_expired);
+  if (port->tok_notify)
+    seq_printf(m, "Token Notify:               %u/%u/%u ms rotation/jitter/"
+                  "lead, %ld early\n",
+               port->tok_rot, port->tok_dev, port->tok_lead, port->tok_early);
+  else
+    seq_printf(m, "Token Notify:               off, %u ms rotation\n",
+               port->tok_rot);
+  seq_printf(m, "TX Order:                   %s\n",
+             port->tx_sched ? "no reply first" : "FIFO");
+  seq_printf(m, "Token Visits:               %ld, %ld frames, %ld full\n",
+             port->tok_visits, port->tok_frames, port->tok_full);
+  seq_printf(m, "Waiting For Replies:        %ld ms\n", port->tok_wait_ms);
+  seq_printf(m, "Dead Peers:                ");
+  for (i = 0; i < MSTP_PEERS; i++)
+    if (port->peer[i].dead)
+      seq_printf(m, " %d", i);
+  seq_printf(m, "\n");
+  seq_printf(m, "Peer Events/Probes:         %ld/%ld\n", port->peer_events,
+             port->peer_probes);
+  seq_printf(m, "Requests Failed (queued/write): %ld/%ld\n",
+             port->peer_failed, port->peer_refused);
+  mstpRingMap(port, &ring);
+  seq_printf(m, "Ring:                      ");
+  for (i = port->This_Station, n = 0;
+       (i < 128) && (ring.next[i] != MSTP_RING_NONE) && (n < 128); n++) {
+    seq_printf(m, " %d", i);
+    i = ring.next[i];
+    if (i == port->This_Station)
+      break;
+  }
+  seq_printf(m, "%s\n", ring.closed ? " (closed)" : " ...");
+  seq_printf(m, "Ring Managers:              %u, highest %u\n", ring.managers,
+             ring.highest);
+  seq_printf(m, "Ring Nmax_manager:          %u suggested, %s, changed %ld\n",
+             ring.suggested, port->ring_tune ? "applied" : "not applied",
+             port->ring_tunes);
+  seq_printf(m, "RX Packets:                 %ld\n", port->RecdPacketCounter);
+  seq_printf(m, "TX Packets:                 %ld\n", port->SentPacketCounter);
   seq_printf(m, "\n");
+}
+
+static int proc_show_mstpstatus(struct seq_file *m, void *v) {
+  int i;
+  seq_printf(m, "\n%s %s\n", MSTPMODULE_NAME, MSTPMODULE_VERSION);
+  seq_printf(m,
+             "============================================================\n");
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++)
+    if (mstp_ports[i])
+      proc_show_port_status(m, mstp_ports[i]);
+  mutex_unlock(&mstp_ports_mutex);
   return 0;
 }
 
@@ -1883,6 +1806,158 @@ static const struct proc_ops mstp_fops = {
     .proc_release = seq_release,
 };
 
+/* proc_show_mstpprof
+ * cat /proc/BACnet/mstpprof shows where the module spends its time:
+ * min/avg/max in ns for each hot path followed by the histograms.
+ * Writing anything to it (echo 0 > /proc/BACnet/mstpprof) clears the
+ * figures so a test run can be measured on its own.
+ */
+
+static void proc_show_prof_line(struct seq_file *m, const char *name,
+                                mstp_prof_t *p) {
+  u64 avg = 0;
+  if (p->count)
+    avg = div64_u64(p->total_ns, p->count);
+  seq_printf(m, "%-16s %10lu %10llu %10llu %10llu\n", name, p->count,
+             p->min_ns, avg, p->max_ns);
+}
+
+static void proc_show_port_prof(struct seq_file *m, struct mstp_port *port) {
+  mstp_port_prof_t *prof = &port->prof;
+  int i = 0;
+  seq_printf(m, "Device: %s\n", port->tty->name);
+  seq_printf(m, "%-16s %10s %10s %10s %10s\n", "Path (ns)", "Count", "Min",
+             "Avg", "Max");
+  proc_show_prof_line(m, "Timer Callback", &prof->timer);
+  proc_show_prof_line(m, "Receive", &prof->receive);
+  proc_show_prof_line(m, "SendFrame", &prof->sendframe);
+  proc_show_prof_line(m, "Turnaround Wait", &prof->turnaround);
+  // a mutex with mnsm_thread, nothing runs with IRQs off then
+  proc_show_prof_line(m, port->mnsm_task ? "Lock Held" : "Lock IRQ-off",
+                      &prof->lockhold);
+  proc_show_prof_line(m, "Tick Lateness", &prof->ticklate);
+  seq_printf(m, "hrtimer Overruns:           %ld\n", prof->overruns);
+  seq_printf(m, "Late Ticks (>%uus):        %ld\n",
+             port->timing.tick_us / 4, prof->lateticks);
+  seq_printf(m, "\n%-10s %10s %10s %10s %10s %10s %10s\n", "Hist (us)",
+             "Timer", "Receive", "SendFrame", "Turnaround", "Lock", "Late");
+  for (i = 0; i < MSTP_PROF_BUCKETS; i++) {
+    if (i == 0)
+      seq_printf(m, "%-10s", "<1");
+    else if (i == MSTP_PROF_BUCKETS - 1)
+      seq_printf(m, ">=%-8d", 1 << (i - 1));
+    else
+      seq_printf(m, "<%-9d", 1 << i);
+    seq_printf(m, " %10lu %10lu %10lu %10lu %10lu %10lu\n", prof->timer.hist[i],
+               prof->receive.hist[i], prof->sendframe.hist[i],
+               prof->turnaround.hist[i], prof->lockhold.hist[i],
+               prof->ticklate.hist[i]);
+  }
+  seq_printf(m, "\n");
+}
+
+static int proc_show_mstpprof(struct seq_file *m, void *v) {
+  int i;
+  seq_printf(m, "\n%s %s\n", MSTPMODULE_NAME, MSTPMODULE_VERSION);
+  seq_printf(m,
+             "============================================================\n");
+#ifndef MSTP_PROFILE
+  seq_printf(m, "Profiling is not compiled in (MSTP_PROFILE)\n");
+#endif
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++)
+    if (mstp_ports[i])
+      proc_show_port_prof(m, mstp_ports[i]);
+  mutex_unlock(&mstp_ports_mutex);
+  return 0;
+}
+
+static int mstp_prof_open(struct inode *inode, struct file *file) {
+  return single_open(file, proc_show_mstpprof, NULL);
+}
+
+static ssize_t mstp_prof_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos) {
+  struct mstp_port *port;
+  unsigned long flags;
+  int i;
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++) {
+    port = mstp_ports[i];
+    if (!port)
+      continue;
+    mstp_lock(port, flags);
+    memset(&port->prof, 0, sizeof(port->prof));
+    mstp_unlock(port, flags);
+  }
+  mutex_unlock(&mstp_ports_mutex);
+  return count;
+}
+
+static const struct proc_ops mstp_prof_fops = {
+    .proc_open = mstp_prof_open,
+    .proc_read = seq_read,
+    .proc_write = mstp_prof_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+/* /proc/BACnet/mstpmnsm, how often each MNSM transition was taken */
+static void proc_show_port_mnsm(struct seq_file *m, struct mstp_port *port) {
+  int t;
+  seq_printf(m, "Device: %s\n", port->tty->name);
+  seq_printf(m, "%-20s %-34s %12s\n", "State", "Transition", "Hits");
+  for (t = mtNone + 1; t < nMNSMTransitions; t++)
+    if (port->mnsm_hits[t])
+      seq_printf(m, "%-20s %-34s %12lu\n",
+                 mnsm_strings[mstpTransitions[t].state],
+                 mstpTransitions[t].name, port->mnsm_hits[t]);
+  seq_printf(m, "\n");
+}
+
+static int proc_show_mstpmnsm(struct seq_file *m, void *v) {
+  int i;
+  seq_printf(m, "\n%s %s\n", MSTPMODULE_NAME, MSTPMODULE_VERSION);
+  seq_printf(m,
+             "============================================================\n");
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++)
+    if (mstp_ports[i])
+      proc_show_port_mnsm(m, mstp_ports[i]);
+  mutex_unlock(&mstp_ports_mutex);
+  return 0;
+}
+
+static int mstp_mnsm_open(struct inode *inode, struct file *file) {
+  return single_open(file, proc_show_mstpmnsm, NULL);
+}
+
+static ssize_t mstp_mnsm_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos) {
+  struct mstp_port *port;
+  unsigned long flags;
+  int i;
+  mutex_lock(&mstp_ports_mutex);
+  for (i = 0; i < nMSTPports; i++) {
+    port = mstp_ports[i];
+    if (!port)
+      continue;
+    mstp_lock(port, flags);
+    memset(port->mnsm_hits, 0, sizeof(port->mnsm_hits));
+    mstp_unlock(port, flags);
+  }
+  mutex_unlock(&mstp_ports_mutex);
+  return count;
+}
+
+static const struct proc_ops mstp_mnsm_fops = {
+    .proc_open = mstp_mnsm_open,
+    .proc_read = seq_read,
+    .proc_write = mstp_mnsm_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
 /*
  * Module management
  */
@@ -1902,12 +1977,20 @@ static struct tty_ldisc_ops mstp_ldisc = {
 
 static int __init mstp_init(void) {
   int err;
+
+  err = mstpCoreInit(); // MNSM dispatch, frame entry caches
+  if (err) {
+    printk(KERN_ERR MSTP_MSG "can't create the frame caches\n");
+    return err;
+  }
+
   /*
    * At module load time, we must register our mouse and line discipline
    */
   err = tty_register_ldisc(N_MSTP, &mstp_ldisc);
   if (err) {
     printk(KERN_ERR MSTP_MSG "can't register line discipline\n");
+    mstpCoreExit();
     return err;
   }
 
@@ -1923,10 +2006,18 @@ static int __init mstp_init(void) {
     goto no_mstp_status; // remove bacnet_dir, unregister the tty
     return -ENOMEM;
   }
+  if (proc_create("mstpprof", 0666, bacnet_dir, &mstp_prof_fops) == NULL) {
+    printk(KERN_ERR MSTP_MSG "can't make /proc/BACnet/mstpprof\n");
+    goto no_mstp_prof; // remove mstpstatus, bacnet_dir, unregister the tty
+    return -ENOMEM;
+  }
+
+  if (proc_create("mstpmnsm", 0666, bacnet_dir, &mstp_mnsm_fops) == NULL) {
+    printk(KERN_ERR MSTP_MSG "can't make /proc/BACnet/mstpmnsm\n");
+    goto no_mstp_mnsm; // remove mstpprof, mstpstatus, bacnet_dir, ...
+    return -ENOMEM;
+  }
 
-  /* init queue */
-  Q_Init(&receive_queue);
-  Q_Init(&send_queue);
   mod_state = STATE_Ready; // so mstp_open can start the timer!
 
   /* everything initialized */
@@ -1936,41 +2027,33 @@ static int __init mstp_init(void) {
   // clean up /proc directory if we get a serious error along the way
   // order of clean up is important, note we don't remove mstpdata here because
   // it's the last thing to get created if it failed it didn't get created
+no_mstp_mnsm:
+  remove_proc_entry("mstpprof", bacnet_dir);
+no_mstp_prof:
+  remove_proc_entry("mstpstatus", bacnet_dir);
 no_mstp_status:
   remove_proc_entry(
       "BACnet", NULL); /* remove the proc entry to avoid Bad Things 	*/
 no_bacnet_dir:         /* the bacnet proc dir entry failed 			*/
   tty_unregister_ldisc(
       N_MSTP); /* unregister ourselves */
+  mstpCoreExit();
 
   return -EFAULT;
 }
 
 static void __exit mstp_unload(void) {
-  static struct mstp_data_t *mstp_tmp_ptr;
-  mod_state = STATE_Done;    /* indicate we're done
-                              */
-  hrtimer_cancel(&hr_timer); /* stop the timers after next execution */
-  enHRTimer = HRTIMER_NORESTART;
-
-  // empty our queues
-  if (Q_Size(&receive_queue)) /* Empty the receive queue	*/
-  {
-    mstp_tmp_ptr = Q_PopTail(&receive_queue);
-    while (mstp_tmp_ptr) {
-      free_entry(mstp_tmp_ptr);
-      mstp_tmp_ptr = Q_PopTail(&receive_queue);
-    }
-  }
-  if (Q_Size(&send_queue)) /* Empty the send queue	*/
-  {
-    mstp_tmp_ptr = Q_PopTail(&send_queue);
-    while (mstp_tmp_ptr) {
-      free_entry(mstp_tmp_ptr);
-      mstp_tmp_ptr = Q_PopTail(&send_queue);
-    }
-  }
+  int i;
+
+  mod_state = STATE_Done; /* indicate we're done
+                           */
+  for (i = 0; i < nMSTPports; i++)
+    kfree(mstp_warm[i].w);
+  // every port was freed in mstp_close, the ldisc can't go away while
+  // a tty still uses it
 
+  remove_proc_entry("mstpmnsm", bacnet_dir);
+  remove_proc_entry("mstpprof", bacnet_dir);
   remove_proc_entry(
       "mstpstatus",
       bacnet_dir); /* remove the proc entry to avoid Bad Things 	*/
@@ -1978,6 +2061,7 @@ static void __exit mstp_unload(void) {
       "BACnet", NULL); /* remove the proc entry to avoid Bad Things 	*/
   tty_unregister_ldisc(
       N_MSTP); /* unregister ourselves 				*/
+  mstpCoreExit();
   printk(KERN_INFO "%s %s unloaded\n", MSTPMODULE_NAME, MSTPMODULE_VERSION);
 }
 
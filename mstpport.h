@@ -0,0 +1,307 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+#ifndef __MSTPPORT_H_INCLUDED
+#define __MSTPPORT_H_INCLUDED
+
+#include "mstp_os.h"
+#include "mstp.h"
+#include "mstpprof.h"
+#include "queue.h"
+
+#define MSTP_RXEV_DEPTH 8 // frame events between RFSM and MNSM, power of 2
+
+#define MSTP_TEMPLATES 128 // destinations with prebuilt token/PFM frames
+
+#define MSTP_PEERS 255 // stations 0..254, see mstpPeer* in mstpcore.c
+#define MSTP_NO_PEER 0xFF
+
+#define MSTP_USAGE_MIN 20     // ms, lowest Tusage_timeout the standard allows
+#define MSTP_USAGE_MARGIN 5   // ms on top of the 95th percentile
+#define MSTP_USAGE_SAMPLES 16 // before a station's percentile is used
+
+#define MSTP_HOLD_FRAMES 16  // hold_queue default, see mstpHold* in mstpcore.c
+#define MSTP_HOLD_AGE 10000  // ms
+
+#define MSTP_TXR_DEPTH 64 // struct mstp_txreport not yet read, see mstpTxr*
+
+#define MSTP_RING_AGE 10000 // ms a token pass stays in the ring map
+#define MSTP_RING_SPARE 4   // addresses above the highest manager still polled
+
+/* One manager in the ring map, see mstpRing* in mstpcore.c */
+struct mstp_ring_node {
+  u32 seen;  // mstpPortClock() it was last seen passing the token
+  byte next; // whom it passed it to, MSTP_RING_NONE
+};
+
+/* What the MNSM knows about one other station */
+struct mstp_peer {
+  u32 probe_at; // while dead, the mstpPortClock() of the next probe
+  byte misses;  // reply timeouts and unused tokens in a row
+  bool dead;
+  bool manager; // has been seen passing the token
+  u16 reply_ms; // how long it takes to answer a request, averaged
+  u16 usage_q;  // 95th percentile of its token/PFM answer time, ms/16
+  byte usage_n; // samples in usage_q, up to MSTP_USAGE_SAMPLES
+};
+
+/* What a port remembers across close and open, see mstpWarm* in mstpcore.c */
+struct mstp_warm {
+  u32 saved; // mstpPortClock() at close
+  byte This_Station;
+  byte ns;
+  unsigned int Nmax_info_frames;
+  unsigned int Nmax_manager;
+  int Tusage_timeout;
+  struct mstp_timing timing;
+  struct mstp_ring_node ring[128];
+  struct mstp_peer peer[MSTP_PEERS];
+};
+
+/* One frame the RFSM has finished, waiting for the MNSM */
+struct mstp_frame_event {
+  byte FrameType;
+  byte DestinationAddress;
+  byte SourceAddress;
+  bool valid; // ReceivedValidFrame, otherwise ReceivedInvalidFrame
+  word DataLength;
+  signed char buf; // rxbuf holding the data, -1 if none was kept
+};
+
+/* Everything the state machines know about one MS/TP port.
+ *
+ * The field names are those of the standard (and of the file scope
+ * variables they replace), so the RFSM and MNSM still read like clause 9.
+ *
+ * The RFSM (the receive path, once per octet) and the MNSM (the tick or
+ * the MNSM thread) run on different CPUs at the same time, so the fields
+ * are grouped by who writes them and each group starts a cache line of
+ * its own: RFSM-hot, MNSM-hot, read-mostly configuration, and the
+ * counters each side bumps, away from the lines the other side reads.
+ * Every counter has a single writer, the port's RFSM, MNSM or write(),
+ * so there is nothing to gain from per-CPU copies.
+ */
+struct mstp_port {
+  ///////////////////////////////////////////////////////////////////////
+  //	RFSM, touched for every octet
+  byte RFSMstate ____cacheline_aligned_in_smp;
+  bool DataAvailable;
+  byte HeaderCRC;
+  byte rxbuf_w; // rxbuf the RFSM receives into, never held
+  word Index;
+  word DataCRC;
+  int rx_errors;
+  int eventcount;
+  unsigned int hbpos;          // next free octet in errb
+  unsigned int rxev_head;      // written by the RFSM only
+  struct mstp_frame_event rx;  // header the RFSM is receiving
+  unsigned char errb[16];      // last header, for the HeaderCRC report
+  u32 usage_heard;             // usage_sent when usage_ms was taken
+  int usage_ms;                // SilenceTimer at the first octet after it
+
+  ///////////////////////////////////////////////////////////////////////
+  //	MNSM
+  byte mnstate ____cacheline_aligned_in_smp;
+  byte ns, ps;
+  byte tokencount;
+  byte framecount;
+  byte retrycount;
+  byte SoleManager;
+  bool online;
+  bool tx_done; // the environment saw our last frame leave the line
+  // the frame the MNSM is looking at, loaded from rxev
+  bool ReceivedValidFrame;
+  bool ReceivedInvalidFrame;
+  byte FrameType;
+  byte SourceAddress;
+  byte DestinationAddress;
+  word DataLength;
+  byte *InputBuffer;
+  u_long ReplyTimer;
+  int joined_state;
+  unsigned int rxev_tail; // written by the MNSM only
+  signed char rxbuf_r;    // rxbuf of the MNSM's current frame, -1 none
+  bool rxbuf_held[2];     // the MNSM still needs it
+  byte reply_from;        // who we wait for in WaitForReply
+  byte peer_watch;        // was sent a token or PFM, MSTP_NO_PEER
+  u32 reply_sent;         // mstpPortClock() when the request went out
+  u32 usage_sent;         // tokens and PFMs sent, see mstpUsage*
+  byte warm_ns;           // successor from before a restart, MSTP_NO_PEER
+  bool join_pending;      // (re)started, not yet passed a token on
+  u32 join_start;         // mstpPortClock() when it (re)started
+  bool tok_seen;          // tok_last is valid, see mstpToken*
+  bool tok_soon;          // MSTP_TOK_SOON went out for this rotation
+  byte tok_state;         // MSTP_TOK_*
+  u32 tok_seq;            // events, MSTP_IOC_GETTOKEN
+  u32 tok_last;           // mstpPortClock() we last got the token
+  u32 tok_rot;            // ms between our tokens, average
+  u32 tok_dev;            // ms, its mean deviation
+  bool txr_busy;          // txr_cur is a frame of ours on the wire
+  bool txr_wait;          // and it waits for a reply
+  struct mstp_txreport txr_cur;
+  // read by MSTP_IOC_GETTXREPORT, both sides lock the port
+  struct mstp_txreport txr[MSTP_TXR_DEPTH];
+  unsigned int txr_head, txr_tail;
+
+  ///////////////////////////////////////////////////////////////////////
+  //	MS/TP variable values and limits, read-mostly
+  byte This_Station ____cacheline_aligned_in_smp;
+  unsigned int Nmax_info_frames;
+  unsigned int Nmax_manager;
+  int Tturnaround;
+  int Tusage_timeout;
+  int Tusage_timeoutTP;
+  int baud;
+  unsigned long true_delay;
+  int txtemplate_len;
+  unsigned int rxq_max_frames; // receive_queue limits, 0 for none
+  unsigned int rxq_max_bytes;
+  unsigned int rxq_policy; // MSTP_RXQ_*
+  unsigned int peer_timeouts; // reply timeouts before a peer is dead, 0 off
+  unsigned int peer_probe;    // ms between probes of a dead peer
+  unsigned int tx_sched;      // MSTP_TXS_*
+  struct mstp_rx_filter __rcu *rxfilter; // NULL accepts everything
+  unsigned int ring_tune;     // MSTP_RING_*
+  bool usage_adapt;           // Tusage_timeout per station, see mstpUsage*
+  struct mstp_timing timing;  // see mstpSetTiming
+  unsigned int hold_max;      // hold_queue limit, 0 refuses writes offline
+  unsigned int hold_age;      // ms a frame may wait in it
+  bool rejoin_poll;           // PFM a dropped manager each visit, mstpRingLost
+  bool tx_report;             // struct mstp_txreport for every frame written
+  unsigned int tx_ttl;        // ms a written frame may wait to be sent, 0 ever
+  bool tok_notify;            // mstpPortTokenEvent on token events
+  unsigned int tok_lead;      // ms MSTP_TOK_SOON comes before the token
+
+  ///////////////////////////////////////////////////////////////////////
+  //	RFSM to MNSM frame handoff, see mstpFrameEvent in mstpcore.c
+  struct mstp_frame_event rxev[MSTP_RXEV_DEPTH] ____cacheline_aligned_in_smp;
+  byte rxbuf[2][maxrx];
+
+  // the RFSM writes it from every token header, anybody reads it
+  struct mstp_ring_node ring[128] ____cacheline_aligned_in_smp;
+
+  // MNSM writes, write() looks at dead and probe_at
+  struct mstp_peer peer[MSTP_PEERS] ____cacheline_aligned_in_smp;
+
+  // each has its own lock, and its own users
+  queue receive_queue ____cacheline_aligned_in_smp;
+  queue send_queue ____cacheline_aligned_in_smp;
+  queue hold_queue ____cacheline_aligned_in_smp; // written while off the ring
+  spinlock_t tx_lock; // one writer at a time, see mstpQueueFrame
+
+  byte OutputBuffer[maxtx] ____cacheline_aligned_in_smp;
+  // Token, PollForManager and ReplyToPollForManager from This_Station,
+  // indexed by frame type and destination, see mstpBuildTemplates
+  byte txtemplate[mftReplyToPollForManager + 1][MSTP_TEMPLATES]
+                 [MSTP_HDR_LEN + 1]; // +1 for the pad octet
+
+  ///////////////////////////////////////////////////////////////////////
+  //	diagnostics the RFSM keeps
+  unsigned long num_rx_bytes ____cacheline_aligned_in_smp;
+  int num_rx_errors;
+  int num_fe;
+  int num_pe;
+  int num_oe;
+  int num_unkerr;
+  int frame_abort_errors;
+  unsigned long RX_PFM_Count;
+  unsigned long RX_Token_Count;
+  unsigned long Num_Invalid_Large_Frames;
+  unsigned long numHdrCRCErrs;
+  unsigned long numDataCRCErrs;
+  unsigned long rxev_overruns;   // frames lost, rxev was full
+  unsigned long rxev_nodata;     // TestRequests echoed without data
+  unsigned int rxev_maxdepth;    // most frames waiting for the MNSM
+  unsigned long rxq_drop_newest; // frames refused, receive_queue was full
+  unsigned long rxq_drop_oldest; // frames pushed out by newer ones
+  unsigned long rxq_drop_fair;   // pushed out, their source had the most
+  unsigned long rxq_nomem;       // frames lost to a failed allocation
+  int rxq_maxbytes;              // most octets receive_queue has held
+  unsigned long rxf_hits[MSTP_RXF_VERDICTS]; // data frames by verdict
+
+  ///////////////////////////////////////////////////////////////////////
+  //	diagnostics the MNSM, read() and write() keep
+  unsigned long num_tx_bytes ____cacheline_aligned_in_smp;
+  unsigned long TX_PFM_Count;
+  unsigned long TX_Token_Count;
+  unsigned int headercrccnt;
+  unsigned int datacrcerrcnt;
+  unsigned int rxinvalidframe;
+  unsigned long SentPacketCounter;
+  unsigned long RecdPacketCounter;
+  unsigned long mnsm_hits[nMNSMTransitions]; // by mt* transition
+  unsigned long peer_events;  // peers that went dead or came back
+  unsigned long peer_probes;  // requests let through to a dead peer
+  unsigned long peer_failed;  // queued requests dropped, peer was dead
+  unsigned long peer_refused; // write()s refused, peer was dead
+  unsigned long tok_visits;   // times we got to use the token
+  unsigned long tok_frames;   // frames sent using it
+  unsigned long tok_full;     // visits that sent Nmax_info_frames
+  unsigned long tok_wait_ms;  // spent in WaitForReply
+  unsigned long ring_tunes;   // times ring_tune changed Nmax_manager
+  unsigned long usage_samples; // token/PFM answer times taken
+  unsigned long hold_flushed; // held frames moved to send_queue
+  unsigned long hold_expired; // held frames dropped, older than hold_age
+  unsigned long hold_full;    // write()s refused, hold_queue was full
+  unsigned long join_ms;      // from the last (re)start to passing a token
+  bool join_warm;             // that was a warm restart
+  unsigned long warm_starts;  // times mstpWarmRestore was used
+  unsigned long rejoin_polls; // PFMs sent to a dropped manager
+  unsigned long txr_counts[MSTP_TXR_OUTCOMES]; // reports by outcome
+  unsigned long txr_lost;     // reports dropped, txr[] was full
+  unsigned long tx_expired;   // frames dropped at the token, ttl ran out
+  unsigned long tok_early;    // tokens that came before MSTP_TOK_SOON
+  mstp_port_prof_t prof;
+
+#ifdef __KERNEL__
+  ///////////////////////////////////////////////////////////////////////
+  //	line discipline glue, only mstpmain.c looks at these
+  struct tty_struct *tty ____cacheline_aligned_in_smp;
+  int slot;        // index in mstp_ports[]
+  spinlock_t lock; // serializes the state machines, IRQs off
+  struct mutex mnsm_mutex; // ... or this with mnsm_thread
+  u64 lock_t0;     // when lock was taken
+  struct hrtimer timer;
+  enum hrtimer_restart enHRTimer;
+  bool tick_primed; // first tick after a (re)start isn't late
+  unsigned long t1; // jiffies at the previous tick
+  struct task_struct *mnsm_task; // runs the MNSM with mnsm_thread
+  wait_queue_head_t mnsm_wq;
+  unsigned long mnsm_kick; // MSTP_KICK_* bits, why mnsm_task woke up
+  struct work_struct tx_work; // mstp_wakeup without mnsm_thread
+  bool tx_busy;               // a frame of ours is on its way out
+  byte txpend[MSTP_WIRE_SIZE]; // what the uart could not take yet
+  int txpend_off;
+  int txpend_len;
+  unsigned long tx_partial; // writes the uart took only part of
+  wait_queue_head_t tok_wq;  // poll() for POLLPRI, see mstpToken*
+  u32 tok_ack;               // tok_seq MSTP_IOC_GETTOKEN last returned
+  struct net_device *netdev; // with netdev=1, see mstp_net_* in mstpmain.c
+#endif
+};
+
+// does the RFSM have frames the MNSM hasn't picked up yet?
+static inline bool mstpFrameEventPending(struct mstp_port *port) {
+  return port->rxev_tail != smp_load_acquire(&port->rxev_head);
+}
+
+#endif //__MSTPPORT_H_INCLUDED
@@ -0,0 +1,91 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+#ifndef __MSTPPROF_H_INCLUDED
+#define __MSTPPROF_H_INCLUDED
+
+/* Hot path time accounting
+ *
+ * Each mstp_prof_t accumulates the duration of one kind of event (a timer
+ * tick, a receive_buf2 burst, a SendFrame, ...) as count/min/max/total plus
+ * a log2 histogram.  Bucket 0 holds everything below 1 us, bucket n holds
+ * [2^(n-1), 2^n) us and the last bucket collects everything above that.
+ *
+ * Every instance has exactly one writer (the timer, the receive path, or
+ * whoever holds the port lock), so no extra locking is done here; readers
+ * in /proc may see a slightly torn snapshot, which is fine for statistics.
+ *
+ * The figures are only taken when MSTP_PROFILE is defined, see Makefile.
+ */
+
+#define MSTP_PROF_BUCKETS 16
+
+typedef struct _mstp_prof {
+  unsigned long count;
+  u64 min_ns;
+  u64 max_ns;
+  u64 total_ns;
+  unsigned long hist[MSTP_PROF_BUCKETS];
+} mstp_prof_t;
+
+static inline void mstp_prof_add(mstp_prof_t *p, u64 ns) {
+  u64 us = div_u64(ns, NSEC_PER_USEC);
+  int b = 0;
+
+  while (us && (b < (MSTP_PROF_BUCKETS - 1))) {
+    us >>= 1;
+    b++;
+  }
+  p->hist[b]++;
+  if ((p->count == 0) || (ns < p->min_ns))
+    p->min_ns = ns;
+  if (ns > p->max_ns)
+    p->max_ns = ns;
+  p->total_ns += ns;
+  p->count++;
+}
+
+/* everything we account for, per port */
+typedef struct _mstp_port_prof {
+  mstp_prof_t timer;      /* mstpTimerCallback, the whole MNSM loop       */
+  mstp_prof_t receive;    /* mstp_receive, one receive_buf2 burst         */
+  mstp_prof_t sendframe;  /* SendFrame, including the turnaround wait     */
+  mstp_prof_t turnaround; /* busy-wait for Tturnaround inside SendFrame   */
+  mstp_prof_t lockhold;   /* port lock hold, IRQs off unless mnsm_thread  */
+  mstp_prof_t ticklate;   /* how late the hrtimer fired vs. its expiry    */
+  unsigned long overruns; /* hrtimer periods missed entirely              */
+  unsigned long lateticks; /* ticks later than MSTP_LATE_TICK_NS           */
+} mstp_port_prof_t;
+
+#ifdef MSTP_PROFILE
+#define PROF_NOW() ktime_get_ns()
+#define PROF_ADD(port, what, t0)                                               \
+  mstp_prof_add(&(port)->prof.what, ktime_get_ns() - (t0))
+#else
+#define PROF_NOW() 0
+#define PROF_ADD(port, what, t0)                                               \
+  do {                                                                         \
+    (void)(t0);                                                                \
+  } while (0)
+#endif
+
+#endif //__MSTPPROF_H_INCLUDED
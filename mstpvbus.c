@@ -0,0 +1,656 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------
+Description:
+                        Virtual RS-485 bus for the BACnet MS/TP line discipline
+                        Registers /dev/ttyMSV0..N-1, all of them on one
+                        half-duplex segment, and provides the low level uart
+                        hooks (mstpReadSilenceTimer and friends) the line
+                        discipline needs, so N_MSTP can be tested on many
+                        ports without any hardware
+----------------------------------------------------------------------------*/
+#ifndef MODULE
+#define MODULE
+#endif
+
+#ifndef __KERNEL__
+#define __KERNEL__
+#endif
+
+#include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tty.h>
+#include <linux/tty_driver.h>
+#include <linux/tty_flip.h>
+
+#define VBUS_NAME "MS/TP virtual bus"
+#define VBUS_MSG "mstpvbus: "
+#define VBUS_MAX_PORTS 32
+#define VBUS_FIFO 4096 // transmit FIFO, octets
+#define VBUS_CHUNK 16  // most octets handed to a receiver at once
+//#define VBUS_DEBUG 1
+
+static int ports = 8;
+module_param(ports, int, 0444);
+MODULE_PARM_DESC(ports, "number of /dev/ttyMSV ports on the bus (1-32)");
+
+static unsigned int ber_ppm;
+module_param(ber_ppm, uint, 0644);
+MODULE_PARM_DESC(ber_ppm, "bit errors per million bits on the wire");
+
+///////////////////////////////////////////////////////////////////////
+//	one port on the bus
+//
+//	The transmit FIFO is drained one chunk at a time.  A chunk is at
+//	most VBUS_CHUNK octets and never more than about 1 ms of line time,
+//	so SilenceTimer stays as accurate as it would be on a UART with a
+//	receive timeout.  It reaches the other ports when its last stop bit
+//	has gone out.
+
+struct vbus_port {
+  struct tty_port port;
+  int index;
+  int open_count;
+  bool mstp; // mstpSetToMSTP was called
+
+  unsigned int baud;
+  unsigned int bits;     // bits per octet incl. start, parity and stop
+  u64 octet_ns;          // line time of one octet
+  unsigned int chunk_max; // octets per chunk at this baud
+
+  int silence; // SilenceTimer, ms
+
+  u8 fifo[VBUS_FIFO];
+  unsigned int head, tail, count;
+
+  bool tx_active; // driving the bus
+  bool collided;  // somebody else drove it during the current chunk
+  u8 chunk[VBUS_CHUNK];
+  unsigned int chunk_len;
+  u64 chunk_end; // ns, when the current chunk is on the wire
+
+  ///////////////////////////////////////////////////////////////////////
+  //	statistics
+  unsigned long tx_octets;
+  unsigned long rx_octets;
+  unsigned long tx_tokens;
+  unsigned long tx_pfms;
+  unsigned long tx_frames; // everything else
+  unsigned long tx_dropped; // octets that didn't fit the FIFO
+  unsigned long collisions;
+  unsigned long bit_errors;
+  u64 last_token; // ns, when we last passed the token
+  u64 rot_min, rot_max, rot_total; // token rotation, ns
+  unsigned long rot_count;
+};
+
+static struct {
+  spinlock_t lock; // everything on the bus, IRQs off
+  struct hrtimer timer;
+  u64 t0;        // ns, when the module was loaded
+  u64 busy_ns;   // line time with at least one transmitter
+  u64 busy_t0;   // ns, when the bus last went busy
+  int active;    // transmitters right now
+  u64 cpu_ns;    // time spent in vbus_timer_function
+  unsigned long ticks;
+} bus;
+
+static struct tty_driver *vbus_driver;
+static struct vbus_port *vbus_ports;
+
+static struct vbus_port *vbus_port_of(struct tty_struct *tty) {
+  if (!tty || !vbus_driver || (tty->driver != vbus_driver))
+    return NULL;
+  return tty->driver_data;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	line settings
+
+static void vbus_set_line(struct vbus_port *p, struct ktermios *t) {
+  unsigned int bits = 1 + 1; // start and one stop bit
+  unsigned int baud = tty_termios_baud_rate(t);
+
+  switch (t->c_cflag & CSIZE) {
+  case CS5:
+    bits += 5;
+    break;
+  case CS6:
+    bits += 6;
+    break;
+  case CS7:
+    bits += 7;
+    break;
+  default:
+    bits += 8;
+    break;
+  }
+  if (t->c_cflag & PARENB)
+    bits++;
+  if (t->c_cflag & CSTOPB)
+    bits++;
+  if (baud == 0)
+    baud = 9600;
+  p->baud = baud;
+  p->bits = bits;
+  p->octet_ns = div_u64((u64)bits * NSEC_PER_SEC, baud);
+  p->chunk_max = clamp_t(unsigned int, baud / (bits * 1000), 1, VBUS_CHUNK);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	the wire
+//
+//	All called with bus.lock held.
+
+// count what the line discipline hands us; SendFrame always writes
+// whole frames so the preamble is at the start of the buffer
+static void vbus_sniff(struct vbus_port *p, const unsigned char *buf, int n,
+                       u64 now) {
+  u64 rot;
+
+  if ((n < 8) || (buf[0] != 0x55) || (buf[1] != 0xFF))
+    return;
+  switch (buf[2]) {
+  case 0: // Token
+    p->tx_tokens++;
+    if (p->last_token) {
+      rot = now - p->last_token;
+      if ((p->rot_count == 0) || (rot < p->rot_min))
+        p->rot_min = rot;
+      if (rot > p->rot_max)
+        p->rot_max = rot;
+      p->rot_total += rot;
+      p->rot_count++;
+    }
+    p->last_token = now;
+    break;
+  case 1: // Poll For Manager
+    p->tx_pfms++;
+    break;
+  default:
+    p->tx_frames++;
+    break;
+  }
+}
+
+// put the next chunk of p's FIFO on the wire, false if there is none
+static bool vbus_start_chunk(struct vbus_port *p, u64 now) {
+  struct vbus_port *q;
+  unsigned int n;
+  int i;
+
+  n = min_t(unsigned int, p->count, p->chunk_max);
+  if (n == 0)
+    return false;
+  for (p->chunk_len = 0; p->chunk_len < n; p->chunk_len++) {
+    p->chunk[p->chunk_len] = p->fifo[p->tail];
+    p->tail = (p->tail + 1) % VBUS_FIFO;
+  }
+  p->count -= n;
+  p->chunk_end = now + (n * p->octet_ns);
+  p->collided = false;
+  if (!p->tx_active) {
+    if (bus.active++ == 0)
+      bus.busy_t0 = now;
+    p->tx_active = true;
+  }
+  // two drivers on the line garble each other's octets
+  for (i = 0; i < ports; i++) {
+    q = &vbus_ports[i];
+    if ((q != p) && q->tx_active)
+      p->collided = q->collided = true;
+  }
+  p->silence = 0;
+  return true;
+}
+
+// hand p's finished chunk to everybody else who is listening
+static void vbus_deliver(struct vbus_port *p) {
+  unsigned char data[VBUS_CHUNK];
+  char flags[VBUS_CHUNK];
+  struct vbus_port *q;
+  unsigned int n = p->chunk_len;
+  unsigned int j, bit;
+  int i;
+
+  p->tx_octets += n;
+  if (p->collided)
+    p->collisions++;
+  for (i = 0; i < ports; i++) {
+    q = &vbus_ports[i];
+    // RS-485 is half duplex, the transmitter doesn't hear itself
+    if ((q == p) || (q->open_count == 0) || q->tx_active)
+      continue;
+    memcpy(data, p->chunk, n);
+    memset(flags, TTY_NORMAL, n);
+    if (p->collided || (q->baud != p->baud) || (q->bits != p->bits)) {
+      for (j = 0; j < n; j++) {
+        data[j] ^= (get_random_u32() | 1);
+        flags[j] = TTY_FRAME;
+      }
+    } else if (ber_ppm) {
+      for (j = 0; j < n; j++) {
+        if ((get_random_u32() % 1000000) >= (ber_ppm * p->bits))
+          continue;
+        q->bit_errors++;
+        bit = get_random_u32() % p->bits;
+        if (bit == 0 || bit > 8)
+          flags[j] = TTY_FRAME; // start or stop bit
+        else
+          data[j] ^= 1 << (bit - 1);
+      }
+    }
+    q->rx_octets += n;
+    q->silence = 0;
+    tty_insert_flip_string_flags(&q->port, data, flags, n);
+    tty_flip_buffer_push(&q->port);
+  }
+  p->chunk_len = 0;
+}
+
+static void vbus_arm(void) {
+  struct vbus_port *p;
+  u64 next = 0;
+  int i;
+
+  for (i = 0; i < ports; i++) {
+    p = &vbus_ports[i];
+    if (p->tx_active && ((next == 0) || (p->chunk_end < next)))
+      next = p->chunk_end;
+  }
+  if (next)
+    hrtimer_start(&bus.timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart vbus_timer_function(struct hrtimer *timer) {
+  u32 wake = 0; // ports whose FIFO just drained
+  struct vbus_port *p;
+  unsigned long flags;
+  u64 now, t0;
+  int i;
+
+  t0 = ktime_get_ns();
+  spin_lock_irqsave(&bus.lock, flags);
+  now = ktime_get_ns();
+  bus.ticks++;
+  for (i = 0; i < ports; i++) {
+    p = &vbus_ports[i];
+    if (!p->tx_active || (p->chunk_end > now))
+      continue;
+    vbus_deliver(p);
+    if (vbus_start_chunk(p, p->chunk_end))
+      continue;
+    p->tx_active = false;
+    p->silence = 0;
+    if (--bus.active == 0)
+      bus.busy_ns += p->chunk_end - bus.busy_t0;
+    wake |= 1U << i;
+  }
+  vbus_arm();
+  spin_unlock_irqrestore(&bus.lock, flags);
+
+  // outside the lock, the line discipline may write from write_wakeup
+  for (i = 0; wake; i++, wake >>= 1)
+    if (wake & 1)
+      tty_port_tty_wakeup(&vbus_ports[i].port);
+  bus.cpu_ns += ktime_get_ns() - t0;
+  return HRTIMER_NORESTART;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	tty driver
+
+static int vbus_install(struct tty_driver *driver, struct tty_struct *tty) {
+  struct vbus_port *p = &vbus_ports[tty->index];
+
+  tty->driver_data = p;
+  return tty_port_install(&p->port, driver, tty);
+}
+
+static int vbus_open(struct tty_struct *tty, struct file *filp) {
+  struct vbus_port *p = tty->driver_data;
+  unsigned long flags;
+
+  spin_lock_irqsave(&bus.lock, flags);
+  if (p->open_count++ == 0) {
+    vbus_set_line(p, &tty->termios);
+    p->mstp = false;
+    p->silence = 0;
+  }
+  spin_unlock_irqrestore(&bus.lock, flags);
+  return tty_port_open(&p->port, tty, filp);
+}
+
+static void vbus_close(struct tty_struct *tty, struct file *filp) {
+  struct vbus_port *p = tty->driver_data;
+  unsigned long flags;
+
+  spin_lock_irqsave(&bus.lock, flags);
+  if (p->open_count > 0)
+    p->open_count--;
+  spin_unlock_irqrestore(&bus.lock, flags);
+  tty_port_close(&p->port, tty, filp);
+}
+
+static void vbus_hangup(struct tty_struct *tty) {
+  struct vbus_port *p = tty->driver_data;
+
+  tty_port_hangup(&p->port);
+}
+
+static int vbus_write(struct tty_struct *tty, const unsigned char *buf,
+                      int count) {
+  struct vbus_port *p = tty->driver_data;
+  unsigned long flags;
+  u64 now;
+  int n;
+
+  spin_lock_irqsave(&bus.lock, flags);
+  now = ktime_get_ns();
+  vbus_sniff(p, buf, count, now);
+  for (n = 0; (n < count) && (p->count < VBUS_FIFO); n++) {
+    p->fifo[p->head] = buf[n];
+    p->head = (p->head + 1) % VBUS_FIFO;
+    p->count++;
+  }
+  p->tx_dropped += count - n;
+  if (!p->tx_active && vbus_start_chunk(p, now))
+    vbus_arm();
+  spin_unlock_irqrestore(&bus.lock, flags);
+  return n;
+}
+
+static int vbus_write_room(struct tty_struct *tty) {
+  struct vbus_port *p = tty->driver_data;
+
+  return VBUS_FIFO - READ_ONCE(p->count);
+}
+
+static int vbus_chars_in_buffer(struct tty_struct *tty) {
+  struct vbus_port *p = tty->driver_data;
+
+  return READ_ONCE(p->count) + READ_ONCE(p->chunk_len);
+}
+
+static void vbus_flush_buffer(struct tty_struct *tty) {
+  struct vbus_port *p = tty->driver_data;
+  unsigned long flags;
+
+  // what is on the wire already goes out, the rest is discarded
+  spin_lock_irqsave(&bus.lock, flags);
+  p->head = p->tail = p->count = 0;
+  spin_unlock_irqrestore(&bus.lock, flags);
+  tty_wakeup(tty);
+}
+
+static void vbus_set_termios(struct tty_struct *tty, struct ktermios *old) {
+  struct vbus_port *p = tty->driver_data;
+  unsigned long flags;
+
+  spin_lock_irqsave(&bus.lock, flags);
+  vbus_set_line(p, &tty->termios);
+  spin_unlock_irqrestore(&bus.lock, flags);
+}
+
+static const struct tty_operations vbus_ops = {
+    .install = vbus_install,
+    .open = vbus_open,
+    .close = vbus_close,
+    .hangup = vbus_hangup,
+    .write = vbus_write,
+    .write_room = vbus_write_room,
+    .chars_in_buffer = vbus_chars_in_buffer,
+    .flush_buffer = vbus_flush_buffer,
+    .set_termios = vbus_set_termios,
+};
+
+static const struct tty_port_operations vbus_port_ops = {};
+
+///////////////////////////////////////////////////////////////////////
+//	Hooks for the line discipline
+//
+//	These are what a real uart driver has to export for N_MSTP.  Every
+//	one of them takes the tty the line discipline is attached to; for a
+//	tty that isn't ours they do nothing and report an idle line.
+//	SilenceTimer is reset here whenever an octet goes out or comes in,
+//	and reads as 0 while anybody is driving the bus.
+
+void mstpSetToMSTP(struct tty_struct *tty) {
+  struct vbus_port *p = vbus_port_of(tty);
+
+  if (!p)
+    return;
+  p->mstp = true;
+  p->silence = 0;
+}
+EXPORT_SYMBOL(mstpSetToMSTP);
+
+int mstpReadSilenceTimer(struct tty_struct *tty) {
+  struct vbus_port *p = vbus_port_of(tty);
+
+  if (!p)
+    return 0;
+  if (READ_ONCE(bus.active))
+    return 0;
+  return READ_ONCE(p->silence);
+}
+EXPORT_SYMBOL(mstpReadSilenceTimer);
+
+void mstpResetSilenceTimer(struct tty_struct *tty) {
+  struct vbus_port *p = vbus_port_of(tty);
+
+  if (p)
+    WRITE_ONCE(p->silence, 0);
+}
+EXPORT_SYMBOL(mstpResetSilenceTimer);
+
+void mstpSetSilenceTimer(struct tty_struct *tty, int val) {
+  struct vbus_port *p = vbus_port_of(tty);
+
+  if (p)
+    WRITE_ONCE(p->silence, val);
+}
+EXPORT_SYMBOL(mstpSetSilenceTimer);
+
+int mstpTransmitComplete(struct tty_struct *tty) {
+  struct vbus_port *p = vbus_port_of(tty);
+
+  if (!p)
+    return 1;
+  return !READ_ONCE(p->tx_active) && (READ_ONCE(p->count) == 0);
+}
+EXPORT_SYMBOL(mstpTransmitComplete);
+
+// a uart driver keeps its interrupt handler off the port while the line
+// discipline reconfigures it; the bus has its own lock, and TCSETS may
+// sleep, so there is nothing to hold here
+unsigned long mstpShutdownLock(struct tty_struct *tty) { return 0; }
+EXPORT_SYMBOL(mstpShutdownLock);
+
+void mstpShutdownUnlock(struct tty_struct *tty, unsigned long flags) {}
+EXPORT_SYMBOL(mstpShutdownUnlock);
+
+///////////////////////////////////////////////////////////////////////
+//	/proc/mstpvbus
+
+static int proc_show_vbus(struct seq_file *m, void *v) {
+  struct vbus_port *p;
+  unsigned long flags;
+  u64 now, up, busy, avg;
+  int i;
+
+  seq_printf(m, "\n%s, %d ports, ber %u ppm\n", VBUS_NAME, ports, ber_ppm);
+  seq_printf(m,
+             "============================================================\n");
+  spin_lock_irqsave(&bus.lock, flags);
+  now = ktime_get_ns();
+  up = now - bus.t0;
+  busy = bus.busy_ns;
+  if (bus.active)
+    busy += now - bus.busy_t0;
+  spin_unlock_irqrestore(&bus.lock, flags);
+  seq_printf(m, "Uptime:                     %llu ms\n", div_u64(up, 1000000));
+  seq_printf(m, "Bus busy:                   %llu ms (%llu.%01llu%%)\n",
+             div_u64(busy, 1000000), div64_u64(busy * 100, up ? up : 1),
+             div64_u64(busy * 1000, up ? up : 1) % 10);
+  seq_printf(m, "Timer:                      %lu runs, %llu us cpu\n",
+             bus.ticks, div_u64(bus.cpu_ns, 1000));
+  seq_printf(m, "\n%-8s %6s %4s %10s %10s %8s %8s %8s %6s %6s %6s %20s\n",
+             "port", "baud", "mstp", "tx octets", "rx octets", "tokens",
+             "pfms", "frames", "drops", "coll", "biterr",
+             "rotation min/avg/max us");
+  for (i = 0; i < ports; i++) {
+    p = &vbus_ports[i];
+    if (p->open_count == 0 && p->tx_octets == 0 && p->rx_octets == 0)
+      continue;
+    avg = p->rot_count ? div_u64(p->rot_total, p->rot_count) : 0;
+    seq_printf(m,
+               "ttyMSV%-2d %6u %4s %10lu %10lu %8lu %8lu %8lu %6lu %6lu %6lu "
+               "%6llu/%6llu/%6llu\n",
+               i, p->baud, p->mstp ? "yes" : "no", p->tx_octets, p->rx_octets,
+               p->tx_tokens, p->tx_pfms, p->tx_frames, p->tx_dropped,
+               p->collisions, p->bit_errors, div_u64(p->rot_min, 1000),
+               div_u64(avg, 1000), div_u64(p->rot_max, 1000));
+  }
+  seq_printf(m, "\n");
+  return 0;
+}
+
+static int vbus_proc_open(struct inode *inode, struct file *file) {
+  return single_open(file, proc_show_vbus, NULL);
+}
+
+static const struct proc_ops vbus_fops = {
+    .proc_open = vbus_proc_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+/*
+ * Module management
+ */
+
+static int __init vbus_init(void) {
+  struct vbus_port *p;
+  struct device *dev;
+  int err, i;
+
+  if ((ports < 1) || (ports > VBUS_MAX_PORTS)) {
+    printk(KERN_ERR VBUS_MSG "ports must be 1-%d\n", VBUS_MAX_PORTS);
+    return -EINVAL;
+  }
+  vbus_ports = kcalloc(ports, sizeof(*vbus_ports), GFP_KERNEL);
+  if (!vbus_ports)
+    return -ENOMEM;
+
+  spin_lock_init(&bus.lock);
+  hrtimer_init(&bus.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  bus.timer.function = &vbus_timer_function;
+  bus.t0 = ktime_get_ns();
+
+  vbus_driver = tty_alloc_driver(ports, TTY_DRIVER_REAL_RAW |
+                                            TTY_DRIVER_DYNAMIC_DEV);
+  if (IS_ERR(vbus_driver)) {
+    err = PTR_ERR(vbus_driver);
+    goto no_driver;
+  }
+  vbus_driver->driver_name = "mstpvbus";
+  vbus_driver->name = "ttyMSV";
+  vbus_driver->major = 0; // dynamic
+  vbus_driver->type = TTY_DRIVER_TYPE_SERIAL;
+  vbus_driver->subtype = SERIAL_TYPE_NORMAL;
+  vbus_driver->init_termios = tty_std_termios;
+  vbus_driver->init_termios.c_cflag = B38400 | CS8 | CREAD | CLOCAL;
+  vbus_driver->init_termios.c_ispeed = 38400;
+  vbus_driver->init_termios.c_ospeed = 38400;
+  tty_set_operations(vbus_driver, &vbus_ops);
+
+  for (i = 0; i < ports; i++) {
+    p = &vbus_ports[i];
+    p->index = i;
+    tty_port_init(&p->port);
+    p->port.ops = &vbus_port_ops;
+    tty_port_link_device(&p->port, vbus_driver, i);
+  }
+  err = tty_register_driver(vbus_driver);
+  if (err) {
+    printk(KERN_ERR VBUS_MSG "can't register tty driver\n");
+    goto no_register;
+  }
+  for (i = 0; i < ports; i++) {
+    dev = tty_port_register_device(&vbus_ports[i].port, vbus_driver, i, NULL);
+    if (IS_ERR(dev)) {
+      err = PTR_ERR(dev);
+      goto no_device;
+    }
+  }
+  if (proc_create("mstpvbus", 0444, NULL, &vbus_fops) == NULL) {
+    printk(KERN_ERR VBUS_MSG "can't make /proc/mstpvbus\n");
+    err = -ENOMEM;
+    goto no_device;
+  }
+
+  printk(KERN_INFO "%s initialized, %d ports\n", VBUS_NAME, ports);
+  return 0;
+
+no_device:
+  while (i-- > 0)
+    tty_unregister_device(vbus_driver, i);
+  tty_unregister_driver(vbus_driver);
+no_register:
+  for (i = 0; i < ports; i++)
+    tty_port_destroy(&vbus_ports[i].port);
+  put_tty_driver(vbus_driver);
+no_driver:
+  kfree(vbus_ports);
+  return err;
+}
+
+static void __exit vbus_unload(void) {
+  int i;
+
+  remove_proc_entry("mstpvbus", NULL);
+  for (i = 0; i < ports; i++)
+    tty_unregister_device(vbus_driver, i);
+  tty_unregister_driver(vbus_driver);
+  hrtimer_cancel(&bus.timer);
+  for (i = 0; i < ports; i++)
+    tty_port_destroy(&vbus_ports[i].port);
+  put_tty_driver(vbus_driver);
+  kfree(vbus_ports);
+  printk(KERN_INFO "%s unloaded\n", VBUS_NAME);
+}
+
+module_init(vbus_init);
+module_exit(vbus_unload);
+
+MODULE_AUTHOR("Coleman Brumley");
+MODULE_DESCRIPTION("Virtual RS-485 bus for the BACnet MS/TP line discipline");
+MODULE_LICENSE("GPL");
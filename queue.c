@@ -22,41 +22,36 @@ SOFTWARE.
 
 #include "queue.h"
 #include "mstp.h"
-#include <linux/kernel.h>
-#include <linux/module.h>
-#include <linux/slab.h>
-#include <linux/spinlock.h>
-
-/* this strcture stores what goes to the upper layers */
-struct mstp_data_t {
-  unsigned char SourceAddress;
-  unsigned char DestinationAddress;
-  unsigned char FrameType;
-  unsigned char data[INPUT_BUFFER_SIZE]; /* Here's the data! 		*/
-  int count;                             /* how much data?			*/
-  void *next;
-};
 
 ///////////////////////////////////////////////////////////////////////
 //	Initialize a semaphore
 //
 // in:	q		the semaphore
 
-void semaClear(queue *q) { rwlock_init(&q->q_mutex); }
+void semaClear(queue *q) { spin_lock_init(&q->q_lock); }
 
 ///////////////////////////////////////////////////////////////////////
 //	Capture a semaphore
 //
+//	The queues are shared between read()/write() and the timer and
+//	receive paths, so this has to exclude everybody and keep interrupts
+//	off while it is held.  It does not nest.
+//
 // in:	q		the semaphore
 
-void semaCapture(queue *q) { read_lock(&q->q_mutex); }
+void semaCapture(queue *q) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&q->q_lock, flags);
+  q->q_flags = flags;
+}
 
 ///////////////////////////////////////////////////////////////////////
 //	Release a semaphore
 //
 // in:	q		the semaphore
 
-void semaRelease(queue *q) { read_unlock(&q->q_mutex); }
+void semaRelease(queue *q) { spin_unlock_irqrestore(&q->q_lock, q->q_flags); }
 
 ///////////////////////////////////////////////////////////////////////
 //	Initialize a frfifo
@@ -66,6 +61,7 @@ void semaRelease(queue *q) { read_unlock(&q->q_mutex); }
 int Q_Init(queue *q) {
   q->front = q->rear = NULL;
   q->count = 0;
+  q->bytes = 0;
   semaClear(q);
 
   return True_;
@@ -78,24 +74,20 @@ int Q_Init(queue *q) {
 //		depth	typically max info frames
 
 void Q_Empty(queue *q, unsigned int depth) {
-  static struct mstp_data_t *mstp_tmp_ptr;
+  struct mstp_data_t *mstp_tmp_ptr;
 
   semaCapture(q);
-
-  if (Q_Size(q)) /* Empty the receive queue	*/
-  {
-    mstp_tmp_ptr = Q_PopTail(q);
-    while (depth != 0) {
-      depth--;
-      if (mstp_tmp_ptr != NULL) {
-        free_entry(mstp_tmp_ptr);
-      }
-      mstp_tmp_ptr = Q_PopTail(q);
-    }
+  mstp_tmp_ptr = q->front; /* Empty the receive queue	*/
+  while ((mstp_tmp_ptr != NULL) && (depth != 0)) {
+    struct mstp_data_t *next = mstp_tmp_ptr->next;
+    depth--;
+    free_entry(mstp_tmp_ptr);
+    mstp_tmp_ptr = next;
   }
 
   q->front = q->rear = NULL;
   q->count = 0;
+  q->bytes = 0;
   semaRelease(q);
 }
 
@@ -118,6 +110,7 @@ void PutQ(queue *q, struct mstp_data_t *p) //	***255
   q->rear = p;    // new guy is now the last one
   p->next = NULL; // tail next is NULL
   q->count++;
+  q->bytes += p->count;
   semaRelease(q);
 }
 
@@ -138,32 +131,241 @@ void *GetQ(queue *q) {
   }
   if (--q->count == 0)
     q->rear = NULL;
+  q->bytes -= fg->count;
   q->front = fg->next;
   semaRelease(q);
   return fg; // return the first one
 }
 
+///////////////////////////////////////////////////////////////////////
+//	remove the oldest packet of the source with the most packets queued
+//
+// in:	q		points to the frfifo to remove from
+//		sa		source of a packet about to be added, counted as well
+// out:	NULL	sa is (one of) the heaviest, or it's empty
+//		else	pointer to a packet
+
+void *Q_PopHeaviest(queue *q, unsigned char sa) {
+  unsigned short n[256];
+  struct mstp_data_t *p, *prev, *fg = NULL;
+  int heaviest = sa;
+
+  memset(n, 0, sizeof(n));
+  n[sa] = 1;
+  semaCapture(q);
+  for (p = q->front; p != NULL; p = p->next)
+    if (++n[p->SourceAddress] > n[heaviest])
+      heaviest = p->SourceAddress;
+  if (n[sa] >= n[heaviest]) {
+    semaRelease(q);
+    return NULL;
+  }
+  for (prev = NULL, p = q->front; p != NULL; prev = p, p = p->next)
+    if (p->SourceAddress == heaviest) {
+      fg = p;
+      break;
+    }
+  if (prev)
+    prev->next = fg->next;
+  else
+    q->front = fg->next;
+  if (q->rear == fg)
+    q->rear = prev;
+  q->count--;
+  q->bytes -= fg->count;
+  semaRelease(q);
+  return fg;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	remove the best of the first few packets, never passing an older
+//	packet to the same destination
+//
+// in:	q		points to the frfifo to remove from
+//		window	how many packets from the front to look at
+//		rank	lower is better, ties go to the older packet
+//		ctx		passed to rank
+// out:	NULL	it's empty
+//		else	pointer to a packet
+
+void *Q_PopBest(queue *q, int window, int (*rank)(void *ctx, void *e),
+                void *ctx) {
+  unsigned char seen[256];
+  struct mstp_data_t *p, *prev, *fg = NULL, *fgprev = NULL;
+  int r, best = 0;
+
+  memset(seen, 0, sizeof(seen));
+  semaCapture(q);
+  for (prev = NULL, p = q->front; (p != NULL) && (window > 0);
+       prev = p, p = p->next, window--) {
+    if (seen[p->DestinationAddress])
+      continue; // an older one to there goes first
+    seen[p->DestinationAddress] = 1;
+    r = rank(ctx, p);
+    if (!fg || (r < best)) {
+      fg = p;
+      fgprev = prev;
+      best = r;
+    }
+    if (best == 0)
+      break; // nothing ranks better
+  }
+  if (fg == NULL) {
+    semaRelease(q);
+    return NULL; // empty
+  }
+  if (fgprev)
+    fgprev->next = fg->next;
+  else
+    q->front = fg->next;
+  if (q->rear == fg)
+    q->rear = fgprev;
+  q->count--;
+  q->bytes -= fg->count;
+  semaRelease(q);
+  return fg;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	remove the oldest packet if it has been queued too long
+//
+// in:	q		points to the frfifo to remove from
+//		now		the clock queued_at was taken from, ms
+//		age		how long a packet may wait
+// out:	NULL	the oldest is younger, or it's empty
+//		else	pointer to a packet
+
+void *Q_PopExpired(queue *q, unsigned int now, unsigned int age) {
+  struct mstp_data_t *fg;
+
+  semaCapture(q);
+  fg = (struct mstp_data_t *)q->front;
+  if ((fg == NULL) || (now - fg->queued_at < age)) {
+    semaRelease(q);
+    return NULL;
+  }
+  if (--q->count == 0)
+    q->rear = NULL;
+  q->bytes -= fg->count;
+  q->front = fg->next;
+  semaRelease(q);
+  return fg;
+}
+
 void Q_PushHead(queue *q, void *d) { PutQ(q, d); }
 
+///////////////////////////////////////////////////////////////////////
+//	Add a priority packet to a frfifo, behind the other priority packets
+//	but ahead of everything else
+//
+// in:	q		points to the frfifo to insert into
+//		d		points to the packet to be inserted
+
+void Q_PushPrio(queue *q, void *d) {
+  struct mstp_data_t *p, *prev = NULL, *n = d;
+
+  n->prio = 1;
+  semaCapture(q);
+  for (p = q->front; (p != NULL) && p->prio; p = p->next)
+    prev = p;
+  n->next = p;
+  if (prev)
+    prev->next = n;
+  else
+    q->front = n;
+  if (p == NULL)
+    q->rear = n;
+  q->count++;
+  q->bytes += n->count;
+  semaRelease(q);
+}
+
 void Q_PushTail(queue *q, void *d) { PutQ(q, d); }
 
 void *Q_PopTail(queue *q) { return GetQ(q); }
 
 int Q_Size(queue *q) { return q->count; };
 
-void *alloc_entry(int size) {
-  void *e;
+///////////////////////////////////////////////////////////////////////
+//	Frame entries
+//
+//	Most frames are I-Ams, COV notifications and simple acks well under
+//	64 octets, so entries come from a few size classes instead of each
+//	carrying a 512 octet buffer.  512 holds the largest frame either way,
+//	header, MSTP_MAX_DATA, CRC and pad sent or maxrx received.
+
+static const int entry_class[] = {64, 256, 512};
+static const char *entry_name[] = {"mstp_entry_64", "mstp_entry_256",
+                                   "mstp_entry_512"};
+#define nEntryClasses (int)(sizeof(entry_class) / sizeof(entry_class[0]))
+static struct kmem_cache *entry_cache[nEntryClasses];
+
+///////////////////////////////////////////////////////////////////////
+//	create the size class caches, before any entry is allocated
+//
+// out:	0 or -ENOMEM
+
+int alloc_init(void) {
+  int i;
+
+  for (i = 0; i < nEntryClasses; i++) {
+    entry_cache[i] = kmem_cache_create(
+        entry_name[i], sizeof(struct mstp_data_t) + entry_class[i], 0, 0,
+        NULL);
+    if (!entry_cache[i]) {
+      alloc_exit();
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	destroy the caches, every entry must have been freed
+
+void alloc_exit(void) {
+  int i;
+
+  for (i = 0; i < nEntryClasses; i++) {
+    if (entry_cache[i])
+      kmem_cache_destroy(entry_cache[i]);
+    entry_cache[i] = NULL;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	allocate a frame entry
+//
+// in:	len		octets of data it has to hold
+// out:	NULL	no memory, or len is too big
+//		else	the entry, all but data cleared
+
+void *alloc_entry(int len) {
+  struct mstp_data_t *e;
+  int c;
+
+  for (c = 0; c < nEntryClasses; c++)
+    if (len <= entry_class[c])
+      break;
+  if (c == nEntryClasses)
+    return NULL;
   // the flags are IMPORTANT!!!
   // GFP_ATOMIC
   // Used to allocate memory from interrupt handlers and
   //	other code outside of a process context. Never sleeps.
   // GFP_KERNEL
   // Normal allocation of kernel memory. May sleep.
-  // e = kmalloc(size, GFP_KERNEL);
-  e = kmalloc(size, GFP_ATOMIC);
-  if (e)
-    memset(e, 0, size);
+  e = kmem_cache_alloc(entry_cache[c], GFP_ATOMIC);
+  if (e) {
+    memset(e, 0, sizeof(*e));
+    e->sclass = c;
+  }
   return e;
 }
 
-void free_entry(void *e) { kfree(e); }
+void free_entry(void *e) {
+  struct mstp_data_t *d = e;
+
+  if (d)
+    kmem_cache_free(entry_cache[d->sclass], d);
+}
@@ -23,7 +23,7 @@ SOFTWARE.
 #ifndef QUEUE__H
 #define QUEUE__H
 
-#include <linux/spinlock.h>
+#include "mstp_os.h"
 
 #ifndef True_
 #define True_ 1
@@ -38,10 +38,14 @@ typedef struct _queue { 					//a generic fifo
 	void	*rear;	
 	void	*next;
 	int		count;
-	rwlock_t q_mutex;
+	int		bytes;					//sum of the packets' count
+	spinlock_t q_lock;
+	unsigned long q_flags;					//irq state saved by semaCapture
 } queue;
 
-void *alloc_entry(int size);
+int alloc_init(void);
+void alloc_exit(void);
+void *alloc_entry(int len);
 void free_entry(void *e);
 
 void Q_Empty(queue  *q, unsigned int depth);
@@ -49,6 +53,11 @@ void Q_Empty(queue  *q, unsigned int depth);
 int    Q_Init(queue  *q);
 int    Q_Size(queue *q);
 void  *Q_PopTail(queue *q);
+void  *Q_PopHeaviest(queue *q, unsigned char sa);
+void  *Q_PopBest(queue *q, int window, int (*rank)(void *ctx, void *e),
+                 void *ctx);
+void  *Q_PopExpired(queue *q, unsigned int now, unsigned int age);
 void    Q_PushHead(queue *q, void *d);
+void    Q_PushPrio(queue *q, void *d);
 void    Q_PushTail(queue *q, void *d);
 #endif
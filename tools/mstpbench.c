@@ -0,0 +1,586 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------
+Description:
+                        Microbenchmarks for the protocol core, built from
+                        the same sources as the module (tools/libmstp.a).
+
+                        Output is one JSON object per line:
+                        {"bench":"crc_data","unit":"ns/byte","value":1.9,...}
+                        "value" is the median of the runs, "min" the best.
+                        With -b the results are compared against an earlier
+                        output and the exit status is 1 if any of them got
+                        slower by more than the -T threshold.
+----------------------------------------------------------------------------*/
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "mstpport.h"
+
+#define BENCH_MAX_RESULTS 64
+#define BENCH_STREAM_SIZE (256 * 1024)
+#define BENCH_QUEUE_OPS 200000
+#define BENCH_MAX_THREADS 8
+#define BENCH_CHUNK 16 // octets per mstpReceiveOctets, a UART FIFO
+
+static int runs = 5;
+static double min_seconds = 0.05; // per run
+static volatile unsigned long sink;
+
+struct bench_result {
+  char name[48];
+  const char *unit;
+  double value;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int nresults;
+
+///////////////////////////////////////////////////////////////////////
+//	the hooks mstpcore.c needs, see mstp.h
+//
+//	Nothing here models time; SendFrame output is either thrown away
+//	or appended to the capture buffer when one is set.
+
+static byte *capture;
+static int capture_len, capture_size;
+
+int mstpPortReadSilence(struct mstp_port *port) { return 0; }
+
+void mstpPortResetSilence(struct mstp_port *port) {}
+
+void mstpPortSetSilence(struct mstp_port *port, int val) {}
+
+int mstpPortTransmitComplete(struct mstp_port *port) { return 1; }
+
+void mstpPortTurnaround(struct mstp_port *port) {}
+
+int mstpPortSend(struct mstp_port *port, const byte *buf, int len) {
+  if (capture && (capture_len + len <= capture_size)) {
+    memcpy(capture + capture_len, buf, len);
+    capture_len += len;
+  }
+  sink += buf[len - 1];
+  return len;
+}
+
+unsigned int mstpPortClock(struct mstp_port *port) {
+  return (unsigned int)(ktime_get_ns() / 1000000);
+}
+
+unsigned long long mstpPortTime(struct mstp_port *port) {
+  return ktime_get_ns();
+}
+
+void mstpPortTokenEvent(struct mstp_port *port) {}
+
+///////////////////////////////////////////////////////////////////////
+//	timing and reporting
+
+static u64 rand_state = 0x2545F4914F6CDD1DULL;
+
+static u64 rand64(void) {
+  rand_state ^= rand_state >> 12;
+  rand_state ^= rand_state << 25;
+  rand_state ^= rand_state >> 27;
+  return rand_state * 2685821657736338717ULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// in:	name	benchmark name
+//		unit	"ns/byte", "ns/frame", ...
+//		fn		runs the workload once and returns its size in units
+//		arg		passed to fn
+//
+//	fn is repeated until a run takes at least min_seconds, the median
+//	and the best of the runs are printed
+
+static void bench(const char *name, const char *unit,
+                  unsigned long (*fn)(void *), void *arg) {
+  double per[16];
+  unsigned long units = 0;
+  int r;
+
+  fn(arg); // warm the caches and the allocator
+  for (r = 0; (r < runs) && (r < 16); r++) {
+    u64 t0 = ktime_get_ns(), t;
+    units = 0;
+    do {
+      units += fn(arg);
+      t = ktime_get_ns() - t0;
+    } while (t < (u64)(min_seconds * 1e9));
+    per[r] = (double)t / (double)units;
+  }
+  qsort(per, r, sizeof(per[0]), cmp_double);
+  printf("{\"bench\":\"%s\",\"unit\":\"%s\",\"value\":%.4f,\"min\":%.4f,"
+         "\"runs\":%d,\"n\":%lu}\n",
+         name, unit, per[r / 2], per[0], r, units);
+  fflush(stdout);
+  if (nresults < BENCH_MAX_RESULTS) {
+    struct bench_result *res = &results[nresults++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->unit = unit;
+    res->value = per[r / 2];
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	CRCs
+
+static byte crc_buf[4096];
+
+static unsigned long run_crc_header(void *arg) {
+  byte crc = 0xFF;
+  unsigned i;
+
+  for (i = 0; i < sizeof(crc_buf); i++)
+    crc = CalcHeaderCRC(crc_buf[i], crc);
+  sink += crc;
+  return sizeof(crc_buf);
+}
+
+static unsigned long run_crc_data(void *arg) {
+  word crc = 0xFFFF;
+  unsigned i;
+
+  for (i = 0; i < sizeof(crc_buf); i++)
+    crc = CalcDataCRC(crc_buf[i], crc);
+  sink += crc;
+  return sizeof(crc_buf);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	RFSM on captured streams
+//
+//	The streams are produced by SendFrame itself, so they are exactly
+//	what a node puts on the wire.  The receiving port is This_Station 1.
+
+#define BENCH_RX_STATION 1
+
+struct rx_stream {
+  byte *buf;
+  int len;
+};
+
+static struct mstp_port tx_port, rx_port;
+
+static void capture_start(struct rx_stream *s) {
+  s->buf = malloc(BENCH_STREAM_SIZE);
+  if (!s->buf) {
+    fprintf(stderr, "mstpbench: out of memory\n");
+    exit(1);
+  }
+  capture = s->buf;
+  capture_len = 0;
+  capture_size = BENCH_STREAM_SIZE;
+}
+
+static void capture_stop(struct rx_stream *s) {
+  s->len = capture_len;
+  capture = NULL;
+}
+
+// tokens going around a ring, one in eight for us
+static void make_tokens(struct rx_stream *s) {
+  int i = 0;
+
+  capture_start(s);
+  while (capture_len + 8 <= capture_size) {
+    byte da = (i % 8) ? (byte)(2 + i % 100) : BENCH_RX_STATION;
+    mstpSetStation(&tx_port, (byte)(3 + i % 100));
+    SendFrame(&tx_port, mftToken, da, tx_port.This_Station, NULL, 0);
+    i++;
+  }
+  capture_stop(s);
+}
+
+// a maintenance PFM sweep over empty addresses
+static void make_pfms(struct rx_stream *s) {
+  int i = 0;
+
+  capture_start(s);
+  mstpSetStation(&tx_port, 0);
+  while (capture_len + 8 <= capture_size) {
+    SendFrame(&tx_port, mftPollForManager, (byte)(2 + i % 126), 0, NULL, 0);
+    i++;
+  }
+  capture_stop(s);
+}
+
+// 501 octet DataNotExpectingReply frames, half of them for us
+static void make_data(struct rx_stream *s, byte *payload) {
+  int i = 0;
+
+  capture_start(s);
+  mstpSetStation(&tx_port, 9);
+  while (capture_len + 8 + 501 + 2 <= capture_size) {
+    SendFrame(&tx_port, mftBACnetDataNotExpectingReply,
+              (i & 1) ? BENCH_RX_STATION : 20, 9, payload, 501);
+    i++;
+  }
+  capture_stop(s);
+}
+
+static void make_noise(struct rx_stream *s) {
+  int i;
+
+  s->buf = malloc(BENCH_STREAM_SIZE);
+  if (!s->buf) {
+    fprintf(stderr, "mstpbench: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < BENCH_STREAM_SIZE; i++)
+    s->buf[i] = (byte)rand64();
+  s->len = BENCH_STREAM_SIZE;
+}
+
+static void drain_rx(struct mstp_port *port) {
+  void *d;
+
+  while ((d = Q_PopTail(&port->receive_queue)) != NULL)
+    free_entry(d);
+}
+
+static void feed_rfsm(struct mstp_port *port, struct rx_stream *s) {
+  int i, n;
+
+  for (i = 0; i < s->len; i += n) {
+    n = s->len - i;
+    if (n > BENCH_CHUNK)
+      n = BENCH_CHUNK;
+    mstpReceiveOctets(port, s->buf + i, NULL, n);
+    // what read() would do, so the queue does not grow without bound
+    if (Q_Size(&port->receive_queue))
+      drain_rx(port);
+    mstpFlushFrameEvents(port);
+  }
+}
+
+static unsigned long run_rfsm(void *arg) {
+  struct rx_stream *s = arg;
+
+  feed_rfsm(&rx_port, s);
+  return s->len;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	the RFSM next to other writers
+//
+//	rfsm_tokens_4ports feeds the token stream to four ports of one array
+//	on four threads (ns/byte of all of them), rfsm_tokens_ticking to one
+//	port while another thread does what the tick does to the MNSM side
+//	of it, counting ReplyTimer up.  Both stay close to rfsm_tokens only
+//	if the RFSM has its cache lines to itself.
+
+#define BENCH_PORTS 4
+
+static struct mstp_port mp_port[BENCH_PORTS];
+
+struct rfsm_thread {
+  struct mstp_port *port;
+  struct rx_stream *s;
+  pthread_barrier_t *barrier;
+  volatile int *stop;
+};
+
+static void *rfsm_worker(void *arg) {
+  struct rfsm_thread *t = arg;
+
+  pthread_barrier_wait(t->barrier);
+  feed_rfsm(t->port, t->s);
+  return NULL;
+}
+
+static void *tick_worker(void *arg) {
+  struct rfsm_thread *t = arg;
+  volatile u_long *reply = &t->port->ReplyTimer;
+
+  pthread_barrier_wait(t->barrier);
+  while (!*t->stop)
+    *reply += 1;
+  return NULL;
+}
+
+static unsigned long run_rfsm_ports(void *arg) {
+  struct rfsm_thread t[BENCH_PORTS];
+  pthread_t tid[BENCH_PORTS];
+  pthread_barrier_t barrier;
+  int i;
+
+  pthread_barrier_init(&barrier, NULL, BENCH_PORTS);
+  for (i = 0; i < BENCH_PORTS; i++) {
+    t[i].port = &mp_port[i];
+    t[i].s = arg;
+    t[i].barrier = &barrier;
+    pthread_create(&tid[i], NULL, rfsm_worker, &t[i]);
+  }
+  for (i = 0; i < BENCH_PORTS; i++)
+    pthread_join(tid[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  return (unsigned long)BENCH_PORTS * ((struct rx_stream *)arg)->len;
+}
+
+static unsigned long run_rfsm_ticking(void *arg) {
+  volatile int stop = 0;
+  struct rfsm_thread t = {&rx_port, arg, NULL, &stop};
+  pthread_barrier_t barrier;
+  pthread_t tid;
+
+  pthread_barrier_init(&barrier, NULL, 2);
+  t.barrier = &barrier;
+  pthread_create(&tid, NULL, tick_worker, &t);
+  pthread_barrier_wait(&barrier);
+  feed_rfsm(&rx_port, t.s);
+  stop = 1;
+  pthread_join(tid, NULL);
+  pthread_barrier_destroy(&barrier);
+  return t.s->len;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	SendFrame wire image construction
+
+struct sf_args {
+  byte type;
+  byte *data;
+  unsigned len;
+};
+
+static unsigned long run_sendframe(void *arg) {
+  struct sf_args *a = arg;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+    SendFrame(&tx_port, a->type, BENCH_RX_STATION, tx_port.This_Station,
+              a->data, a->len);
+  return 1000;
+}
+
+// a send queue entry, built once by mstpQueueFrame
+static unsigned long run_sendqueued(void *arg) {
+  struct mstp_data_t *f = arg;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+    SendQueuedFrame(&tx_port, f);
+  return 1000;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	queue operations under contention
+//
+//	Each thread pushes one of its own entries and pops whatever is at
+//	the tail, so the queue stays short and every op takes the lock.
+
+struct q_args {
+  queue *q;
+  int threads;
+};
+
+struct q_thread {
+  queue *q;
+  struct mstp_data_t entry[4];
+  pthread_barrier_t *barrier;
+};
+
+static void *q_worker(void *arg) {
+  struct q_thread *t = arg;
+  void *held[4];
+  int i, k;
+
+  for (k = 0; k < 4; k++)
+    held[k] = &t->entry[k];
+  pthread_barrier_wait(t->barrier);
+  for (i = 0; i < BENCH_QUEUE_OPS; i++) {
+    k = i & 3;
+    Q_PushHead(t->q, held[k]);
+    held[k] = Q_PopTail(t->q);
+    while (held[k] == NULL) // another thread took ours and not yet its own
+      held[k] = Q_PopTail(t->q);
+  }
+  return NULL;
+}
+
+static unsigned long run_queue(void *arg) {
+  struct q_args *a = arg;
+  struct q_thread t[BENCH_MAX_THREADS];
+  pthread_t tid[BENCH_MAX_THREADS];
+  pthread_barrier_t barrier;
+  int i;
+
+  pthread_barrier_init(&barrier, NULL, a->threads);
+  for (i = 0; i < a->threads; i++) {
+    t[i].q = a->q;
+    t[i].barrier = &barrier;
+    pthread_create(&tid[i], NULL, q_worker, &t[i]);
+  }
+  for (i = 0; i < a->threads; i++)
+    pthread_join(tid[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  if (Q_Size(a->q) != 0) {
+    fprintf(stderr, "mstpbench: queue lost track of %d entries\n",
+            Q_Size(a->q));
+    exit(1);
+  }
+  // one push and one pop per iteration per thread
+  return 2UL * BENCH_QUEUE_OPS * a->threads;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	comparison against an earlier run
+
+static int compare(const char *path, double threshold) {
+  char line[256], name[48];
+  double old;
+  int i, regressions = 0;
+  FILE *f = fopen(path, "r");
+
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    char *p = strstr(line, "\"bench\":\"");
+    char *v = strstr(line, "\"value\":");
+    if (!p || !v || (sscanf(p + 9, "%47[^\"]", name) != 1) ||
+        (sscanf(v + 8, "%lf", &old) != 1) || (old <= 0.0))
+      continue;
+    for (i = 0; i < nresults; i++) {
+      double change;
+      if (strcmp(results[i].name, name))
+        continue;
+      change = 100.0 * (results[i].value - old) / old;
+      fprintf(stderr, "%-24s %10.4f -> %10.4f %s %+6.1f%%%s\n", name, old,
+              results[i].value, results[i].unit, change,
+              (change > threshold) ? "  REGRESSION" : "");
+      if (change > threshold)
+        regressions++;
+    }
+  }
+  fclose(f);
+  return regressions ? 1 : 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: mstpbench [-r runs] [-m min-seconds-per-run] "
+                  "[-b baseline.json [-T percent]]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  struct rx_stream tokens, pfms, data, noise;
+  struct sf_args sf_token = {mftToken, NULL, 0};
+  struct sf_args sf_data = {mftBACnetDataNotExpectingReply, NULL, 501};
+  byte payload[501];
+  struct mstp_data_t *sq_data;
+  queue q;
+  struct q_args qa = {&q, 1};
+  const char *baseline = NULL;
+  double threshold = 10.0;
+  char name[48];
+  unsigned i;
+  int c;
+
+  while ((c = getopt(argc, argv, "r:m:b:T:h")) != -1) {
+    switch (c) {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 'm':
+      min_seconds = atof(optarg);
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 'T':
+      threshold = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((runs < 1) || (runs > 16))
+    usage();
+
+  for (i = 0; i < sizeof(crc_buf); i++)
+    crc_buf[i] = (byte)rand64();
+  for (i = 0; i < sizeof(payload); i++)
+    payload[i] = (byte)rand64();
+
+  bench("crc_header", "ns/byte", run_crc_header, NULL);
+  bench("crc_data", "ns/byte", run_crc_data, NULL);
+
+  if (mstpCoreInit()) {
+    fprintf(stderr, "mstpbench: out of memory\n");
+    return 1;
+  }
+  mstpPortInit(&tx_port);
+  mstpPortInit(&rx_port);
+  mstpSetStation(&rx_port, BENCH_RX_STATION);
+  make_tokens(&tokens);
+  make_pfms(&pfms);
+  make_data(&data, payload);
+  make_noise(&noise);
+  bench("rfsm_tokens", "ns/byte", run_rfsm, &tokens);
+  bench("rfsm_pfm", "ns/byte", run_rfsm, &pfms);
+  bench("rfsm_maxdata", "ns/byte", run_rfsm, &data);
+  bench("rfsm_noise", "ns/byte", run_rfsm, &noise);
+  for (i = 0; i < BENCH_PORTS; i++) {
+    mstpPortInit(&mp_port[i]);
+    mstpSetStation(&mp_port[i], BENCH_RX_STATION);
+  }
+  if (sysconf(_SC_NPROCESSORS_ONLN) >= BENCH_PORTS) { // else it's timeslices
+    bench("rfsm_tokens_4ports", "ns/byte", run_rfsm_ports, &tokens);
+    bench("rfsm_tokens_ticking", "ns/byte", run_rfsm_ticking, &tokens);
+  }
+
+  mstpSetStation(&tx_port, 2);
+  sf_data.data = payload;
+  bench("sendframe_token", "ns/frame", run_sendframe, &sf_token);
+  bench("sendframe_maxdata", "ns/frame", run_sendframe, &sf_data);
+  sq_data = alloc_entry(MSTP_HDR_LEN + sizeof(payload) + 3);
+  sq_data->FrameType = mftBACnetDataNotExpectingReply;
+  sq_data->DestinationAddress = BENCH_RX_STATION;
+  sq_data->SourceAddress = tx_port.This_Station;
+  sq_data->count = sizeof(payload);
+  sq_data->wirelen =
+      mstpBuildFrame(sq_data->data, sq_data->FrameType, BENCH_RX_STATION,
+                     sq_data->SourceAddress, payload, sizeof(payload));
+  bench("sendqueued_maxdata", "ns/frame", run_sendqueued, sq_data);
+  free_entry(sq_data);
+
+  Q_Init(&q);
+  for (qa.threads = 1; qa.threads <= 4; qa.threads *= 2) {
+    snprintf(name, sizeof(name), "queue_%dthread", qa.threads);
+    bench(name, "ns/op", run_queue, &qa);
+  }
+
+  if (baseline)
+    return compare(baseline, threshold);
+  return (sink == 0x5a5a5a5a) ? 3 : 0; // keep sink alive
+}
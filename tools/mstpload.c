@@ -0,0 +1,685 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------
+Description:
+                        Traffic generator and load test for the line
+                        discipline.  Attaches N_MSTP to one or more ttys
+                        (real uarts or /dev/ttyMSV* from mstpvbus.ko),
+                        offers a Poisson mix of DataExpectingReply and
+                        DataNotExpectingReply frames between them through
+                        write(), answers requests and consumes everything
+                        through read().
+
+                        Every frame carries a sequence number and a send
+                        timestamp, so the ports in one run measure end to
+                        end latency, request/reply round trips and loss
+                        against each other.  Kernel slab growth is sampled
+                        from /proc/meminfo for soak runs.
+----------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mstp.h"
+
+#define LOAD_MAX_PORTS 32
+#define LOAD_MAGIC0 'L'
+#define LOAD_MAGIC1 'T'
+#define LOAD_HDR 16 // magic(2) flags(1) mac(1) seq(4) timestamp(8)
+#define LOAD_MAX_PAYLOAD 501
+#define LOAD_F_REQUEST 0x01 // sent as DataExpectingReply, answer it
+#define LOAD_F_REPLY 0x02
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC 1000000000LL
+
+typedef int64_t s64;
+
+typedef struct {
+  s64 res_ns; // bin width
+  int nbins;  // the last bin collects everything above
+  uint32_t *bins;
+  unsigned long n;
+  double sum;
+  s64 max;
+} load_hist;
+
+struct load_port {
+  const char *dev;
+  int fd;
+  int mac;
+  s64 next_send;
+  uint32_t seq;
+  bool online;
+
+  unsigned long offered;
+  unsigned long queued;
+  unsigned long rejected; // -ENOMEM from mstp_write
+  unsigned long unreachable; // -EHOSTUNREACH, the destination is dead
+  unsigned long errors;   // anything else
+  unsigned long tx_bytes; // payload
+  unsigned long requests;
+  unsigned long replies_sent;
+  unsigned long replies_rejected;
+  unsigned long expected; // receptions our frames should cause
+  unsigned long rx_frames;
+  unsigned long rx_bytes;
+  unsigned long rx_replies;
+  unsigned long rx_foreign; // not from this tool
+  unsigned long offline_samples;
+};
+
+static struct load_port lports[LOAD_MAX_PORTS];
+static int nports;
+static int baud = 38400;
+static int info_frames = 1;
+static int max_manager = 127;
+static double run_seconds = 60.0;
+static double join_seconds = 10.0;
+static double interval_seconds = 10.0;
+static double rate = 10.0;
+static int size_min = 64, size_max = 480;
+static int req_min = 16, req_max = 64;
+static int der_pct;
+static int bcast_pct;
+static int verbose;
+static uint64_t rng = 1;
+static load_hist latency, rtt;
+static volatile sig_atomic_t stop;
+
+///////////////////////////////////////////////////////////////////////
+//	helpers
+
+static s64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (s64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static double rand01(void) {
+  // xorshift64*, good enough for traffic
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (double)((rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static int rand_range(int lo, int hi) {
+  return lo + (int)(rand01() * (hi - lo + 1));
+}
+
+static s64 next_gap(void) {
+  return (s64)(-log(1.0 - rand01()) / rate * NSEC_PER_SEC);
+}
+
+static void hist_init(load_hist *h, s64 res_ns, s64 max_ns) {
+  h->res_ns = res_ns;
+  h->nbins = (int)(max_ns / res_ns) + 1;
+  h->bins = calloc(h->nbins, sizeof(*h->bins));
+  if (!h->bins) {
+    perror("mstpload");
+    exit(1);
+  }
+}
+
+static void hist_add(load_hist *h, s64 v) {
+  s64 b = v / h->res_ns;
+
+  if (v < 0)
+    return;
+  if (b >= h->nbins)
+    b = h->nbins - 1;
+  h->bins[b]++;
+  h->n++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+static double hist_pct(const load_hist *h, double p) {
+  unsigned long want = (unsigned long)ceil(h->n * p / 100.0);
+  unsigned long seen = 0;
+  int b;
+
+  if (!h->n)
+    return 0.0;
+  for (b = 0; b < h->nbins; b++) {
+    seen += h->bins[b];
+    if (seen >= want)
+      break;
+  }
+  if (b >= h->nbins - 1)
+    return h->max / 1e6;
+  return (double)(b + 1) * h->res_ns / 1e6;
+}
+
+static void hist_print(const char *name, const load_hist *h) {
+  if (!h->n) {
+    printf("%-9s no samples\n", name);
+    return;
+  }
+  printf("%-9s n=%lu avg %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f "
+         "max %.2f ms\n",
+         name, h->n, h->sum / h->n / 1e6, hist_pct(h, 50), hist_pct(h, 90),
+         hist_pct(h, 99), hist_pct(h, 99.9), h->max / 1e6);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	kernel memory
+//
+//	The line discipline kmallocs every queued frame, so a leak shows up
+//	as unreclaimable slab growing over a soak run.
+
+typedef struct {
+  long slab_kb;
+  long sunreclaim_kb;
+} load_mem;
+
+static load_mem mem_first, mem_last, mem_max;
+static double mem_sx, mem_sy, mem_sxx, mem_sxy; // least squares, hours/kB
+static unsigned long mem_n;
+
+static bool read_meminfo(load_mem *m) {
+  char line[128];
+  FILE *f = fopen("/proc/meminfo", "r");
+
+  if (!f)
+    return false;
+  m->slab_kb = m->sunreclaim_kb = -1;
+  while (fgets(line, sizeof(line), f)) {
+    sscanf(line, "Slab: %ld kB", &m->slab_kb);
+    sscanf(line, "SUnreclaim: %ld kB", &m->sunreclaim_kb);
+  }
+  fclose(f);
+  return m->sunreclaim_kb >= 0;
+}
+
+static void mem_sample(double hours) {
+  load_mem m;
+
+  if (!read_meminfo(&m))
+    return;
+  if (mem_n == 0)
+    mem_first = mem_max = m;
+  if (m.sunreclaim_kb > mem_max.sunreclaim_kb)
+    mem_max = m;
+  mem_last = m;
+  mem_sx += hours;
+  mem_sy += m.sunreclaim_kb;
+  mem_sxx += hours * hours;
+  mem_sxy += hours * m.sunreclaim_kb;
+  mem_n++;
+}
+
+static double mem_slope(void) {
+  double d = mem_n * mem_sxx - mem_sx * mem_sx;
+
+  if ((mem_n < 3) || (d <= 0.0))
+    return 0.0;
+  return (mem_n * mem_sxy - mem_sx * mem_sy) / d;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	ports
+
+static speed_t baud_code(int b) {
+  switch (b) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  }
+  return B0;
+}
+
+static int port_open(struct load_port *p) {
+  struct termios t;
+  int ldisc = N_MSTP;
+
+  p->fd = open(p->dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (p->fd < 0) {
+    fprintf(stderr, "mstpload: %s: %s\n", p->dev, strerror(errno));
+    return -1;
+  }
+  if (baud && (tcgetattr(p->fd, &t) == 0)) {
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    cfsetspeed(&t, baud_code(baud));
+    if (tcsetattr(p->fd, TCSANOW, &t) < 0)
+      fprintf(stderr, "mstpload: %s: can't set %d baud\n", p->dev, baud);
+  }
+  if (ioctl(p->fd, TIOCSETD, &ldisc) < 0) {
+    fprintf(stderr, "mstpload: %s: can't attach N_MSTP: %s\n", p->dev,
+            strerror(errno));
+    return -1;
+  }
+  // the MS/TP ioctls take their argument by value
+  if ((ioctl(p->fd, MSTP_IOC_SETMAXMANAGER, (unsigned long)max_manager) < 0) ||
+      (ioctl(p->fd, MSTP_IOC_SETMAXINFOFRAMES, (unsigned long)info_frames) <
+       0) ||
+      (ioctl(p->fd, MSTP_IOC_SETMACADDRESS, (unsigned long)p->mac) < 0)) {
+    fprintf(stderr, "mstpload: %s: MS/TP ioctl failed: %s\n", p->dev,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static bool port_online(struct load_port *p) {
+  return ioctl(p->fd, MSTP_IOC_GETONLINE, 0) > 0;
+}
+
+static void put32(unsigned char *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+}
+
+static uint32_t get32(const unsigned char *b) {
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+         ((uint32_t)b[2] << 8) | b[3];
+}
+
+static void put64(unsigned char *b, uint64_t v) {
+  put32(b, v >> 32);
+  put32(b + 4, (uint32_t)v);
+}
+
+static uint64_t get64(const unsigned char *b) {
+  return ((uint64_t)get32(b) << 32) | get32(b + 4);
+}
+
+// hand one frame to mstp_write, returns its result
+static int port_write(struct load_port *p, int type, int dest, int flags,
+                      uint32_t seq, s64 stamp, int len) {
+  unsigned char buf[5 + LOAD_MAX_PAYLOAD];
+  unsigned char *d = &buf[5];
+  int i;
+
+  buf[0] = type;
+  buf[1] = dest;
+  buf[2] = 0xFF; // our own MAC
+  buf[3] = len >> 8;
+  buf[4] = len & 0xFF;
+  d[0] = LOAD_MAGIC0;
+  d[1] = LOAD_MAGIC1;
+  d[2] = flags;
+  d[3] = p->mac;
+  put32(&d[4], seq);
+  put64(&d[8], (uint64_t)stamp);
+  for (i = LOAD_HDR; i < len; i++)
+    d[i] = (unsigned char)(seq + i);
+  return (int)write(p->fd, buf, 5 + len);
+}
+
+static void port_send(struct load_port *p, s64 now) {
+  int type = mftBACnetDataNotExpectingReply;
+  int flags = 0;
+  int dest, len, r;
+
+  p->offered++;
+  if ((nports > 1) && (rand_range(0, 99) < bcast_pct)) {
+    dest = 255;
+  } else if (nports > 1) {
+    do
+      dest = lports[rand_range(0, nports - 1)].mac;
+    while (dest == p->mac);
+  } else {
+    dest = 255;
+  }
+  if ((dest != 255) && (rand_range(0, 99) < der_pct)) {
+    type = mftBACnetDataExpectingReply;
+    flags = LOAD_F_REQUEST;
+    len = rand_range(req_min, req_max);
+  } else {
+    len = rand_range(size_min, size_max);
+  }
+  r = port_write(p, type, dest, flags, p->seq++, now, len);
+  if (r > 0) {
+    p->queued++;
+    p->tx_bytes += len;
+    p->expected += (dest == 255) ? (nports - 1) : 1;
+    if (flags & LOAD_F_REQUEST)
+      p->requests++;
+  } else if ((r < 0) && (errno == ENOMEM)) {
+    p->rejected++;
+  } else if ((r < 0) && (errno == EHOSTUNREACH)) {
+    p->unreachable++;
+  } else {
+    p->errors++;
+  }
+}
+
+static void port_receive(struct load_port *p, s64 now) {
+  unsigned char buf[1 + INPUT_BUFFER_SIZE];
+  const unsigned char *d = &buf[1]; // buf[0] is the source MAC
+  int n, r;
+
+  while ((n = (int)read(p->fd, buf, sizeof(buf))) > 0) {
+    n--;
+    if ((n < LOAD_HDR) || (d[0] != LOAD_MAGIC0) || (d[1] != LOAD_MAGIC1)) {
+      p->rx_foreign++;
+      continue;
+    }
+    if (d[2] & LOAD_F_REPLY) {
+      p->rx_replies++;
+      hist_add(&rtt, now - (s64)get64(&d[8]));
+      continue;
+    }
+    p->rx_frames++;
+    p->rx_bytes += n;
+    hist_add(&latency, now - (s64)get64(&d[8]));
+    if (d[2] & LOAD_F_REQUEST) {
+      r = port_write(p, mftBACnetDataNotExpectingReply, buf[0], LOAD_F_REPLY,
+                     get32(&d[4]), (s64)get64(&d[8]), LOAD_HDR);
+      if (r > 0)
+        p->replies_sent++;
+      else
+        p->replies_rejected++;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+//	reports
+
+static void totals(struct load_port *t) {
+  int i;
+
+  memset(t, 0, sizeof(*t));
+  for (i = 0; i < nports; i++) {
+    struct load_port *p = &lports[i];
+    t->offered += p->offered;
+    t->queued += p->queued;
+    t->rejected += p->rejected;
+    t->unreachable += p->unreachable;
+    t->errors += p->errors;
+    t->tx_bytes += p->tx_bytes;
+    t->requests += p->requests;
+    t->replies_sent += p->replies_sent;
+    t->replies_rejected += p->replies_rejected;
+    t->expected += p->expected;
+    t->rx_frames += p->rx_frames;
+    t->rx_bytes += p->rx_bytes;
+    t->rx_replies += p->rx_replies;
+    t->rx_foreign += p->rx_foreign;
+    t->offline_samples += p->offline_samples;
+  }
+}
+
+static void report_interval(double secs, struct load_port *prev) {
+  struct load_port t;
+  int i;
+
+  totals(&t);
+  for (i = 0; i < nports; i++)
+    if (!port_online(&lports[i]))
+      lports[i].offline_samples++;
+  printf("%8.0f s  tx %7.1f/s  rx %7.1f/s  rejected %lu  p99 %.2f ms  "
+         "SUnreclaim %+ld kB\n",
+         secs, (t.queued - prev->queued) / interval_seconds,
+         (t.rx_frames - prev->rx_frames) / interval_seconds,
+         t.rejected - prev->rejected, hist_pct(&latency, 99),
+         mem_last.sunreclaim_kb - mem_first.sunreclaim_kb);
+  fflush(stdout);
+  *prev = t;
+}
+
+static void report(double secs) {
+  struct load_port t;
+  long lost;
+  int i;
+
+  totals(&t);
+  lost = (long)t.expected - (long)t.rx_frames;
+  printf("mstpload: %d ports, %d baud, %.1f s measured\n", nports, baud, secs);
+  printf("offered:  %.1f frames/s, %lu queued, %lu rejected (-ENOMEM), "
+         "%lu unreachable, %lu other errors\n",
+         t.offered / secs, t.queued, t.rejected, t.unreachable, t.errors);
+  printf("sent:     %.1f frames/s, %.0f bytes/s payload, %lu requests\n",
+         t.queued / secs, t.tx_bytes / secs, t.requests);
+  printf("received: %.1f frames/s, %.0f bytes/s payload, %lu lost, "
+         "%lu foreign\n",
+         t.rx_frames / secs, t.rx_bytes / secs, lost > 0 ? lost : 0,
+         t.rx_foreign);
+  printf("replies:  %lu sent, %lu rejected, %lu received\n", t.replies_sent,
+         t.replies_rejected, t.rx_replies);
+  hist_print("latency:", &latency);
+  hist_print("rtt:", &rtt);
+  if (mem_n)
+    printf("kernel:   Slab %+ld kB, SUnreclaim %+ld kB (peak %+ld kB), "
+           "trend %+.1f kB/h\n",
+           mem_last.slab_kb - mem_first.slab_kb,
+           mem_last.sunreclaim_kb - mem_first.sunreclaim_kb,
+           mem_max.sunreclaim_kb - mem_first.sunreclaim_kb, mem_slope());
+  if (t.offline_samples)
+    printf("warning:  ports were offline in %lu samples\n", t.offline_samples);
+  if (!verbose)
+    return;
+  printf("\n%-16s mac  offered   queued rejected  errors  rx_frames "
+         "replies foreign\n",
+         "device");
+  for (i = 0; i < nports; i++) {
+    struct load_port *p = &lports[i];
+    printf("%-16s %3d %8lu %8lu %8lu %7lu %10lu %7lu %7lu\n", p->dev, p->mac,
+           p->offered, p->queued, p->rejected, p->errors, p->rx_frames,
+           p->rx_replies, p->rx_foreign);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: mstpload [options] -p tty:mac [-p tty:mac ...]\n"
+          "  -p tty:mac   port to attach N_MSTP to, repeatable (max 32)\n"
+          "  -b baud      9600, 19200, 38400, 57600, 115200, 0 leaves the\n"
+          "               tty settings alone (38400)\n"
+          "  -m frames    Nmax_info_frames (1)\n"
+          "  -M mac       Nmax_manager (127)\n"
+          "  -t seconds   measured time, 0 runs until interrupted (60)\n"
+          "  -w seconds   wait for the ports to join the ring (10)\n"
+          "  -i seconds   interval between progress lines (10)\n"
+          "  -r rate      frames per second offered by each port (10)\n"
+          "  -s min[:max] DataNotExpectingReply payload size (64:480)\n"
+          "  -q min[:max] DataExpectingReply payload size (16:64)\n"
+          "  -d percent   share of DataExpectingReply frames (0)\n"
+          "  -B percent   share of broadcasts (0)\n"
+          "  -S seed      random seed (1)\n"
+          "  -v           per port table\n");
+  exit(2);
+}
+
+static void parse_size(const char *s, int *lo, int *hi) {
+  char *end;
+
+  *lo = (int)strtol(s, &end, 0);
+  *hi = (*end == ':') ? (int)strtol(end + 1, NULL, 0) : *lo;
+  if (*lo < LOAD_HDR)
+    *lo = LOAD_HDR;
+  if (*hi > LOAD_MAX_PAYLOAD)
+    *hi = LOAD_MAX_PAYLOAD;
+  if (*hi < *lo)
+    *hi = *lo;
+}
+
+static void on_signal(int sig) { stop = 1; }
+
+int main(int argc, char **argv) {
+  struct load_port prev;
+  s64 t0, end, now, next_report, next_mem, deadline;
+  char *colon;
+  bool all;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "p:b:m:M:t:w:i:r:s:q:d:B:S:vh")) != -1) {
+    switch (c) {
+    case 'p':
+      colon = strrchr(optarg, ':');
+      if (!colon || (nports == LOAD_MAX_PORTS))
+        usage();
+      *colon = '\0';
+      lports[nports].dev = optarg;
+      lports[nports].mac = atoi(colon + 1);
+      lports[nports].fd = -1;
+      nports++;
+      break;
+    case 'b':
+      baud = atoi(optarg);
+      break;
+    case 'm':
+      info_frames = atoi(optarg);
+      break;
+    case 'M':
+      max_manager = atoi(optarg);
+      break;
+    case 't':
+      run_seconds = atof(optarg);
+      break;
+    case 'w':
+      join_seconds = atof(optarg);
+      break;
+    case 'i':
+      interval_seconds = atof(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 's':
+      parse_size(optarg, &size_min, &size_max);
+      break;
+    case 'q':
+      parse_size(optarg, &req_min, &req_max);
+      break;
+    case 'd':
+      der_pct = atoi(optarg);
+      break;
+    case 'B':
+      bcast_pct = atoi(optarg);
+      break;
+    case 'S':
+      rng = strtoull(optarg, NULL, 0);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((nports == 0) || (rate <= 0.0) || (interval_seconds <= 0.0) ||
+      (max_manager < 1) || (max_manager > 127) ||
+      (baud && (baud_code(baud) == B0)))
+    usage();
+  for (i = 0; i < nports; i++)
+    if ((lports[i].mac < 0) || (lports[i].mac > max_manager)) {
+      fprintf(stderr, "mstpload: MAC %d is not a manager under %d\n",
+              lports[i].mac, max_manager);
+      return 2;
+    }
+  if (!rng)
+    rng = 1;
+  hist_init(&latency, 100000, 10 * NSEC_PER_SEC); // 0.1 ms bins
+  hist_init(&rtt, 100000, 10 * NSEC_PER_SEC);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  for (i = 0; i < nports; i++)
+    if (port_open(&lports[i]) < 0)
+      return 1;
+
+  // until a port has joined mstp_write only pretends to send
+  deadline = now_ns() + (s64)(join_seconds * NSEC_PER_SEC);
+  do {
+    all = true;
+    for (i = 0; i < nports; i++)
+      all &= (lports[i].online = port_online(&lports[i]));
+    if (all || stop)
+      break;
+    usleep(10000);
+  } while (now_ns() < deadline);
+  if (!all)
+    for (i = 0; i < nports; i++)
+      if (!lports[i].online)
+        fprintf(stderr, "mstpload: %s hasn't joined the ring\n",
+                lports[i].dev);
+
+  t0 = now_ns();
+  end = (run_seconds > 0.0) ? t0 + (s64)(run_seconds * NSEC_PER_SEC) : 0;
+  next_report = t0 + (s64)(interval_seconds * NSEC_PER_SEC);
+  next_mem = t0;
+  memset(&prev, 0, sizeof(prev));
+  for (i = 0; i < nports; i++)
+    lports[i].next_send = t0 + next_gap();
+
+  // the line discipline's poll() doesn't report anything, so look at
+  // every port once a millisecond
+  for (now = t0; !stop && (!end || (now < end)); now = now_ns()) {
+    for (i = 0; i < nports; i++) {
+      struct load_port *p = &lports[i];
+      while (p->next_send <= now) {
+        port_send(p, now);
+        p->next_send += next_gap();
+      }
+    }
+    for (i = 0; i < nports; i++)
+      port_receive(&lports[i], now);
+    if (now >= next_mem) {
+      mem_sample((double)(now - t0) / 3600e9);
+      next_mem += NSEC_PER_SEC;
+    }
+    if (now >= next_report) {
+      report_interval((double)(now - t0) / NSEC_PER_SEC, &prev);
+      next_report += (s64)(interval_seconds * NSEC_PER_SEC);
+    }
+    usleep(1000);
+  }
+  end = now_ns();
+
+  // give the ring a second to deliver what is still queued
+  for (deadline = end + NSEC_PER_SEC; (now = now_ns()) < deadline;) {
+    for (i = 0; i < nports; i++)
+      port_receive(&lports[i], now);
+    usleep(1000);
+  }
+  report((double)(end - t0) / NSEC_PER_SEC);
+  for (i = 0; i < nports; i++)
+    close(lports[i].fd);
+  return 0;
+}
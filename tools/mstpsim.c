@@ -0,0 +1,1294 @@
+/*-----------------------------------------------------------------------------
+Copyright 2022 Coleman Brumley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------
+Description:
+                        Discrete event simulator for one MS/TP segment.
+                        Every node runs the real protocol core (mstpcore.c)
+                        against a virtual half-duplex bus: octets take
+                        10 bit times, arrive at the other nodes in UART
+                        FIFO sized chunks, overlapping transmissions are
+                        garbled and a bit error rate can be injected.
+                        Each node has its own tick (1 ms, -T tick_us, with
+                        a random phase) and a Poisson traffic generator.
+
+                        Idle nodes are only woken when a frame arrives or
+                        their Tno_token deadline comes up, which is what
+                        lets a 127 node segment run much faster than real
+                        time.
+----------------------------------------------------------------------------*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stddef.h>
+
+#include "mstpport.h"
+
+#define SIM_MAX_NODES 127
+#define SIM_MAX_TX 16 // transmissions on the wire at once (>1 = collision)
+#define SIM_MIN_PAYLOAD 12 // timestamp + sequence number
+#define SIM_MAX_PAYLOAD 501
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC 1000000000LL
+
+enum { EV_TICK, EV_CHUNK, EV_GEN, EV_WARMUP, EV_RESTART, EV_UP };
+
+typedef struct {
+  s64 t;
+  u64 seq; // keeps events at the same instant in FIFO order
+  int kind;
+  int idx;
+  unsigned gen;
+} sim_event;
+
+typedef struct {
+  s64 res_ns; // bin width
+  int nbins;  // the last bin collects everything above
+  u32 *bins;
+  unsigned long n;
+  double sum;
+  s64 max;
+} sim_hist;
+
+struct sim_node {
+  struct mstp_port port; // first, so the hooks can cast back to the node
+  int idx;
+  s64 silence_base; // SilenceTimer is (now - silence_base) in ms
+  s64 line_quiet;   // when this node last saw an octet end
+  s64 tx_at;        // when the frame being sent starts driving the line
+  s64 tx_start;     // current/last transmission
+  s64 tx_end;
+  s64 phase; // offset of our 1 ms tick
+  s64 next_tick;
+  unsigned tick_gen; // stale EV_TICKs carry an older generation
+  s64 last_token;    // last time a token addressed to us went by
+  s64 dies_at;       // -k, goes silent from then on, -1 never
+  s64 down_ms;       // -W, how long a restart takes
+  bool down;         // -W, restarting
+  bool restarted;
+  struct mstp_warm warm; // what it kept over the restart
+  bool joined;
+  // traffic generator
+  double rate; // frames per second
+  int size_min, size_max;
+  u32 seqno;
+  int pending;  // -J, samples since the last write, sent as one
+  byte tok_event; // -J, what mstpPortTokenEvent said during this tick
+  bool tok_soon;  // -J, MSTP_TOK_SOON came for this visit
+  // statistics
+  unsigned long generated, queued, rejected, offline, unreachable;
+  unsigned long rx_frames, rx_bytes;
+  unsigned long tokens;
+};
+
+struct sim_tx {
+  bool busy;
+  bool collided;
+  int node;
+  s64 start;
+  int len;
+  int done; // octets handed to the receivers so far
+  byte buf[maxtx + 8];
+  char flags[maxtx + 8];
+};
+
+///////////////////////////////////////////////////////////////////////
+//	configuration
+
+static int nnodes = 32;
+static int baud = 76800;
+static double sim_seconds = 60.0;
+static double warmup_seconds = 5.0;
+static int info_frames = 1;
+static int max_manager = 127;
+static int tusage = 35;
+static double ber = 0.0;
+static double rate = 10.0;
+static int size_min = 64, size_max = 480;
+static int der_pct = 0;
+static int test_pct = 0; // -E, unicast frames sent as TestRequest
+static int bcast_pct = 0;
+static int fifo = 16;
+static u64 seed = 1;
+static int verbose = 0;
+static int nkilled = 0;
+static int peer_timeouts = 3;
+static int tx_sched = MSTP_TXS_FIFO;
+static int drop_bcast = 0;
+static int ring_tune = MSTP_RING_OFF;
+static int usage_adapt = 0;
+static int custom_timing = 0;
+static int cold_restarts = 0;
+static int tx_report = 0;
+static int tx_ttl = 0;
+static int jit_lead = -1; // -J, -1 writes every sample as it is taken
+static int nrestarts = 0;
+static const char *timings[16];
+static int ntimings = 0;
+
+///////////////////////////////////////////////////////////////////////
+//	simulation state
+
+static struct sim_node nodes[SIM_MAX_NODES];
+static struct sim_tx txs[SIM_MAX_TX];
+static s64 now;
+static s64 octet_ns;      // 10 bit times
+static s64 turnaround_ns; // 40 bit times
+static bool measuring;
+static s64 measure_start;
+static s64 ring_formed = -1;
+static int njoined;
+static u64 rng;
+
+static sim_event *heap;
+static int heap_n, heap_cap;
+static u64 heap_seq;
+
+// bus and traffic statistics, only while measuring
+static sim_hist rotation, latency, txdone;
+static unsigned long txr_outcomes[MSTP_TXR_OUTCOMES], txr_badcookie;
+static unsigned long jit_events[MSTP_TOK_HERE + 1], jit_coalesced;
+static unsigned long echo_req, echo_full, echo_short;
+static int echo_owed[SIM_MAX_NODES]; // TestRequest data length + 1, 0 none
+static unsigned long frames_on_wire, octets_on_wire, tokens_passed, pfms;
+static unsigned long collisions, noise_hits, tx_overflows;
+static unsigned long delivered, delivered_bytes, bcast_delivered;
+static s64 busy_ns;
+
+///////////////////////////////////////////////////////////////////////
+//	xorshift64*, good enough and reproducible for a given seed
+
+static u64 rand64(void) {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ULL;
+}
+
+static double rand01(void) {
+  return (rand64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int rand_range(int lo, int hi) {
+  if (hi <= lo)
+    return lo;
+  return lo + (int)(rand64() % (u64)(hi - lo + 1));
+}
+
+///////////////////////////////////////////////////////////////////////
+//	histograms
+
+static void hist_init(sim_hist *h, s64 res_ns, s64 span_ns) {
+  h->res_ns = res_ns;
+  h->nbins = (int)(span_ns / res_ns) + 1;
+  h->bins = calloc(h->nbins, sizeof(u32));
+  if (!h->bins) {
+    fprintf(stderr, "mstpsim: out of memory\n");
+    exit(1);
+  }
+}
+
+static void hist_add(sim_hist *h, s64 v) {
+  s64 b = v / h->res_ns;
+
+  if (b < 0)
+    b = 0;
+  if (b >= h->nbins)
+    b = h->nbins - 1;
+  h->bins[b]++;
+  h->n++;
+  h->sum += (double)v;
+  if (v > h->max)
+    h->max = v;
+}
+
+// in:	h	the histogram
+//		p	percentile, 0..100
+//
+// out:	upper edge of the bin holding the percentile, in ms
+
+static double hist_pct(const sim_hist *h, double p) {
+  unsigned long want = (unsigned long)ceil(h->n * p / 100.0);
+  unsigned long seen = 0;
+  int b;
+
+  if (!h->n)
+    return 0.0;
+  for (b = 0; b < h->nbins; b++) {
+    seen += h->bins[b];
+    if (seen >= want)
+      break;
+  }
+  if (b >= h->nbins - 1)
+    return h->max / 1e6;
+  return (double)(b + 1) * h->res_ns / 1e6;
+}
+
+static void hist_print(const char *name, const sim_hist *h) {
+  if (!h->n) {
+    printf("%-9s no samples\n", name);
+    return;
+  }
+  printf("%-9s n=%lu avg %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f ms\n",
+         name, h->n, h->sum / h->n / 1e6, hist_pct(h, 50), hist_pct(h, 90),
+         hist_pct(h, 99), h->max / 1e6);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	event queue, a binary heap ordered by (t, seq)
+
+static bool ev_before(const sim_event *a, const sim_event *b) {
+  return (a->t < b->t) || ((a->t == b->t) && (a->seq < b->seq));
+}
+
+static void ev_push(s64 t, int kind, int idx, unsigned gen) {
+  sim_event e = {t, heap_seq++, kind, idx, gen};
+  int i;
+
+  if (heap_n == heap_cap) {
+    heap_cap = heap_cap ? heap_cap * 2 : 1024;
+    heap = realloc(heap, heap_cap * sizeof(*heap));
+    if (!heap) {
+      fprintf(stderr, "mstpsim: out of memory\n");
+      exit(1);
+    }
+  }
+  i = heap_n++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!ev_before(&e, &heap[parent]))
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = e;
+}
+
+static bool ev_pop(sim_event *out) {
+  sim_event last;
+  int i = 0;
+
+  if (!heap_n)
+    return false;
+  *out = heap[0];
+  last = heap[--heap_n];
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= heap_n)
+      break;
+    if ((c + 1 < heap_n) && ev_before(&heap[c + 1], &heap[c]))
+      c++;
+    if (!ev_before(&heap[c], &last))
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	node ticks
+
+// in:	n	the node
+//		t	any time
+//
+// out:	the first tick of n at or after t
+
+static s64 tick_align(struct sim_node *n, s64 t) {
+  s64 tick = n->port.timing.tick_us * 1000LL, k;
+
+  if (t <= n->phase)
+    return n->phase;
+  k = (t - n->phase + tick - 1) / tick;
+  return n->phase + k * tick;
+}
+
+static void tick_schedule(struct sim_node *n, s64 t) {
+  n->next_tick = t;
+  n->tick_gen++;
+  ev_push(t, EV_TICK, n->idx, n->tick_gen);
+}
+
+// a frame arrived, make sure the MNSM gets to look at it on its next tick
+
+static void tick_wake(struct sim_node *n) {
+  s64 t = tick_align(n, now);
+
+  if (t < n->next_tick)
+    tick_schedule(n, t);
+}
+
+// -k: the node is switched off, it neither sends nor receives
+
+static bool node_dead(struct sim_node *n) {
+  return n->down || ((n->dies_at >= 0) && (now >= n->dies_at));
+}
+
+static bool node_joined(struct sim_node *n) {
+  return (n->port.joined_state != 0) || (n->port.SoleManager == true);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	traffic generator
+
+static void gen_schedule(struct sim_node *n) {
+  if (n->rate <= 0.0)
+    return;
+  ev_push(now + (s64)(-log(1.0 - rand01()) / n->rate * NSEC_PER_SEC), EV_GEN,
+          n->idx, 0);
+}
+
+// write one frame, sampled now
+
+static int sim_write(struct sim_node *n) {
+  byte buf[SIM_MAX_PAYLOAD + 5 + sizeof(now)];
+  int len = rand_range(n->size_min, n->size_max);
+  byte da;
+  int rc;
+
+  if ((nnodes < 2) || ((int)(rand64() % 100) < bcast_pct))
+    da = MSTP_BROADCAST_ADDRESS;
+  else {
+    da = (byte)(rand64() % (nnodes - 1));
+    if (da >= n->idx)
+      da++;
+  }
+  buf[0] = ((int)(rand64() % 100) < der_pct) ? mftBACnetDataExpectingReply
+                                              : mftBACnetDataNotExpectingReply;
+  if (test_pct && (da != MSTP_BROADCAST_ADDRESS) &&
+      ((int)(rand64() % 100) < test_pct))
+    buf[0] = mftTestRequest; // the MNSM of da echoes it, see -E
+  buf[1] = da;
+  buf[2] = 0xFF; // from This_Station
+  buf[3] = (byte)(len >> 8);
+  buf[4] = (byte)len;
+  memset(&buf[5], 0, len);
+  memcpy(&buf[5], &now, sizeof(now));
+  memcpy(&buf[5 + sizeof(now)], &n->seqno, sizeof(n->seqno));
+  n->seqno++;
+  memcpy(&buf[5 + len], &now, sizeof(now)); // the -c cookie
+
+  if (measuring)
+    n->generated++;
+  if (measuring &&
+      ((n->port.joined_state == 0) || (n->port.SoleManager == true)))
+    n->offline++; // held, or refused if too many are
+  rc = mstpQueueFrame(&n->port, buf, len + 5 + (tx_report ? sizeof(now) : 0));
+  if (measuring) {
+    if (rc == -EHOSTUNREACH)
+      n->unreachable++;
+    else if (rc < 0)
+      n->rejected++;
+    else
+      n->queued++;
+  }
+  return rc;
+}
+
+static void sim_generate(struct sim_node *n) {
+  if (node_dead(n)) {
+    if (n->down)
+      gen_schedule(n); // the application comes back with it
+    return;            // and no more generating
+  }
+  if ((jit_lead < 0) || n->tok_soon)
+    sim_write(n);
+  else
+    n->pending++; // -J: written when the token is near
+  gen_schedule(n);
+}
+
+// -J: the token is due soon, write the latest value if there is room.
+// Until the token comes new samples are written at once.  When it came
+// first the visit is likely gone, write for the next one
+
+static void sim_jit(struct sim_node *n) {
+  struct mstp_token_info ti;
+
+  if (measuring)
+    jit_events[n->tok_event]++;
+  if (n->tok_event == MSTP_TOK_HERE) {
+    bool missed = !n->tok_soon;
+    n->tok_soon = false;
+    if (!missed)
+      return;
+  } else
+    n->tok_soon = true;
+  mstpTokenInfo(&n->port, &ti);
+  if ((n->pending == 0) || (ti.budget == 0) || (sim_write(n) < 0))
+    return;
+  if (measuring)
+    jit_coalesced += n->pending - 1;
+  n->pending = 0;
+}
+
+// -c: what the application would read with MSTP_IOC_GETTXREPORT
+
+static void sim_reports(struct sim_node *n) {
+  struct mstp_txreport r;
+
+  while (mstpTxrPop(&n->port, &r)) {
+    if (!measuring || ((s64)r.queued_ns < measure_start))
+      continue;
+    txr_outcomes[r.outcome]++;
+    if (r.cookie != r.queued_ns) // sim_write passes now as the cookie
+      txr_badcookie++;
+    if (r.done_ns)
+      hist_add(&txdone, (s64)(r.done_ns - r.queued_ns));
+  }
+}
+
+static void sim_tick(struct sim_node *n) {
+  struct mstp_port *port = &n->port;
+  s64 next;
+  bool joined;
+
+  if (node_dead(n)) {
+    if (n->joined) {
+      n->joined = false;
+      njoined--;
+    }
+    return; // no more ticks
+  }
+  n->tok_event = MSTP_TOK_NONE;
+  mstpServiceMNSM(port);
+  sim_reports(n);
+  if (n->tok_event != MSTP_TOK_NONE)
+    sim_jit(n);
+
+  joined = node_joined(n);
+  if (joined != n->joined) {
+    n->joined = joined;
+    njoined += joined ? 1 : -1;
+    if ((njoined == nnodes) && (ring_formed < 0))
+      ring_formed = now;
+  }
+
+  next = now + port->timing.tick_us * 1000LL;
+  if ((port->mnstate == mnsmIdle) && !port->ReceivedValidFrame &&
+      !port->ReceivedInvalidFrame && !mstpFrameEventPending(port)) {
+    // nothing to do until a frame shows up or we lose the token
+    s64 lost = tick_align(
+        n, n->silence_base + port->timing.Tno_token * NSEC_PER_MSEC);
+    if (lost > next)
+      next = lost;
+    if (port->tok_notify && !port->tok_soon && port->tok_rot) {
+      // or until the token is due within the lead time
+      struct mstp_token_info ti;
+      s64 soon;
+      mstpTokenInfo(port, &ti);
+      soon = (ti.eta_ms > ti.lead_ms)
+                 ? tick_align(n, now + (s64)(ti.eta_ms - ti.lead_ms) *
+                                           NSEC_PER_MSEC)
+                 : now + port->timing.tick_us * 1000LL;
+      if (soon < next)
+        next = soon;
+    }
+  }
+  tick_schedule(n, next);
+}
+
+///////////////////////////////////////////////////////////////////////
+//	the bus
+
+static void tx_garble(struct sim_tx *tx, s64 from, s64 to) {
+  int first = (int)((from - tx->start) / octet_ns);
+  int last = (int)((to - tx->start + octet_ns - 1) / octet_ns);
+  int i;
+
+  if (first < tx->done)
+    first = tx->done;
+  if (last > tx->len)
+    last = tx->len;
+  for (i = first; i < last; i++) {
+    tx->buf[i] ^= (byte)rand64();
+    tx->flags[i] = TTY_FRAME;
+  }
+  tx->collided = true;
+}
+
+static s64 tx_end(const struct sim_tx *tx) {
+  return tx->start + tx->len * octet_ns;
+}
+
+static int sim_transmit(struct sim_node *n, const byte *buf, int len) {
+  struct sim_tx *tx = NULL;
+  s64 start, end;
+  int i, chunk;
+
+  for (i = 0; i < SIM_MAX_TX; i++)
+    if (!txs[i].busy) {
+      tx = &txs[i];
+      break;
+    }
+  if (!tx) {
+    tx_overflows++;
+    return len; // the line is a mess anyway, lose it
+  }
+  start = (n->tx_at > n->tx_end) ? n->tx_at : n->tx_end;
+  end = start + len * octet_ns;
+
+  tx->busy = true;
+  tx->collided = false;
+  tx->node = n->idx;
+  tx->start = start;
+  tx->len = len;
+  tx->done = 0;
+  memcpy(tx->buf, buf, len);
+  memset(tx->flags, TTY_NORMAL, len);
+
+  if (ber > 0.0) {
+    double p = 1.0 - pow(1.0 - ber, 10.0); // per octet, 10 bits each
+    for (i = 0; i < len; i++) {
+      if (rand01() >= p)
+        continue;
+      if (rand64() % 10 < 8)
+        tx->buf[i] ^= (byte)(1 << (rand64() % 8)); // a data bit
+      else
+        tx->flags[i] = TTY_FRAME; // start or stop bit
+      if (measuring)
+        noise_hits++;
+    }
+  }
+
+  for (i = 0; i < SIM_MAX_TX; i++) {
+    struct sim_tx *o = &txs[i];
+    s64 ostart, oend;
+    if (!o->busy || (o == tx))
+      continue;
+    ostart = o->start;
+    oend = tx_end(o);
+    if ((oend > start) && (ostart < end)) {
+      s64 from = (ostart > start) ? ostart : start;
+      s64 to = (oend < end) ? oend : end;
+      tx_garble(o, from, to);
+      tx_garble(tx, from, to);
+      if (measuring)
+        collisions++;
+    }
+  }
+
+  n->tx_start = start;
+  n->tx_end = end;
+  if (measuring) {
+    frames_on_wire++;
+    octets_on_wire += len;
+    busy_ns += end - start;
+  }
+  chunk = (len < fifo) ? len : fifo;
+  ev_push(start + chunk * octet_ns, EV_CHUNK, (int)(tx - txs), 0);
+  return len;
+}
+
+// the application side: read everything the node has received
+
+static void sim_drain(struct sim_node *n) {
+  struct mstp_data_t *d;
+
+  while (Q_Size(&n->port.receive_queue)) {
+    d = Q_PopTail(&n->port.receive_queue);
+    if (!d)
+      break;
+    n->rx_frames++;
+    n->rx_bytes += d->count;
+    if (measuring) {
+      delivered++;
+      delivered_bytes += d->count;
+      if (d->DestinationAddress == MSTP_BROADCAST_ADDRESS)
+        bcast_delivered++;
+      if (d->count >= SIM_MIN_PAYLOAD) {
+        s64 ts;
+        memcpy(&ts, d->data, sizeof(ts));
+        if (ts >= measure_start)
+          hist_add(&latency, now - ts);
+      }
+    }
+    free_entry(d);
+  }
+}
+
+static void sim_frame_done(struct sim_tx *tx) {
+  struct sim_node *sender = &nodes[tx->node];
+  byte type = tx->buf[2], da = tx->buf[3];
+
+  sender->line_quiet = now;
+  if (tx->collided || !measuring)
+    return;
+  if (type == mftPollForManager)
+    pfms++;
+  // -E: does the TestResponse carry the TestRequest's data back?
+  if ((type == mftTestRequest) && (da < nnodes)) {
+    echo_req++;
+    echo_owed[da] = tx->buf[5] * 256 + tx->buf[6] + 1;
+  }
+  if ((type == mftTestResponse) && echo_owed[tx->node]) {
+    if (tx->buf[5] * 256 + tx->buf[6] + 1 == echo_owed[tx->node])
+      echo_full++;
+    else
+      echo_short++;
+    echo_owed[tx->node] = 0;
+  }
+  if ((type == mftToken) && (da < nnodes)) {
+    struct sim_node *d = &nodes[da];
+    tokens_passed++;
+    d->tokens++;
+    if (d->last_token)
+      hist_add(&rotation, now - d->last_token);
+    d->last_token = now;
+  }
+}
+
+static void sim_chunk(struct sim_tx *tx) {
+  int upto = tx->done + fifo;
+  s64 from;
+  int i;
+
+  if (upto > tx->len)
+    upto = tx->len;
+  from = tx->start + tx->done * octet_ns;
+  for (i = 0; i < nnodes; i++) {
+    struct sim_node *r = &nodes[i];
+    if ((i == tx->node) || node_dead(r))
+      continue;
+    if ((r->tx_end > from) && (r->tx_start < now))
+      continue; // half duplex, our receiver was off while we drove the line
+    r->line_quiet = now;
+    mstpReceiveOctets(&r->port, tx->buf + tx->done, tx->flags + tx->done,
+                      upto - tx->done);
+    sim_drain(r);
+    if (r->port.ReceivedValidFrame || r->port.ReceivedInvalidFrame ||
+        mstpFrameEventPending(&r->port) || (r->port.mnstate != mnsmIdle))
+      tick_wake(r);
+  }
+  tx->done = upto;
+  if (tx->done < tx->len) {
+    int chunk = tx->len - tx->done;
+    if (chunk > fifo)
+      chunk = fifo;
+    ev_push(now + chunk * octet_ns, EV_CHUNK, (int)(tx - txs), 0);
+    return;
+  }
+  sim_frame_done(tx);
+  tx->busy = false;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	the hooks mstpcore.c needs, see mstp.h
+
+static struct sim_node *sim_node_of(struct mstp_port *port) {
+  return (struct sim_node *)port;
+}
+
+int mstpPortReadSilence(struct mstp_port *port) {
+  return (int)((now - sim_node_of(port)->silence_base) / NSEC_PER_MSEC);
+}
+
+void mstpPortResetSilence(struct mstp_port *port) {
+  sim_node_of(port)->silence_base = now;
+}
+
+void mstpPortSetSilence(struct mstp_port *port, int val) {
+  sim_node_of(port)->silence_base = now - (s64)val * NSEC_PER_MSEC;
+}
+
+int mstpPortTransmitComplete(struct mstp_port *port) {
+  return now >= sim_node_of(port)->tx_end;
+}
+
+void mstpPortTurnaround(struct mstp_port *port) {
+  struct sim_node *n = sim_node_of(port);
+  s64 t = n->line_quiet + turnaround_ns;
+
+  n->tx_at = (t > now) ? t : now;
+}
+
+int mstpPortSend(struct mstp_port *port, const byte *buf, int len) {
+  return sim_transmit(sim_node_of(port), buf, len);
+}
+
+unsigned int mstpPortClock(struct mstp_port *port) {
+  return (unsigned int)(now / NSEC_PER_MSEC);
+}
+
+unsigned long long mstpPortTime(struct mstp_port *port) { return now; }
+
+void mstpPortTokenEvent(struct mstp_port *port) {
+  sim_node_of(port)->tok_event = port->tok_state;
+}
+
+///////////////////////////////////////////////////////////////////////
+//	setup and reporting
+
+static void start_measuring(void) {
+  int i;
+
+  measuring = true;
+  measure_start = now;
+  for (i = 0; i < nnodes; i++)
+    nodes[i].last_token = 0;
+}
+
+static void report(double wall) {
+  double secs = (now - measure_start) / 1e9;
+  unsigned long gen = 0, queued = 0, rejected = 0, offline = 0;
+  unsigned long hdrcrc = 0, datacrc = 0, fe = 0, aborts = 0;
+  unsigned long unreachable = 0, failed = 0, probes = 0;
+  unsigned long visits = 0, sent = 0, full = 0, wait_ms = 0;
+  unsigned long rxf[MSTP_RXF_VERDICTS] = {0};
+  unsigned long tunes = 0, retries = 0, usage = 0;
+  unsigned long usage_q = 0, usage_qmax = 0; // ms/16, see struct mstp_peer
+  int usage_nq = 0;
+  unsigned long held = 0, expired = 0, holdfull = 0, stale = 0, early = 0;
+  unsigned long join_sum = 0, join_max = 0, rejoin = 0;
+  int joins = 0, waiting = 0;
+  struct mstp_ring ring;
+  int i;
+
+  for (i = 0; i < nnodes; i++) {
+    struct sim_node *n = &nodes[i];
+    gen += n->generated;
+    queued += n->queued;
+    rejected += n->rejected;
+    offline += n->offline;
+    unreachable += n->unreachable;
+    failed += n->port.peer_failed;
+    probes += n->port.peer_probes;
+    visits += n->port.tok_visits;
+    sent += n->port.tok_frames;
+    full += n->port.tok_full;
+    wait_ms += n->port.tok_wait_ms;
+    tunes += n->port.ring_tunes;
+    held += n->port.hold_flushed;
+    expired += n->port.hold_expired;
+    holdfull += n->port.hold_full;
+    rejoin += n->port.rejoin_polls;
+    stale += n->port.tx_expired;
+    early += n->port.tok_early;
+    if (n->restarted && n->port.join_pending)
+      waiting++;
+    else if (n->restarted) {
+      joins++;
+      join_sum += n->port.join_ms;
+      if (n->port.join_ms > join_max)
+        join_max = n->port.join_ms;
+    }
+    retries += n->port.mnsm_hits[mtRetrySendToken];
+    usage += mstpUsageTimeout(&n->port, n->port.ns, n->port.Tusage_timeoutTP);
+    if ((n->port.ns < MSTP_PEERS) && n->port.peer[n->port.ns].usage_n) {
+      struct mstp_peer *p = &n->port.peer[n->port.ns];
+      usage_q += p->usage_q;
+      usage_nq++;
+      if (p->usage_q > usage_qmax)
+        usage_qmax = p->usage_q;
+    }
+    rxf[MSTP_RXF_ACCEPT] += n->port.rxf_hits[MSTP_RXF_ACCEPT];
+    rxf[MSTP_RXF_DROP] += n->port.rxf_hits[MSTP_RXF_DROP];
+    hdrcrc += n->port.numHdrCRCErrs;
+    datacrc += n->port.numDataCRCErrs;
+    fe += n->port.num_fe;
+    aborts += n->port.frame_abort_errors;
+  }
+  if (secs <= 0.0)
+    secs = 1e-9;
+
+  printf("mstpsim: %d nodes, %d baud, %.1f s simulated in %.2f s "
+         "(%.0fx real time), seed %llu\n",
+         nnodes, baud, now / 1e9, wall, wall > 0 ? now / 1e9 / wall : 0.0,
+         (unsigned long long)seed);
+  if (ring_formed >= 0)
+    printf("ring:     all %d nodes joined at %.3f s, %d joined at the end\n",
+           nnodes, ring_formed / 1e9, njoined);
+  else
+    printf("ring:     never complete, %d of %d nodes joined at the end\n",
+           njoined, nnodes);
+  printf("measured: %.1f s after %.1f s warm-up\n", secs, measure_start / 1e9);
+  printf("bus:      %.1f %% busy, %.1f frames/s, %.0f octets/s, "
+         "%lu collisions, %lu noise hits\n",
+         100.0 * busy_ns / (secs * 1e9), frames_on_wire / secs,
+         octets_on_wire / secs, collisions, noise_hits);
+  printf("tokens:   %.1f passed/s, %lu PFMs\n", tokens_passed / secs, pfms);
+  mstpRingMap(&nodes[0].port, &ring);
+  printf("map:      node 0 sees %u managers up to %u, %s, Nmax_manager %u "
+         "suggested, %u in use (%lu changes)\n",
+         ring.managers, ring.highest, ring.closed ? "closed" : "open",
+         ring.suggested, nodes[0].port.Nmax_manager, tunes);
+  hist_print("rotation:", &rotation);
+  printf("usage:    successor answers in %.1f ms (95th percentile, worst "
+         "%.1f), %.1f ms average timeout (%s), %lu token retries\n",
+         usage_nq ? usage_q / 16.0 / usage_nq : 0.0, usage_qmax / 16.0,
+         (double)usage / nnodes, usage_adapt ? "adaptive" : "fixed", retries);
+  if (custom_timing) {
+    struct mstp_timing *t = &nodes[0].port.timing;
+    printf("timing:   Npoll %u, Nretry_token %u, Nmin_octets %u, "
+           "Tframe_abort %u, Tno_token %u, Treply_timeout %u, Tslot %u ms, "
+           "tick %u us\n",
+           t->Npoll, t->Nretry_token, t->Nmin_octets, t->Tframe_abort,
+           t->Tno_token, t->Treply_timeout, t->Tslot, t->tick_us);
+  }
+  printf("use:      %.2f frames/token visit, %.1f %% full, "
+         "%.1f %% of the time waiting for replies (%s)\n",
+         visits ? (double)sent / visits : 0.0,
+         visits ? 100.0 * full / visits : 0.0,
+         100.0 * wait_ms / (now / 1e6), tx_sched ? "no reply first" : "FIFO");
+  printf("offered:  %.1f frames/s, %lu queued, %lu rejected, "
+         "%lu while not on the ring\n",
+         gen / secs, queued, rejected, offline);
+  if (test_pct)
+    printf("echo:     %lu test requests, %lu answered with their data, %lu "
+           "without\n",
+           echo_req, echo_full, echo_short);
+  if (jit_lead >= 0)
+    printf("notify:   %lu soon, %lu here, %lu tokens came first, %lu samples "
+           "coalesced, lead %d ms + 2 x %u ms jitter (node 0)\n",
+           jit_events[MSTP_TOK_SOON], jit_events[MSTP_TOK_HERE], early,
+           jit_coalesced, jit_lead, (unsigned)nodes[0].port.tok_dev);
+  if (tx_ttl)
+    printf("ttl:      %lu frames older than %d ms dropped unsent, whole run\n",
+           stale, tx_ttl);
+  printf("held:     %lu sent after joining, %lu too old, %lu refused "
+         "(-ENOBUFS), whole run\n",
+         held, expired, holdfull);
+  if (nrestarts)
+    printf("restart:  %d nodes restarted %s, %.1f ms average and %lu ms "
+           "worst time to join, %d never rejoined, %lu rejoin PFMs\n",
+           nrestarts, cold_restarts ? "cold" : "warm",
+           joins ? (double)join_sum / joins : 0.0, join_max, waiting, rejoin);
+  if (nkilled)
+    printf("dead:     %d nodes switched off, %lu requests refused by write(), "
+           "%lu dropped from the queue, %lu probes\n",
+           nkilled, unreachable, failed, probes);
+  printf("received: %.1f frames/s, %.1f bytes/s payload, %lu broadcast\n",
+         delivered / secs, delivered_bytes / secs, bcast_delivered);
+  hist_print("latency:", &latency);
+  if (tx_report) {
+    printf("txreport: %lu sent, %lu reply, %lu postponed, %lu timeout, "
+           "%lu no reply, %lu dropped, %lu expired, %lu bad cookies\n",
+           txr_outcomes[MSTP_TXR_SENT], txr_outcomes[MSTP_TXR_REPLY],
+           txr_outcomes[MSTP_TXR_POSTPONED], txr_outcomes[MSTP_TXR_TIMEOUT],
+           txr_outcomes[MSTP_TXR_NOREPLY], txr_outcomes[MSTP_TXR_DROPPED],
+           txr_outcomes[MSTP_TXR_EXPIRED], txr_badcookie);
+    hist_print("tx done:", &txdone);
+  }
+  if (drop_bcast)
+    printf("filter:   %lu data frames accepted, %lu broadcasts dropped "
+           "before allocation\n",
+           rxf[MSTP_RXF_ACCEPT], rxf[MSTP_RXF_DROP]);
+  printf("errors:   %lu header CRC, %lu data CRC, %lu framing, "
+         "%lu frame aborts\n",
+         hdrcrc, datacrc, fe, aborts);
+  if (tx_overflows)
+    printf("warning:  %lu frames lost, more than %d transmissions at once\n",
+           tx_overflows, SIM_MAX_TX);
+
+  if (!verbose)
+    return;
+  printf("\n mac  rate/s  generated  queued rejected offline  rx_frames "
+         "  tokens  state\n");
+  for (i = 0; i < nnodes; i++) {
+    struct sim_node *n = &nodes[i];
+    printf("%4d %7.1f %10lu %7lu %8lu %7lu %10lu %8lu  %d%s\n",
+           n->port.This_Station, n->rate, n->generated, n->queued,
+           n->rejected, n->offline, n->rx_frames, n->tokens, n->port.mnstate,
+           n->port.SoleManager ? " sole" : "");
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: mstpsim [options]\n"
+          "  -n nodes     number of nodes, MACs 0..n-1 (32, max 127)\n"
+          "  -b baud      9600, 19200, 38400, 57600, 76800, 115200 (76800)\n"
+          "  -t seconds   simulated time (60)\n"
+          "  -w seconds   warm-up excluded from the statistics (5)\n"
+          "  -m frames    Nmax_info_frames (1)\n"
+          "  -M mac       Nmax_manager (127)\n"
+          "  -u ms        Tusage_timeout (35)\n"
+          "  -e ber       bit error rate on the bus (0)\n"
+          "  -r rate      frames per second offered by each node (10)\n"
+          "  -s min[:max] payload size range in octets (64:480)\n"
+          "  -d percent   share of DataExpectingReply frames (0)\n"
+          "  -B percent   share of broadcasts (0)\n"
+          "  -N mac:rate[:min[:max]]  per node traffic, repeatable\n"
+          "  -k mac[:seconds]  switch a node off (at 0), repeatable\n"
+          "  -W mac:seconds[:ms]  close and reopen a node's port, down for ms\n"
+          "               (100), repeatable\n"
+          "  -C           -W restarts start cold, forgetting the ring\n"
+          "  -c           transmit reports, write() to the uart being empty\n"
+          "  -L ms        drop frames queued longer than that unsent (0 never)\n"
+          "  -J ms        write samples when the token is that close, not at once\n"
+          "  -E percent   share of unicast frames sent as TestRequest (0)\n"
+          "  -p timeouts  reply timeouts before a peer is dead (3, 0 off)\n"
+          "  -o           send frames needing no reply first in a token visit\n"
+          "  -x           drop received broadcasts with the receive filter\n"
+          "  -R           set Nmax_manager from the ring map\n"
+          "  -a           wait for the successor as long as it needs\n"
+          "  -T name=value  timing, as in struct mstp_timing, repeatable\n"
+          "  -f octets    UART receive FIFO size (16)\n"
+          "  -S seed      random seed (1)\n"
+          "  -v           per node table\n");
+  exit(2);
+}
+
+static const struct {
+  const char *name;
+  size_t off;
+} timing_names[] = {
+    {"Npoll", offsetof(struct mstp_timing, Npoll)},
+    {"Nretry_token", offsetof(struct mstp_timing, Nretry_token)},
+    {"Nmin_octets", offsetof(struct mstp_timing, Nmin_octets)},
+    {"Tframe_abort", offsetof(struct mstp_timing, Tframe_abort)},
+    {"Tno_token", offsetof(struct mstp_timing, Tno_token)},
+    {"Treply_timeout", offsetof(struct mstp_timing, Treply_timeout)},
+    {"Treply_delay", offsetof(struct mstp_timing, Treply_delay)},
+    {"Tslot", offsetof(struct mstp_timing, Tslot)},
+    {"tick_us", offsetof(struct mstp_timing, tick_us)},
+};
+
+// -T name=value into t, false if there is no such name
+
+static bool parse_timing(const char *s, struct mstp_timing *t) {
+  const char *eq = strchr(s, '=');
+  size_t i;
+
+  if (!eq)
+    return false;
+  for (i = 0; i < sizeof(timing_names) / sizeof(timing_names[0]); i++)
+    if ((strlen(timing_names[i].name) == (size_t)(eq - s)) &&
+        !strncmp(s, timing_names[i].name, eq - s)) {
+      *(unsigned int *)((char *)t + timing_names[i].off) =
+          (unsigned int)strtoul(eq + 1, NULL, 0);
+      return true;
+    }
+  return false;
+}
+
+static void parse_size(const char *s, int *lo, int *hi) {
+  char *end;
+
+  *lo = (int)strtol(s, &end, 0);
+  *hi = (*end == ':') ? (int)strtol(end + 1, NULL, 0) : *lo;
+}
+
+static void clamp_size(int *lo, int *hi) {
+  if (*lo < SIM_MIN_PAYLOAD)
+    *lo = SIM_MIN_PAYLOAD;
+  if (*hi > SIM_MAX_PAYLOAD)
+    *hi = SIM_MAX_PAYLOAD;
+  if (*hi < *lo)
+    *hi = *lo;
+}
+
+// the configuration of every node, everything but the MAC address
+//
+// out:	false	the -T options were no good
+
+static bool node_setup(struct sim_node *n) {
+  mstpPortInit(&n->port);
+  if (mstpSetBaud(&n->port, baud) != baud) {
+    fprintf(stderr, "mstpsim: unsupported baud rate %d\n", baud);
+    return false;
+  }
+  mstpVarInit(&n->port, n->port.Tturnaround);
+  n->port.Nmax_info_frames = info_frames;
+  n->port.Nmax_manager = max_manager;
+  n->port.Tusage_timeout = tusage;
+  n->port.peer_timeouts = peer_timeouts;
+  n->port.tx_sched = tx_sched;
+  n->port.ring_tune = ring_tune;
+  n->port.usage_adapt = usage_adapt;
+  n->port.tx_report = tx_report;
+  n->port.tx_ttl = tx_ttl;
+  n->port.tok_notify = (jit_lead >= 0);
+  n->port.tok_lead = (jit_lead >= 0) ? jit_lead : 0;
+  if (drop_bcast) {
+    struct mstp_rx_filter f = {.nrules = 1};
+    f.rule[0].addressing = MSTP_RXF_BROADCAST;
+    f.rule[0].source = MSTP_RXF_ANY;
+    f.rule[0].verdict = MSTP_RXF_DROP;
+    mstpSetRxFilter(&n->port, &f);
+  }
+  if (ntimings) {
+    struct mstp_timing t = n->port.timing;
+    int j;
+    for (j = 0; j < ntimings; j++)
+      if (!parse_timing(timings[j], &t)) {
+        fprintf(stderr, "mstpsim: bad -T %s\n", timings[j]);
+        return false;
+      }
+    if (mstpSetTiming(&n->port, &t)) {
+      fprintf(stderr, "mstpsim: timing out of range\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// -W: the application closes the port, what mstp_close does
+
+static void node_restart(struct sim_node *n) {
+  struct mstp_port *port = &n->port;
+
+  mstpWarmSave(port, &n->warm);
+  n->down = true;
+  n->restarted = true;
+  Q_Empty(&port->receive_queue, Q_Size(&port->receive_queue));
+  Q_Empty(&port->send_queue, Q_Size(&port->send_queue));
+  Q_Empty(&port->hold_queue, Q_Size(&port->hold_queue));
+  mstpSetRxFilter(port, NULL);
+  ev_push(now + n->down_ms * NSEC_PER_MSEC, EV_UP, n->idx, 0);
+}
+
+// and opens it again, warm unless -C
+
+static void node_up(struct sim_node *n) {
+  node_setup(n); // the options were checked at startup
+  if (cold_restarts || !mstpWarmRestore(&n->port, &n->warm, 30000))
+    mstpSetStation(&n->port, (byte)n->idx);
+  n->down = false;
+  tick_schedule(n, tick_align(n, now));
+}
+
+int main(int argc, char **argv) {
+  const char *overrides[SIM_MAX_NODES], *kills[SIM_MAX_NODES];
+  const char *restarts[SIM_MAX_NODES];
+  int noverrides = 0;
+  struct timespec w0, w1;
+  sim_event ev;
+  s64 end;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "n:b:t:w:m:M:u:e:r:s:d:B:N:k:W:CcL:J:E:p:oxRaT:f:S:vh")) != -1) {
+    switch (c) {
+    case 'n':
+      nnodes = atoi(optarg);
+      break;
+    case 'b':
+      baud = atoi(optarg);
+      break;
+    case 't':
+      sim_seconds = atof(optarg);
+      break;
+    case 'w':
+      warmup_seconds = atof(optarg);
+      break;
+    case 'm':
+      info_frames = atoi(optarg);
+      break;
+    case 'M':
+      max_manager = atoi(optarg);
+      break;
+    case 'u':
+      tusage = atoi(optarg);
+      break;
+    case 'e':
+      ber = atof(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 's':
+      parse_size(optarg, &size_min, &size_max);
+      break;
+    case 'd':
+      der_pct = atoi(optarg);
+      break;
+    case 'B':
+      bcast_pct = atoi(optarg);
+      break;
+    case 'N':
+      if (noverrides < SIM_MAX_NODES)
+        overrides[noverrides++] = optarg;
+      break;
+    case 'k':
+      if (nkilled < SIM_MAX_NODES)
+        kills[nkilled++] = optarg;
+      break;
+    case 'W':
+      if (nrestarts < SIM_MAX_NODES)
+        restarts[nrestarts++] = optarg;
+      break;
+    case 'C':
+      cold_restarts = 1;
+      break;
+    case 'c':
+      tx_report = 1;
+      break;
+    case 'L':
+      tx_ttl = atoi(optarg);
+      break;
+    case 'E':
+      test_pct = atoi(optarg);
+      break;
+    case 'J':
+      jit_lead = atoi(optarg);
+      break;
+    case 'p':
+      peer_timeouts = atoi(optarg);
+      break;
+    case 'o':
+      tx_sched = MSTP_TXS_NOWAIT_FIRST;
+      break;
+    case 'x':
+      drop_bcast = 1;
+      break;
+    case 'R':
+      ring_tune = MSTP_RING_APPLY;
+      break;
+    case 'a':
+      usage_adapt = 1;
+      break;
+    case 'T':
+      if (ntimings < 16)
+        timings[ntimings++] = optarg;
+      custom_timing = 1;
+      break;
+    case 'f':
+      fifo = atoi(optarg);
+      break;
+    case 'S':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((nnodes < 1) || (nnodes > SIM_MAX_NODES) || (fifo < 1) ||
+      (sim_seconds <= 0.0) || (max_manager < 1) || (max_manager > 127)) {
+    usage();
+  }
+  if (nnodes > max_manager + 1) {
+    fprintf(stderr, "mstpsim: %d nodes do not fit under Nmax_manager %d\n",
+            nnodes, max_manager);
+    return 2;
+  }
+  if (warmup_seconds >= sim_seconds)
+    warmup_seconds = 0.0;
+  clamp_size(&size_min, &size_max);
+  rng = seed ? seed : 1;
+
+  octet_ns = 10LL * NSEC_PER_SEC / baud;
+  turnaround_ns = 40LL * NSEC_PER_SEC / baud;
+  hist_init(&rotation, 100000, 10 * NSEC_PER_SEC); // 0.1 ms bins
+  hist_init(&latency, NSEC_PER_MSEC, 60 * NSEC_PER_SEC);
+  hist_init(&txdone, NSEC_PER_MSEC, 60 * NSEC_PER_SEC);
+  if (mstpCoreInit()) {
+    fprintf(stderr, "mstpsim: out of memory\n");
+    return 1;
+  }
+
+  for (i = 0; i < nnodes; i++) {
+    struct sim_node *n = &nodes[i];
+    if (!node_setup(n))
+      return 2;
+    n->idx = i;
+    n->dies_at = -1;
+    n->phase = (s64)(rand01() * NSEC_PER_MSEC);
+    n->rate = rate;
+    n->size_min = size_min;
+    n->size_max = size_max;
+    mstpSetStation(&n->port, (byte)i);
+  }
+  for (i = 0; i < noverrides; i++) {
+    char *p;
+    int mac = (int)strtol(overrides[i], &p, 0);
+    struct sim_node *n;
+    if ((mac < 0) || (mac >= nnodes) || (*p != ':')) {
+      fprintf(stderr, "mstpsim: bad -N %s\n", overrides[i]);
+      return 2;
+    }
+    n = &nodes[mac];
+    n->rate = strtod(p + 1, &p);
+    if (*p == ':') {
+      parse_size(p + 1, &n->size_min, &n->size_max);
+      clamp_size(&n->size_min, &n->size_max);
+    }
+  }
+
+  for (i = 0; i < nkilled; i++) {
+    char *p;
+    int mac = (int)strtol(kills[i], &p, 0);
+    if ((mac < 0) || (mac >= nnodes) || ((*p != ':') && (*p != '\0'))) {
+      fprintf(stderr, "mstpsim: bad -k %s\n", kills[i]);
+      return 2;
+    }
+    nodes[mac].dies_at =
+        (*p == ':') ? (s64)(strtod(p + 1, NULL) * NSEC_PER_SEC) : 0;
+  }
+
+  for (i = 0; i < nrestarts; i++) {
+    char *p;
+    int mac = (int)strtol(restarts[i], &p, 0);
+    s64 at;
+    if ((mac < 0) || (mac >= nnodes) || (*p != ':')) {
+      fprintf(stderr, "mstpsim: bad -W %s\n", restarts[i]);
+      return 2;
+    }
+    at = (s64)(strtod(p + 1, &p) * NSEC_PER_SEC);
+    nodes[mac].down_ms = (*p == ':') ? strtol(p + 1, NULL, 0) : 100;
+    ev_push(at, EV_RESTART, mac, 0);
+  }
+
+  for (i = 0; i < nnodes; i++) {
+    tick_schedule(&nodes[i], nodes[i].phase);
+    gen_schedule(&nodes[i]);
+  }
+  if (warmup_seconds > 0.0)
+    ev_push((s64)(warmup_seconds * NSEC_PER_SEC), EV_WARMUP, 0, 0);
+  else
+    start_measuring();
+  end = (s64)(sim_seconds * NSEC_PER_SEC);
+
+  clock_gettime(CLOCK_MONOTONIC, &w0);
+  while (ev_pop(&ev) && (ev.t <= end)) {
+    now = ev.t;
+    switch (ev.kind) {
+    case EV_TICK:
+      if (ev.gen == nodes[ev.idx].tick_gen)
+        sim_tick(&nodes[ev.idx]);
+      break;
+    case EV_CHUNK:
+      sim_chunk(&txs[ev.idx]);
+      break;
+    case EV_GEN:
+      sim_generate(&nodes[ev.idx]);
+      break;
+    case EV_WARMUP:
+      start_measuring();
+      break;
+    case EV_RESTART:
+      node_restart(&nodes[ev.idx]);
+      break;
+    case EV_UP:
+      node_up(&nodes[ev.idx]);
+      break;
+    }
+  }
+  now = end;
+  clock_gettime(CLOCK_MONOTONIC, &w1);
+
+  report((w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9);
+  return 0;
+}